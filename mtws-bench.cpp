@@ -0,0 +1,645 @@
+// mtws-bench.cpp – load generator and benchmark suite for My Tiny Web Server
+// Everything runs over loopback, so results before and after a change can be compared directly.
+//
+//   ./mtws-bench -p 8080 -c 64 -d 10 --url /index.html
+//   ./mtws-bench -p 8080 -r 20000 -c 128 --url /a.css=3 --url /b.js=1
+//   ./mtws-bench --server ./mtws --scenario all > results.json
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <csignal>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+// Settings
+std::string g_host = "127.0.0.1";
+int g_port = 8080;
+int g_connections = 64;
+int g_threads = 0; // 0 = one per CPU, at most one per connection
+double g_rate = 0; // requests per second; 0 means closed loop
+double g_duration = 10;
+double g_warmup = 1;
+bool g_keepAlive = true;
+
+struct Url {
+    std::string path;
+    double weight;
+};
+
+void fail(const std::string& msg) {
+    std::cerr << "mtws-bench: " << msg << std::endl;
+    exit(1);
+}
+
+uint64_t nowMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// Latency histogram
+// Exact below 16us, then 16 linear sub-buckets per power of two (the same layout mtws uses)
+const int SUB_BUCKETS = 16;
+const int BUCKETS = 40 * SUB_BUCKETS;
+
+struct Histogram {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKETS);
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    static int bucketOf(uint64_t micros) {
+        if (micros < SUB_BUCKETS) return micros;
+        int exponent = 63 - __builtin_clzll(micros);
+        int bucket = (exponent - 3) * SUB_BUCKETS + ((micros >> (exponent - 4)) & (SUB_BUCKETS - 1));
+        return std::min(bucket, BUCKETS - 1);
+    }
+
+    static uint64_t bucketEnd(int bucket) {
+        if (bucket < SUB_BUCKETS) return bucket + 1;
+        int exponent = bucket / SUB_BUCKETS + 3;
+        uint64_t width = 1ULL << (exponent - 4);
+        return (SUB_BUCKETS + bucket % SUB_BUCKETS) * width + width;
+    }
+
+    void record(uint64_t micros) {
+        counts[bucketOf(micros)]++;
+        total++;
+        sum += micros;
+        max = std::max(max, micros);
+    }
+
+    void merge(const Histogram& other) {
+        for (int i = 0; i < BUCKETS; i++) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t percentile(double fraction) const {
+        if (total == 0) return 0;
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)(fraction * total + 0.5));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= target) return std::min(bucketEnd(i) - 1, max);
+        }
+        return max;
+    }
+};
+
+// Load generation
+struct Result {
+    Histogram latency;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t missed = 0; // open loop: requests that were due but never sent
+    uint64_t bytes = 0;
+    uint64_t statuses[600] = {};
+};
+
+enum class ReadState { HEAD, BODY };
+
+struct Client {
+    int fd = -1;
+    bool busy = false;
+    uint64_t started = 0; // when the request was due (open loop) or sent (closed loop)
+    std::string request;
+    size_t requestSent = 0;
+    std::string head;
+    ReadState state = ReadState::HEAD;
+    size_t bodyRemaining = 0;
+    bool closeAfter = false;
+    int status = 0;
+};
+
+struct Load {
+    std::vector<Url> urls;
+    std::vector<std::string> requests; // prebuilt request for each URL
+    std::vector<double> cumulative;    // cumulative weights for picking a URL
+};
+
+Load prepareLoad(const std::vector<Url>& urls) {
+    Load load;
+    load.urls = urls;
+    double total = 0;
+    for (const auto& url : urls) {
+        total += url.weight;
+        load.cumulative.push_back(total);
+        load.requests.push_back("GET " + url.path + " HTTP/1.1\r\nHost: " + g_host + "\r\nUser-Agent: mtws-bench\r\n" +
+                                (g_keepAlive ? "" : "Connection: close\r\n") + "\r\n");
+    }
+    return load;
+}
+
+int openConnection(int epollFd, Client& client, int index) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(g_port);
+    inet_pton(AF_INET, g_host.c_str(), &address.sin_addr);
+    // Loopback connects complete immediately, so a blocking connect keeps this simple
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u32 = index;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    client.fd = fd;
+    client.head.clear();
+    client.state = ReadState::HEAD;
+    return fd;
+}
+
+void closeClient(Client& client) {
+    if (client.fd >= 0) close(client.fd);
+    client.fd = -1;
+    client.busy = false;
+}
+
+// Returns false when the connection failed
+bool sendPending(Client& client) {
+    while (client.requestSent < client.request.size()) {
+        ssize_t sent = send(client.fd, client.request.data() + client.requestSent,
+                            client.request.size() - client.requestSent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        client.requestSent += sent;
+    }
+    return true;
+}
+
+bool startRequest(int epollFd, Client& client, int index, const std::string& request, uint64_t due) {
+    if (client.fd < 0 && openConnection(epollFd, client, index) < 0) return false;
+    client.busy = true;
+    client.started = due;
+    client.request = request;
+    client.requestSent = 0;
+    client.head.clear();
+    client.state = ReadState::HEAD;
+    return sendPending(client);
+}
+
+// Parse the status line and the headers we need once the head is complete
+bool parseHead(Client& client) {
+    if (client.head.compare(0, 5, "HTTP/") != 0) return false;
+    size_t space = client.head.find(' ');
+    if (space == std::string::npos) return false;
+    client.status = atoi(client.head.c_str() + space + 1);
+    client.bodyRemaining = 0;
+    client.closeAfter = false;
+
+    size_t position = client.head.find("\r\n") + 2;
+    while (position < client.head.size()) {
+        size_t end = client.head.find("\r\n", position);
+        if (end == std::string::npos || end == position) break;
+        std::string line = client.head.substr(position, end - position);
+        for (size_t i = 0; i < line.size() && line[i] != ':'; i++) line[i] = tolower(line[i]);
+        if (line.compare(0, 15, "content-length:") == 0) client.bodyRemaining = strtoull(line.c_str() + 15, nullptr, 10);
+        if (line.compare(0, 11, "connection:") == 0 && line.find("close") != std::string::npos) client.closeAfter = true;
+        position = end + 2;
+    }
+    if (client.status == 304 || client.status == 204) client.bodyRemaining = 0;
+    return true;
+}
+
+// Read what is available; returns 1 when a response completed, 0 to keep waiting, -1 on error
+int readResponse(Client& client, Result& result) {
+    char buffer[65536];
+    while (true) {
+        ssize_t n = read(client.fd, buffer, sizeof(buffer));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) return -1;
+        result.bytes += n;
+
+        size_t used = 0;
+        if (client.state == ReadState::HEAD) {
+            size_t before = client.head.size();
+            client.head.append(buffer, n);
+            size_t end = client.head.find("\r\n\r\n", before >= 3 ? before - 3 : 0);
+            if (end == std::string::npos) {
+                if (client.head.size() > 65536) return -1;
+                continue;
+            }
+            used = end + 4 - before;
+            client.head.resize(end + 4);
+            if (!parseHead(client)) return -1;
+            client.state = ReadState::BODY;
+        }
+        size_t body = std::min<size_t>(n - used, client.bodyRemaining);
+        client.bodyRemaining -= body;
+        if (client.bodyRemaining == 0) {
+            // Nothing is pipelined, so any extra bytes would be a protocol error
+            return used + body == (size_t)n ? 1 : -1;
+        }
+    }
+}
+
+void runThread(const Load& load, int connections, double rate, uint64_t start, uint64_t end, uint64_t measureFrom,
+               unsigned seed, Result& result) {
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<Client> clients(connections);
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> pick(0, load.cumulative.back());
+    auto nextRequest = [&]() -> const std::string& {
+        size_t index = std::lower_bound(load.cumulative.begin(), load.cumulative.end(), pick(random)) - load.cumulative.begin();
+        return load.requests[std::min(index, load.requests.size() - 1)];
+    };
+
+    // Open loop: requests are due at fixed intervals whether or not the server keeps up.
+    // Latency is measured from when a request was due, so a stalled server can't hide its backlog.
+    std::deque<uint64_t> due;
+    double interval = rate > 0 ? 1e6 / rate : 0;
+    double nextDue = start;
+
+    auto finish = [&](Client& client, bool ok) {
+        uint64_t now = nowMicros();
+        if (client.started >= measureFrom) {
+            if (ok) {
+                result.requests++;
+                result.latency.record(now - client.started);
+                if (client.status > 0 && client.status < 600) result.statuses[client.status]++;
+            } else {
+                result.errors++;
+            }
+        }
+        if (!ok || client.closeAfter || !g_keepAlive) {
+            closeClient(client);
+        }
+        client.busy = false;
+    };
+
+    auto dispatch = [&](uint64_t now) {
+        for (int i = 0; i < connections && now < end; i++) {
+            Client& client = clients[i];
+            if (client.busy) continue;
+            uint64_t when = now;
+            if (rate > 0) {
+                if (due.empty()) return;
+                when = due.front();
+                due.pop_front();
+            }
+            if (!startRequest(epollFd, client, i, nextRequest(), when)) finish(client, false);
+        }
+    };
+
+    epoll_event events[256];
+    while (true) {
+        uint64_t now = nowMicros();
+        if (now >= end) break;
+        if (rate > 0) {
+            while (nextDue <= now && nextDue < end) {
+                due.push_back((uint64_t)nextDue);
+                nextDue += interval;
+            }
+        }
+        dispatch(now);
+
+        int timeout = rate > 0 ? std::max(0, (int)((nextDue - nowMicros()) / 1000)) : 100;
+        int n = epoll_wait(epollFd, events, 256, std::min(timeout, 100));
+        for (int i = 0; i < n; i++) {
+            int index = events[i].data.u32;
+            Client& client = clients[index];
+            if (client.fd < 0 || !client.busy) {
+                // The server closing an idle keep-alive connection is not an error
+                if (client.fd >= 0 && (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) closeClient(client);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && !sendPending(client)) {
+                finish(client, false);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                int status = readResponse(client, result);
+                if (status != 0) finish(client, status > 0);
+            }
+        }
+    }
+    for (uint64_t when : due) {
+        if (when >= measureFrom) result.missed++;
+    }
+    for (auto& client : clients) closeClient(client);
+    close(epollFd);
+}
+
+Result runLoad(const std::vector<Url>& urls) {
+    Load load = prepareLoad(urls);
+    int threads = g_threads > 0 ? g_threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, g_connections);
+
+    uint64_t start = nowMicros();
+    uint64_t measureFrom = start + (uint64_t)(g_warmup * 1e6);
+    uint64_t end = measureFrom + (uint64_t)(g_duration * 1e6);
+    std::vector<Result> results(threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        int connections = g_connections / threads + (i < g_connections % threads ? 1 : 0);
+        double rate = g_rate * connections / g_connections;
+        workers.emplace_back(runThread, std::cref(load), connections, rate, start, end, measureFrom, 1234 + i, std::ref(results[i]));
+    }
+    for (auto& worker : workers) worker.join();
+
+    Result total;
+    for (const auto& result : results) {
+        total.latency.merge(result.latency);
+        total.requests += result.requests;
+        total.errors += result.errors;
+        total.missed += result.missed;
+        total.bytes += result.bytes;
+        for (int status = 0; status < 600; status++) total.statuses[status] += result.statuses[status];
+    }
+    return total;
+}
+
+std::string resultJson(const std::string& scenario, const Result& result) {
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer),
+             "{\"scenario\": \"%s\", \"mode\": \"%s\", \"connections\": %d, \"rate\": %.0f, \"keep_alive\": %s, "
+             "\"duration_s\": %.1f, \"requests\": %llu, \"errors\": %llu, \"missed\": %llu, \"throughput_rps\": %.1f, \"throughput_mib_s\": %.2f, "
+             "\"latency_us\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu, \"mean\": %.1f}, \"status\": {",
+             scenario.c_str(), g_rate > 0 ? "open" : "closed", g_connections, g_rate, g_keepAlive ? "true" : "false",
+             g_duration, (unsigned long long)result.requests, (unsigned long long)result.errors, (unsigned long long)result.missed,
+             result.requests / g_duration, result.bytes / g_duration / (1024 * 1024),
+             (unsigned long long)result.latency.percentile(0.5), (unsigned long long)result.latency.percentile(0.9),
+             (unsigned long long)result.latency.percentile(0.99), (unsigned long long)result.latency.percentile(0.999),
+             (unsigned long long)result.latency.max, result.latency.total ? (double)result.latency.sum / result.latency.total : 0.0);
+    std::string json = buffer;
+    bool first = true;
+    for (int status = 0; status < 600; status++) {
+        if (result.statuses[status] == 0) continue;
+        json += (first ? "\"" : ", \"") + std::to_string(status) + "\": " + std::to_string(result.statuses[status]);
+        first = false;
+    }
+    return json + "}}";
+}
+
+// Canned scenarios
+// A generated web root served by a freshly started server, so every run sees the same files
+struct Scenario {
+    const char* name;
+    const char* description;
+    std::vector<Url> urls;
+    int connections; // 0 keeps -c
+};
+
+void writeFile(const std::string& path, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) fail("could not create " + path);
+    std::string chunk(std::min<size_t>(size, 1 << 20), 'x');
+    for (size_t i = 0; i < chunk.size(); i++) chunk[i] = "abcdefghijklmnopqrstuvwxyz\n"[i % 27];
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, chunk.data(), std::min(chunk.size(), size - written));
+        if (n <= 0) fail("could not write " + path);
+        written += n;
+    }
+    close(fd);
+}
+
+std::vector<Scenario> buildWebRoot(const std::string& root) {
+    std::vector<Scenario> scenarios;
+
+    mkdir((root + "/small").c_str(), 0755);
+    Scenario small{"small", "1000 files of 1-8 KiB", {}, 0};
+    for (int i = 0; i < 1000; i++) {
+        std::string name = "/small/file" + std::to_string(i) + ".html";
+        writeFile(root + name, 1024 + (i * 7919) % 7168);
+        small.urls.push_back(Url{name, 1});
+    }
+    scenarios.push_back(small);
+
+    mkdir((root + "/large").c_str(), 0755);
+    Scenario large{"large", "4 files of 16 MiB", {}, 8};
+    for (int i = 0; i < 4; i++) {
+        std::string name = "/large/blob" + std::to_string(i) + ".bin";
+        writeFile(root + name, 16 << 20);
+        large.urls.push_back(Url{name, 1});
+    }
+    scenarios.push_back(large);
+
+    mkdir((root + "/listing").c_str(), 0755);
+    for (int i = 0; i < 10000; i++) {
+        writeFile(root + "/listing/entry" + std::to_string(i) + ".txt", 0);
+    }
+    scenarios.push_back(Scenario{"explorer", "explorer listing of a 10000-entry directory", {{"/listing/", 1}}, 0});
+
+    Scenario notFound{"404", "requests for missing files", {}, 0};
+    for (int i = 0; i < 1000; i++) {
+        notFound.urls.push_back(Url{"/missing/page" + std::to_string(i) + ".html", 1});
+    }
+    scenarios.push_back(notFound);
+    return scenarios;
+}
+
+void removeTree(const std::string& path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("rm", "rm", "-rf", path.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    if (pid > 0) waitpid(pid, nullptr, 0);
+}
+
+int freePort() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(fd, (sockaddr*)&address, sizeof(address)) < 0 || getsockname(fd, (sockaddr*)&address, &length) < 0) {
+        fail("could not find a free port");
+    }
+    close(fd);
+    return ntohs(address.sin_port);
+}
+
+struct ServerProcess {
+    pid_t pid = -1;
+    int console = -1; // the server's stdin, used to send "stop"
+};
+
+ServerProcess startServer(const std::string& binary, const std::string& root, const std::vector<std::string>& extraArgs) {
+    std::string absolute = binary;
+    if (absolute.find('/') != std::string::npos && absolute[0] != '/') {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd))) absolute = std::string(cwd) + "/" + absolute;
+    }
+    g_port = freePort();
+
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) < 0) fail("pipe failed");
+    ServerProcess server;
+    server.pid = fork();
+    if (server.pid == 0) {
+        dup2(pipeFds[0], STDIN_FILENO);
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        if (chdir(root.c_str()) < 0) _exit(127);
+        std::vector<std::string> args = {absolute, "-p", std::to_string(g_port), "--max-requests", "1000000"};
+        args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+        std::vector<char*> argv;
+        for (auto& arg : args) argv.push_back(&arg[0]);
+        argv.push_back(nullptr);
+        execv(absolute.c_str(), argv.data());
+        _exit(127);
+    }
+    close(pipeFds[0]);
+    server.console = pipeFds[1];
+
+    // Wait until it accepts connections
+    for (int attempt = 0; attempt < 100; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(g_port);
+        inet_pton(AF_INET, g_host.c_str(), &address.sin_addr);
+        bool up = connect(fd, (sockaddr*)&address, sizeof(address)) == 0;
+        close(fd);
+        if (up) return server;
+        if (waitpid(server.pid, nullptr, WNOHANG) == server.pid) fail("server exited during startup");
+        usleep(50000);
+    }
+    fail("server did not start listening");
+    return server;
+}
+
+void stopServer(ServerProcess& server) {
+    ssize_t ignored = write(server.console, "stop\n", 5);
+    (void)ignored;
+    close(server.console);
+    for (int attempt = 0; attempt < 50; attempt++) {
+        if (waitpid(server.pid, nullptr, WNOHANG) == server.pid) return;
+        usleep(100000);
+    }
+    kill(server.pid, SIGKILL);
+    waitpid(server.pid, nullptr, 0);
+}
+
+void printUsage() {
+    std::cerr <<
+        "Usage: mtws-bench [options]\n"
+        "  -p <port>             port of a running server on 127.0.0.1 (default 8080)\n"
+        "  -c <connections>      concurrent connections (default 64)\n"
+        "  -r <rate>             open loop at <rate> requests/s; without it the load is closed loop\n"
+        "  -d <seconds>          measured duration (default 10)\n"
+        "  -w <seconds>          warm-up before measuring (default 1)\n"
+        "  -t <threads>          load generator threads (default: one per CPU)\n"
+        "  --url <path>[=weight] URL to request, can be repeated to build a weighted mix (default /)\n"
+        "  --no-keepalive        open a new connection for every request\n"
+        "  --server <binary>     start this server on a generated web root instead of using -p\n"
+        "  --server-arg <arg>    extra argument for the started server, can be repeated\n"
+        "  --scenario <name>     small, large, explorer, 404 or all (needs --server)\n"
+        "Results are printed as JSON.\n";
+}
+
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<Url> urls;
+    std::string serverBinary;
+    std::vector<std::string> serverArgs;
+    std::string scenarioName;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) fail("flag " + arg + " needs a value");
+            return argv[++i];
+        };
+        try {
+            if (arg == "-p") g_port = std::stoi(value());
+            else if (arg == "-c") g_connections = std::stoi(value());
+            else if (arg == "-r") g_rate = std::stod(value());
+            else if (arg == "-d") g_duration = std::stod(value());
+            else if (arg == "-w") g_warmup = std::stod(value());
+            else if (arg == "-t") g_threads = std::stoi(value());
+            else if (arg == "--no-keepalive") g_keepAlive = false;
+            else if (arg == "--server") serverBinary = value();
+            else if (arg == "--server-arg") serverArgs.push_back(value());
+            else if (arg == "--scenario") scenarioName = value();
+            else if (arg == "--url") {
+                std::string url = value();
+                size_t equals = url.rfind('=');
+                double weight = 1;
+                if (equals != std::string::npos && equals > url.rfind('/')) {
+                    weight = std::stod(url.substr(equals + 1));
+                    url.resize(equals);
+                }
+                if (url.empty() || url[0] != '/' || weight <= 0) fail("invalid --url " + url);
+                urls.push_back(Url{url, weight});
+            } else if (arg == "-h" || arg == "--help") {
+                printUsage();
+                return 0;
+            } else {
+                printUsage();
+                fail("unknown flag " + arg);
+            }
+        } catch (const std::exception& e) {
+            fail("invalid value for " + arg);
+        }
+    }
+    if (g_connections < 1 || g_duration <= 0 || g_warmup < 0 || g_rate < 0) fail("invalid load settings");
+    if (!scenarioName.empty() && serverBinary.empty()) fail("--scenario needs --server");
+
+    if (serverBinary.empty()) {
+        if (urls.empty()) urls.push_back(Url{"/", 1});
+        std::cout << resultJson("custom", runLoad(urls)) << std::endl;
+        return 0;
+    }
+
+    char rootTemplate[] = "/tmp/mtws-bench-XXXXXX";
+    if (!mkdtemp(rootTemplate)) fail("could not create a web root");
+    std::string root = rootTemplate;
+    std::cerr << "Generating web root in " << root << std::endl;
+    std::vector<Scenario> scenarios = buildWebRoot(root);
+    if (scenarioName.empty() && !urls.empty()) scenarios = {Scenario{"custom", "given URLs", urls, 0}};
+    else if (scenarioName.empty()) scenarioName = "all";
+
+    std::vector<std::string> results;
+    int connections = g_connections;
+    for (const auto& scenario : scenarios) {
+        if (scenarioName != "all" && scenarioName != scenario.name && std::string(scenario.name) != "custom") continue;
+        // Every scenario gets a fresh server so caches and counters start out the same
+        ServerProcess server = startServer(serverBinary, root, serverArgs);
+        g_connections = scenario.connections > 0 ? std::min(scenario.connections, connections) : connections;
+        std::cerr << "Running " << scenario.name << " (" << scenario.description << ")" << std::endl;
+        results.push_back(resultJson(scenario.name, runLoad(scenario.urls)));
+        stopServer(server);
+    }
+    removeTree(root);
+    if (results.empty()) fail("unknown scenario " + scenarioName);
+
+    std::cout << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        std::cout << "  " << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    std::cout << "]" << std::endl;
+    return 0;
+}
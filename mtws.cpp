@@ -5,36 +5,346 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
 #include <filesystem>
 #include <thread>
 #include <chrono>
-#include <regex>
 #include <csignal>
 #include <cstring>
+#include <strings.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dlfcn.h>
 #include <arpa/inet.h>
 #include <netdb.h>  // Added for gethostbyname
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <sys/resource.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <climits>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <pthread.h>
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <memory>
+#include <algorithm>
+#include <deque>
+#include <shared_mutex>
+#include <memory_resource>
+#include <unordered_map>
+#include <unordered_set>
+#include <list>
+#include <map>
+#include <functional>
+#ifdef MTWS_WITH_GZIP
+#include <zlib.h>
+#endif
+#ifdef MTWS_WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef MTWS_WITH_ZSTD
+#include <zstd.h>
+#endif
+#include "mtws_plugin.h"
 
 namespace fs = std::filesystem;
 
 // Global variables for server control
 std::atomic<bool> g_running(true);
 std::atomic<bool> g_restart(false);
+std::atomic<bool> g_draining(false); // stop accepting and let open connections finish, then restart
+std::atomic<bool> g_upgrade(false); // ... and re-execute the binary instead of restarting in place
+std::atomic<bool> g_shutdownSignalled(false);
 std::mutex g_mutex;
 std::condition_variable g_cv;
-std::vector<std::string> g_plugins; // Placeholder for plugins
 int g_port = 80; // Global port variable
+std::vector<int> g_listenFds; // one per worker, kept open across restarts and handed on by an upgrade
+std::string g_executable; // the binary an upgrade starts
+const char* LISTEN_FDS_ENV = "MTWS_LISTEN_FDS"; // tells an upgraded binary which listening sockets it inherited
+
+// Worker settings
+const int MAX_WORKERS = 256;
+int g_workerCount = 1; // 0 means one worker per available CPU
+bool g_pinWorkers = false;
+// Per-worker eventfds that wake the event loops when g_running changes. Each one is created the first time
+// its worker slot is used and stays open across restarts, so a waker never writes to a closed or reused fd;
+// g_wakeFdCount only grows and is raised after the fd is stored.
+int g_wakeFds[MAX_WORKERS];
+std::atomic<int> g_wakeFdCount(0);
+
+// Connection settings
+int g_keepAliveTimeout = 5; // seconds an idle keep-alive connection is kept open
+int g_headerTimeout = 10; // seconds a client has to send a complete request head
+int g_bodyTimeout = 30; // seconds a request body may go without any new data
+int g_sendTimeout = 30; // seconds a client may go without accepting any output
+int g_drainTimeout = 10; // seconds a graceful restart waits for open connections
+int g_maxKeepAliveRequests = 100; // requests served on one connection before it is closed
+int g_listenBacklog = 4096; // connections the kernel queues for accepting (capped by net.core.somaxconn)
+bool g_ioUring = false; // --io-engine io_uring; cleared at startup if the kernel lacks support
+
+// Reverse proxy: requests for paths that are not on disk are forwarded to the --proxy servers
+struct Upstream {
+    std::string name; // as given on the command line
+    std::string host; // for requests that came without a Host header
+    sockaddr_storage address{};
+    socklen_t addressLength = 0;
+    std::atomic<int> active{0}; // requests it is answering, over all workers
+    std::atomic<int> failures{0}; // failed attempts in a row
+    std::atomic<time_t> downUntil{0}; // passed over until then (monotonic seconds)
+};
+std::vector<std::unique_ptr<Upstream>> g_upstreams;
+bool g_proxyLeastConnections = false; // --proxy-balance least-conn; round robin otherwise
+int g_proxyTimeout = 60; // seconds an upstream may take to answer or stay silent in the middle of it
 
 // Logging
+// log() never blocks on output: every thread appends whole lines to its own lock-free rings and a
+// background thread writes all rings out with writev. A line that does not fit is dropped and counted.
 enum class LogLevel { INFO, WARN, ERROR, FATAL };
 
+const size_t LOG_CONSOLE_RING = 64 * 1024;  // both sizes must be powers of two
+const size_t LOG_ACCESS_RING = 256 * 1024;
+const int LOG_FLUSH_INTERVAL_MS = 10;
+int g_accessLogFd = -1; // -1 when access logging is off
+bool g_accessLogCombined = true; // Combined Log Format, otherwise Common Log Format
+std::atomic<uint64_t> g_logDropped(0);
+std::atomic<uint64_t> g_logSequence(0); // orders console lines across threads
+
+// Single-producer single-consumer byte ring; head and tail only grow, and head only ever moves past complete lines
+struct LogRing {
+    alignas(64) std::atomic<size_t> head{0}; // advanced by the owning thread
+    alignas(64) std::atomic<size_t> tail{0}; // advanced by the log writer
+    size_t capacity;
+    std::unique_ptr<char[]> data;
+    
+    explicit LogRing(size_t capacity) : capacity(capacity), data(new char[capacity]) {}
+    
+    void copyIn(size_t position, const void* source, size_t length) {
+        size_t offset = position & (capacity - 1);
+        size_t first = std::min(length, capacity - offset);
+        memcpy(&data[offset], source, first);
+        memcpy(&data[0], static_cast<const char*>(source) + first, length - first);
+    }
+    
+    void copyOut(size_t position, void* target, size_t length) const {
+        size_t offset = position & (capacity - 1);
+        size_t first = std::min(length, capacity - offset);
+        memcpy(target, &data[offset], first);
+        memcpy(static_cast<char*>(target) + first, &data[0], length - first);
+    }
+    
+    // Append a line, optionally preceded by a small binary header
+    bool push(const char* text, size_t length, const void* header = nullptr, size_t headerLength = 0) {
+        size_t position = head.load(std::memory_order_relaxed);
+        if (headerLength + length > capacity - (position - tail.load(std::memory_order_acquire))) {
+            g_logDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (headerLength > 0) copyIn(position, header, headerLength);
+        copyIn(position + headerLength, text, length);
+        head.store(position + headerLength + length, std::memory_order_release);
+        return true;
+    }
+};
+
+// Console lines carry a sequence number so lines from different threads come out in the order they were logged
+struct ConsoleRecord {
+    uint64_t sequence;
+    uint32_t length;
+};
+
+// The rings of one thread. They are recycled when the thread exits, so restarts don't leak them.
+struct ThreadLog {
+    LogRing console{LOG_CONSOLE_RING};
+    LogRing access{LOG_ACCESS_RING};
+    bool owned = false; // guarded by g_logRingsMutex
+};
+
+std::mutex g_logRingsMutex;
+std::vector<ThreadLog*> g_logRings;
+std::mutex g_logWriterMutex; // held by whoever drains the rings, so there is only ever one consumer
+
+struct ThreadLogHandle {
+    ThreadLog* log = nullptr;
+    
+    ThreadLogHandle() {
+        std::lock_guard<std::mutex> lock(g_logRingsMutex);
+        for (ThreadLog* candidate : g_logRings) {
+            if (!candidate->owned) {
+                log = candidate;
+                break;
+            }
+        }
+        if (!log) {
+            log = new ThreadLog();
+            g_logRings.push_back(log);
+        }
+        log->owned = true;
+    }
+    
+    ~ThreadLogHandle() {
+        std::lock_guard<std::mutex> lock(g_logRingsMutex);
+        log->owned = false;
+    }
+};
+
+ThreadLog& threadLog() {
+    thread_local ThreadLogHandle handle;
+    return *handle.log;
+}
+
+// Formatted timestamps, refreshed at most once per second per thread
+struct LogClock {
+    time_t second = -1;
+    char time[16];   // 13:55:36
+    char common[32]; // 10/Oct/2000:13:55:36 -0700
+};
+
+const LogClock& logClock() {
+    thread_local LogClock clock;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if (now.tv_sec != clock.second) {
+        tm local;
+        localtime_r(&now.tv_sec, &local);
+        strftime(clock.time, sizeof(clock.time), "%H:%M:%S", &local);
+        strftime(clock.common, sizeof(clock.common), "%d/%b/%Y:%H:%M:%S %z", &local);
+        clock.second = now.tv_sec;
+    }
+    return clock;
+}
+
+void writeAll(int fd, std::vector<iovec>& iov) {
+    size_t index = 0;
+    while (index < iov.size()) {
+        ssize_t written = writev(fd, &iov[index], std::min<size_t>(iov.size() - index, IOV_MAX));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return; // nowhere left to report this
+        }
+        // Skip what was written, including a partly written buffer
+        while (index < iov.size() && (size_t)written >= iov[index].iov_len) {
+            written -= iov[index].iov_len;
+            index++;
+        }
+        if (index < iov.size()) {
+            iov[index].iov_base = static_cast<char*>(iov[index].iov_base) + written;
+            iov[index].iov_len -= written;
+        }
+    }
+}
+
+// Add the unread part of a ring to 'iov'; returns the position up to which it was collected
+size_t collectRing(LogRing& ring, std::vector<iovec>& iov) {
+    size_t head = ring.head.load(std::memory_order_acquire);
+    size_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (head == tail) return head;
+    size_t offset = tail & (ring.capacity - 1);
+    size_t first = std::min(head - tail, ring.capacity - offset);
+    iov.push_back(iovec{&ring.data[offset], first});
+    if (head - tail > first) iov.push_back(iovec{&ring.data[0], head - tail - first});
+    return head;
+}
+
+struct ConsoleLine {
+    uint64_t sequence;
+    size_t offset; // into the text buffer, which may still grow while lines are collected
+    size_t length;
+};
+
+// Copy the unread console lines of a ring out, tagged with their sequence numbers
+size_t collectConsole(LogRing& ring, std::string& text, std::vector<ConsoleLine>& lines) {
+    size_t head = ring.head.load(std::memory_order_acquire);
+    size_t position = ring.tail.load(std::memory_order_relaxed);
+    while (position < head) {
+        ConsoleRecord record;
+        ring.copyOut(position, &record, sizeof(record));
+        size_t start = text.size();
+        text.resize(start + record.length);
+        ring.copyOut(position + sizeof(record), &text[start], record.length);
+        lines.push_back(ConsoleLine{record.sequence, start, record.length});
+        position += sizeof(record) + record.length;
+    }
+    return head;
+}
+
+// Write everything logged so far. Called by the writer thread, and directly before the process exits.
+void flushLogs() {
+    std::lock_guard<std::mutex> writer(g_logWriterMutex);
+    std::vector<ThreadLog*> rings;
+    {
+        std::lock_guard<std::mutex> lock(g_logRingsMutex);
+        rings = g_logRings;
+    }
+    
+    std::string consoleText;
+    std::vector<ConsoleLine> consoleLines;
+    std::vector<iovec> access;
+    std::vector<size_t> consoleHeads, accessHeads;
+    for (ThreadLog* ring : rings) {
+        consoleHeads.push_back(collectConsole(ring->console, consoleText, consoleLines));
+        accessHeads.push_back(collectRing(ring->access, access));
+    }
+    if (!consoleLines.empty()) {
+        std::sort(consoleLines.begin(), consoleLines.end(), 
+                  [](const ConsoleLine& a, const ConsoleLine& b) { return a.sequence < b.sequence; });
+        std::vector<iovec> console;
+        for (const auto& line : consoleLines) {
+            console.push_back(iovec{&consoleText[line.offset], line.length});
+        }
+        writeAll(STDOUT_FILENO, console);
+    }
+    if (!access.empty() && g_accessLogFd >= 0) writeAll(g_accessLogFd, access);
+    for (size_t i = 0; i < rings.size(); i++) {
+        rings[i]->console.tail.store(consoleHeads[i], std::memory_order_release);
+        rings[i]->access.tail.store(accessHeads[i], std::memory_order_release);
+    }
+}
+
+void log(LogLevel level, const std::string& msg);
+
+void logWriter() {
+    uint64_t reportedDrops = 0;
+    time_t lastReport = 0;
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        flushLogs();
+        
+        time_t now = time(nullptr);
+        uint64_t dropped = g_logDropped.load(std::memory_order_relaxed);
+        if (dropped != reportedDrops && now != lastReport) {
+            log(LogLevel::WARN, std::to_string(dropped - reportedDrops) + " log lines dropped because logging fell behind");
+            reportedDrops = dropped;
+            lastReport = now;
+        }
+    }
+}
+
+void startLogging() {
+    std::thread(logWriter).detach();
+}
+
 void log(LogLevel level, const std::string& msg) {
     const char* levelStr = "INFO";
     const char* color = "\033[37m";
@@ -44,544 +354,5813 @@ void log(LogLevel level, const std::string& msg) {
         case LogLevel::ERROR: levelStr = "ERROR"; color = "\033[31m"; break;
         case LogLevel::FATAL: levelStr = "FATAL"; color = "\033[35m"; break;
     }
-    time_t now = time(nullptr);
-    tm* local = localtime(&now);
-    char timebuf[10];
-    strftime(timebuf, sizeof(timebuf), "%H:%M:%S", local);
     
-    std::lock_guard<std::mutex> lock(g_mutex);
-    std::cout << color << "[ " << timebuf << " = " << levelStr << " ] " << msg << "\033[0m" << std::endl;
+    thread_local std::string line;
+    line.clear();
+    line += color;
+    line += "[ ";
+    line += logClock().time;
+    line += " = ";
+    line += levelStr;
+    line += " ] ";
+    line += msg;
+    line += "\033[0m\n";
+    ConsoleRecord record{g_logSequence.fetch_add(1, std::memory_order_relaxed), (uint32_t)line.size()};
+    threadLog().console.push(line.data(), line.size(), &record, sizeof(record));
+    
+    if (level == LogLevel::FATAL) {
+        g_running = false;
+        g_cv.notify_all();
+        flushLogs();
+        exit(1);
+    }
+}
+
+// Queue one finished access log line (including the newline)
+void logAccessLine(const std::string& line) {
+    threadLog().access.push(line.data(), line.size());
+}
+
+// Wake every event loop so it notices g_running; safe to call from signal handlers
+void wakeServer() {
+    int count = g_wakeFdCount;
+    for (int i = 0; i < count; i++) {
+        uint64_t one = 1;
+        ssize_t ignored = write(g_wakeFds[i], &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+// Signal handler for graceful shutdown
+void signalHandler(int signum) {
+    if (signum == SIGINT) {
+        g_shutdownSignalled = true; // logged by runServer; logging is not safe in a signal handler
+        g_running = false;
+        g_cv.notify_all();
+        wakeServer();
+    }
+}
+
+std::string_view trimWhitespace(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+    return value;
+}
+
+// File types
+// The extension of a file decides its Content-Type and its icon in the explorer. The built-in types sit in
+// a perfect hash table laid out at compile time, so a lookup is one hash, one probe and one compare and
+// never allocates. Extensions it does not know are looked up in the system's mime.types.
+struct FileKind {
+    std::string_view mimeType;
+    const char* icon; // a symbol in EXPLORER_ICONS
+};
+
+const FileKind UNKNOWN_FILE_KIND = {"text/plain", "i-file"};
+
+struct BuiltinType {
+    std::string_view extension; // lower case, without the dot
+    FileKind kind;
+};
+
+// Source files are sent as text/plain so browsers show them instead of downloading them
+constexpr BuiltinType BUILTIN_TYPES[] = {
+    {"html", {"text/html", "i-html"}}, {"htm", {"text/html", "i-html"}},
+    {"css", {"text/css", "i-css"}},
+    {"js", {"application/javascript", "i-js"}}, {"mjs", {"application/javascript", "i-js"}},
+    {"json", {"application/json", "i-file"}}, {"map", {"application/json", "i-file"}},
+    {"webmanifest", {"application/manifest+json", "i-file"}},
+    {"xml", {"application/xml", "i-file"}}, {"txt", {"text/plain", "i-file"}},
+    {"md", {"text/plain", "i-file"}}, {"csv", {"text/csv", "i-file"}},
+    {"c", {"text/plain", "i-cpp"}}, {"h", {"text/plain", "i-cpp"}}, {"cc", {"text/plain", "i-cpp"}},
+    {"cpp", {"text/plain", "i-cpp"}}, {"hpp", {"text/plain", "i-cpp"}},
+    {"png", {"image/png", "i-image"}}, {"jpg", {"image/jpeg", "i-image"}}, {"jpeg", {"image/jpeg", "i-image"}},
+    {"gif", {"image/gif", "i-image"}}, {"svg", {"image/svg+xml", "i-image"}}, {"webp", {"image/webp", "i-image"}},
+    {"avif", {"image/avif", "i-image"}}, {"bmp", {"image/bmp", "i-image"}}, {"ico", {"image/x-icon", "i-image"}},
+    {"wasm", {"application/wasm", "i-file"}},
+    {"woff", {"font/woff", "i-file"}}, {"woff2", {"font/woff2", "i-file"}},
+    {"ttf", {"font/ttf", "i-file"}}, {"otf", {"font/otf", "i-file"}},
+    {"pdf", {"application/pdf", "i-pdf"}},
+    {"mp4", {"video/mp4", "i-video"}}, {"webm", {"video/webm", "i-video"}}, {"mov", {"video/quicktime", "i-video"}},
+    {"ogv", {"video/ogg", "i-video"}},
+    {"mp3", {"audio/mpeg", "i-audio"}}, {"wav", {"audio/wav", "i-audio"}}, {"ogg", {"audio/ogg", "i-audio"}},
+    {"oga", {"audio/ogg", "i-audio"}}, {"opus", {"audio/ogg", "i-audio"}}, {"flac", {"audio/flac", "i-audio"}},
+    {"m4a", {"audio/mp4", "i-audio"}},
+    {"zip", {"application/zip", "i-archive"}}, {"rar", {"application/vnd.rar", "i-archive"}},
+    {"tar", {"application/x-tar", "i-archive"}}, {"gz", {"application/gzip", "i-archive"}},
+    {"tgz", {"application/gzip", "i-archive"}}, {"7z", {"application/x-7z-compressed", "i-archive"}},
+    {"zst", {"application/zstd", "i-archive"}},
+};
+constexpr size_t BUILTIN_TYPE_COUNT = sizeof(BUILTIN_TYPES) / sizeof(BUILTIN_TYPES[0]);
+constexpr size_t BUILTIN_TYPE_SLOTS = 256; // a power of two; roomy enough that a seed is found quickly
+static_assert(BUILTIN_TYPE_COUNT < 255, "slots hold an 8-bit index");
+
+constexpr char lowerAscii(char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// FNV-1a over the lower-cased extension, varied by 'seed'. Its low bits only depend on the low bits of
+// the input, so the result is mixed once more before tables take their slot from them.
+constexpr uint32_t hashExtension(std::string_view extension, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : extension) hash = (hash ^ (unsigned char)lowerAscii(c)) * 16777619u;
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    return hash;
+}
+
+struct BuiltinTypeTable {
+    uint32_t seed = 0;
+    uint8_t slots[BUILTIN_TYPE_SLOTS] = {}; // index + 1 into BUILTIN_TYPES, 0 if empty
+};
+
+// Try seeds until every extension gets a slot of its own
+constexpr BuiltinTypeTable buildBuiltinTypeTable() {
+    for (uint32_t seed = 0;; seed++) {
+        BuiltinTypeTable table{};
+        table.seed = seed;
+        bool collision = false;
+        for (size_t i = 0; i < BUILTIN_TYPE_COUNT && !collision; i++) {
+            uint8_t& slot = table.slots[hashExtension(BUILTIN_TYPES[i].extension, seed) & (BUILTIN_TYPE_SLOTS - 1)];
+            collision = slot != 0;
+            slot = i + 1;
+        }
+        if (!collision) return table;
+    }
+}
+constexpr BuiltinTypeTable BUILTIN_TYPE_TABLE = buildBuiltinTypeTable();
+
+// Extensions from a mime.types file ("type ext ext ..." per line). Filled once at startup, before any
+// worker runs, and only read afterwards; open addressing keeps a lookup within one or two cache lines.
+struct MimeDatabase {
+    struct Slot {
+        std::string extension; // lower case; empty if the slot is free
+        uint32_t type = 0; // index into 'types'
+    };
+    std::vector<std::string> types;
+    std::vector<Slot> slots;
+    size_t count = 0;
+    
+    bool load(const std::string& path);
+    std::string_view find(std::string_view extension) const;
+};
+
+MimeDatabase g_mimeTypes;
+
+bool MimeDatabase::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) return false;
+    std::vector<std::pair<std::string, uint32_t>> entries;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream words(line.substr(0, line.find('#')));
+        std::string type, extension;
+        if (!(words >> type) || type.find('/') == std::string::npos) continue;
+        bool used = false;
+        while (words >> extension) {
+            for (char& c : extension) c = lowerAscii(c);
+            entries.emplace_back(extension, types.size());
+            used = true;
+        }
+        if (used) types.push_back(type);
+    }
+    
+    size_t capacity = 16;
+    while (capacity < entries.size() * 2) capacity *= 2;
+    slots.assign(capacity, Slot());
+    count = 0;
+    for (auto& entry : entries) {
+        size_t i = hashExtension(entry.first, 0) & (capacity - 1);
+        while (!slots[i].extension.empty() && slots[i].extension != entry.first) i = (i + 1) & (capacity - 1);
+        if (!slots[i].extension.empty()) continue; // listed twice: the first line wins
+        slots[i].extension = std::move(entry.first);
+        slots[i].type = entry.second;
+        count++;
+    }
+    return true;
+}
+
+bool equalsLowerCase(std::string_view value, std::string_view lower) {
+    if (value.size() != lower.size()) return false;
+    for (size_t i = 0; i < value.size(); i++) {
+        if (lowerAscii(value[i]) != lower[i]) return false;
+    }
+    return true;
+}
+
+std::string_view MimeDatabase::find(std::string_view extension) const {
+    if (slots.empty()) return {};
+    size_t mask = slots.size() - 1;
+    for (size_t i = hashExtension(extension, 0) & mask; !slots[i].extension.empty(); i = (i + 1) & mask) {
+        if (equalsLowerCase(extension, slots[i].extension)) return types[slots[i].type];
+    }
+    return {};
+}
+
+FileKind classifyFile(std::string_view filename) {
+    size_t dot = filename.rfind('.');
+    if (dot == std::string_view::npos || filename.find('/', dot) != std::string_view::npos) return UNKNOWN_FILE_KIND;
+    std::string_view extension = filename.substr(dot + 1);
+    
+    uint8_t slot = BUILTIN_TYPE_TABLE.slots[hashExtension(extension, BUILTIN_TYPE_TABLE.seed) & (BUILTIN_TYPE_SLOTS - 1)];
+    if (slot != 0 && equalsLowerCase(extension, BUILTIN_TYPES[slot - 1].extension)) return BUILTIN_TYPES[slot - 1].kind;
+    
+    std::string_view type = g_mimeTypes.find(extension);
+    if (type.empty()) return UNKNOWN_FILE_KIND;
+    const char* icon = type.compare(0, 6, "image/") == 0 ? "i-image" : type.compare(0, 6, "video/") == 0 ? "i-video" : 
+                       type.compare(0, 6, "audio/") == 0 ? "i-audio" : "i-file";
+    return {type, icon};
+}
+
+std::string_view getMimeType(std::string_view filename) {
+    return classifyFile(filename).mimeType;
+}
+
+// Helper function to get the explorer icon for a file type (a symbol in EXPLORER_ICONS)
+const char* getFileIcon(std::string_view filename) {
+    return classifyFile(filename).icon;
+}
+
+// Explorer
+// The page is put together from constant fragments. The stylesheet is served separately from a reserved
+// path so browsers fetch it once, and the icons are defined once per page and referenced by every entry.
+const char EXPLORER_CSS_PATH[] = "/__mtws/explorer.css";
+const char METRICS_PATH[] = "/__mtws/metrics";
+const size_t EXPLORER_PAGE_SIZE = 1000;
+const size_t MAX_CACHED_LISTINGS = 64;
+
+constexpr char EXPLORER_CSS[] =
+    ":root {"
+    "  --bg-color: #121212;"
+    "  --card-bg: #1e1e1e;"
+    "  --card-hover: #2a2a2a;"
+    "  --text-color: #f0f0f0;"
+    "  --accent-color: #8a2be2;"
+    "  --accent-hover: #9d44e6;"
+    "  --header-bg: #1a1a1a;"
+    "  --shadow-color: rgba(138, 43, 226, 0.4);"
+    "  --warning-bg: #332700;"
+    "  --warning-border: #665200;"
+    "  --warning-text: #ffcc00;"
+    "  --icon-color: #f0f0f0;"
+    "  --folder-color: #8a85ff;"
+    "  --file-color: #f0f0f0;"
+    "  --file-js-color: #f0db4f;"
+    "  --file-html-color: #e44d26;"
+    "  --file-css-color: #264de4;"
+    "  --file-cpp-color: #659ad2;"
+    "  --file-img-color: #ff9e80;"
+    "  --file-video-color: #ff5252;"
+    "  --file-audio-color: #69f0ae;"
+    "  --file-pdf-color: #ff5252;"
+    "  --file-archive-color: #ffd740;"
+    "}"
+    "* {"
+    "  box-sizing: border-box;"
+    "  margin: 0;"
+    "  padding: 0;"
+    "  transition: all 0.2s ease;"
+    "}"
+    "body {"
+    "  background: var(--bg-color);"
+    "  color: var(--text-color);"
+    "  font-family: 'Segoe UI', system-ui, -apple-system, sans-serif;"
+    "  line-height: 1.6;"
+    "  padding-bottom: 2rem;"
+    "  min-height: 100vh;"
+    "}"
+    "header {"
+    "  background: var(--header-bg);"
+    "  padding: 0.75rem 1rem;"
+    "  box-shadow: 0 4px 12px rgba(0, 0, 0, 0.1);"
+    "  position: sticky;"
+    "  top: 0;"
+    "  z-index: 100;"
+    "  backdrop-filter: blur(10px);"
+    "  display: flex;"
+    "  align-items: center;"
+    "  justify-content: space-between;"
+    "}"
+    ".header-title {"
+    "  font-size: 1.2rem;"
+    "  font-weight: 600;"
+    "  display: flex;"
+    "  align-items: center;"
+    "  gap: 0.5rem;"
+    "}"
+    ".navigation {"
+    "  display: flex;"
+    "  align-items: center;"
+    "  gap: 0.5rem;"
+    "}"
+    ".nav-button {"
+    "  background: transparent;"
+    "  border: none;"
+    "  color: var(--text-color);"
+    "  width: 36px;"
+    "  height: 36px;"
+    "  border-radius: 4px;"
+    "  display: flex;"
+    "  align-items: center;"
+    "  justify-content: center;"
+    "  cursor: pointer;"
+    "}"
+    ".nav-button:hover {"
+    "  background: rgba(255, 255, 255, 0.1);"
+    "}"
+    ".nav-button svg {"
+    "  width: 20px;"
+    "  height: 20px;"
+    "  fill: var(--icon-color);"
+    "}"
+    ".breadcrumb {"
+    "  display: flex;"
+    "  align-items: center;"
+    "  gap: 0.25rem;"
+    "  margin-left: 1rem;"
+    "  flex-grow: 1;"
+    "  overflow-x: auto;"
+    "  white-space: nowrap;"
+    "  scrollbar-width: thin;"
+    "  padding: 0.25rem 0;"
+    "}"
+    ".breadcrumb::-webkit-scrollbar {"
+    "  height: 4px;"
+    "}"
+    ".breadcrumb::-webkit-scrollbar-thumb {"
+    "  background: rgba(255, 255, 255, 0.2);"
+    "  border-radius: 4px;"
+    "}"
+    ".breadcrumb-item {"
+    "  display: flex;"
+    "  align-items: center;"
+    "  color: var(--text-color);"
+    "  opacity: 0.7;"
+    "  text-decoration: none;"
+    "  padding: 0.25rem 0.5rem;"
+    "  border-radius: 4px;"
+    "}"
+    ".breadcrumb-item:hover {"
+    "  background: rgba(255, 255, 255, 0.1);"
+    "  opacity: 1;"
+    "}"
+    ".breadcrumb-item.active {"
+    "  opacity: 1;"
+    "  font-weight: 500;"
+    "}"
+    ".breadcrumb-separator {"
+    "  opacity: 0.5;"
+    "  margin: 0 0.25rem;"
+    "}"
+    ".view-options {"
+    "  display: flex;"
+    "  align-items: center;"
+    "  gap: 0.5rem;"
+    "}"
+    ".container {"
+    "  width: 95%;"
+    "  max-width: 1400px;"
+    "  margin: 1rem auto;"
+    "  animation: fadeIn 0.5s ease-out;"
+    "}"
+    ".warning-banner {"
+    "  background-color: var(--warning-bg);"
+    "  border: 1px solid var(--warning-border);"
+    "  color: var(--warning-text);"
+    "  padding: 1rem;"
+    "  margin-bottom: 1rem;"
+    "  border-radius: 8px;"
+    "  animation: pulse 2s infinite;"
+    "}"
+    ".warning-banner h3 {"
+    "  margin-bottom: 0.5rem;"
+    "  display: flex;"
+    "  align-items: center;"
+    "  gap: 0.5rem;"
+    "}"
+    ".warning-banner p {"
+    "  margin: 0.25rem 0;"
+    "}"
+    ".explorer {"
+    "  background: var(--card-bg);"
+    "  border-radius: 8px;"
+    "  overflow: hidden;"
+    "  box-shadow: 0 4px 8px rgba(0, 0, 0, 0.2);"
+    "}"
+    ".explorer-body {"
+    "  padding: 0.5rem;"
+    "}"
+    ".file-grid {"
+    "  display: grid;"
+    "  grid-template-columns: repeat(auto-fill, minmax(120px, 1fr));"
+    "  gap: 1rem;"
+    "  padding: 0.5rem;"
+    "}"
+    ".file-item {"
+    "  display: flex;"
+    "  flex-direction: column;"
+    "  align-items: center;"
+    "  text-align: center;"
+    "  padding: 0.75rem;"
+    "  border-radius: 8px;"
+    "  transition: background-color 0.2s;"
+    "  cursor: pointer;"
+    "  text-decoration: none;"
+    "  color: var(--text-color);"
+    "}"
+    ".file-item:hover {"
+    "  background-color: var(--card-hover);"
+    "}"
+    ".file-icon {"
+    "  width: 48px;"
+    "  height: 48px;"
+    "  margin-bottom: 0.5rem;"
+    "  display: flex;"
+    "  align-items: center;"
+    "  justify-content: center;"
+    "}"
+    ".file-icon svg {"
+    "  width: 100%;"
+    "  height: 100%;"
+    "}"
+    ".file-name {"
+    "  font-size: 0.9rem;"
+    "  word-break: break-word;"
+    "  max-width: 100%;"
+    "  overflow: hidden;"
+    "  text-overflow: ellipsis;"
+    "  display: -webkit-box;"
+    "  -webkit-line-clamp: 2;"
+    "  -webkit-box-orient: vertical;"
+    "}"
+    ".footer {"
+    "  margin-top: 2rem;"
+    "  text-align: center;"
+    "  font-size: 0.85rem;"
+    "  color: rgba(255, 255, 255, 0.5);"
+    "}"
+    "@keyframes fadeIn {"
+    "  from { opacity: 0; transform: translateY(10px); }"
+    "  to { opacity: 1; transform: translateY(0); }"
+    "}"
+    "@keyframes pulse {"
+    "  0% { opacity: 1; }"
+    "  50% { opacity: 0.8; }"
+    "  100% { opacity: 1; }"
+    "}"
+    "@media (max-width: 768px) {"
+    "  .file-grid {"
+    "    grid-template-columns: repeat(auto-fill, minmax(100px, 1fr));"
+    "  }"
+    "  header {"
+    "    padding: 0.5rem;"
+    "  }"
+    "  .breadcrumb {"
+    "    margin-left: 0.5rem;"
+    "  }"
+    "}"
+    ".pager {"
+    "  display: flex;"
+    "  align-items: center;"
+    "  justify-content: center;"
+    "  gap: 1rem;"
+    "  padding: 1rem;"
+    "}"
+    ".pager a {"
+    "  color: var(--accent-color);"
+    "  text-decoration: none;"
+    "}"
+    ".pager a:hover {"
+    "  color: var(--accent-hover);"
+    "}";
+
+constexpr uint64_t fnv1a(std::string_view data) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : data) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Changes whenever the stylesheet does, so it can be cached for a long time
+constexpr uint64_t EXPLORER_CSS_HASH = fnv1a(EXPLORER_CSS);
+
+constexpr char EXPLORER_HEAD[] =
+    "<!DOCTYPE html><html><head><title>MTWS Directory Explorer</title>"
+    "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">"
+    "<link rel=\"stylesheet\" href=\"/__mtws/explorer.css\">"
+    "</head><body>"
+    "<svg style=\"display:none\">"
+    "<symbol id=\"i-folder\" viewBox=\"0 0 24 24\"><path fill=\"#8a85ff\" d=\"M20,18H4V8H20M20,6H12L10,4H4C2.89,4 2,4.89 2,6V18A2,2 0 0,0 4,20H20A2,2 0 0,0 22,18V8C22,6.89 21.1,6 20,6Z\" /></symbol>"
+    "<symbol id=\"i-html\" viewBox=\"0 0 24 24\"><path fill=\"#e44d26\" d=\"M12,17.56L16.07,16.43L16.62,10.33H9.38L9.2,8.3H16.8L17,6.31H7L7.56,12.32H14.45L14.22,14.9L12,15.5L9.78,14.9L9.64,13.24H7.64L7.93,16.43L12,17.56M4.07,3H19.93L18.5,19.2L12,21L5.5,19.2L4.07,3Z\" /></symbol>"
+    "<symbol id=\"i-css\" viewBox=\"0 0 24 24\"><path fill=\"#264de4\" d=\"M5,3L4.35,6.34H17.94L17.5,8.5H3.92L3.26,11.83H16.85L16.09,16.64L10.61,18.33L5.86,16.64L6.19,14.41H2.87L2.17,19L9.95,22L18.3,19L20.1,3H5Z\" /></symbol>"
+    "<symbol id=\"i-js\" viewBox=\"0 0 24 24\"><path fill=\"#f0db4f\" d=\"M3,3H21V21H3V3M7.73,18.04C8.13,18.89 8.92,19.59 10.27,19.59C11.77,19.59 12.8,18.79 12.8,17.04V11.26H11.1V17C11.1,17.86 10.75,18.08 10.2,18.08C9.62,18.08 9.38,17.68 9.11,17.21L7.73,18.04M13.71,17.86C14.21,18.84 15.22,19.59 16.8,19.59C18.4,19.59 19.6,18.76 19.6,17.23C19.6,15.82 18.79,15.19 17.35,14.57L16.93,14.39C16.2,14.08 15.89,13.87 15.89,13.37C15.89,12.96 16.2,12.64 16.7,12.64C17.18,12.64 17.5,12.85 17.79,13.37L19.1,12.5C18.55,11.54 17.77,11.17 16.7,11.17C15.19,11.17 14.22,12.13 14.22,13.4C14.22,14.78 15.03,15.43 16.25,15.95L16.67,16.13C17.45,16.47 17.91,16.68 17.91,17.26C17.91,17.74 17.46,18.09 16.76,18.09C15.93,18.09 15.45,17.66 15.09,17.06L13.71,17.86Z\" /></symbol>"
+    "<symbol id=\"i-cpp\" viewBox=\"0 0 24 24\"><path fill=\"#659ad2\" d=\"M10.5,15.97L10.91,18.41C10.65,18.55 10.23,18.68 9.67,18.8C9.1,18.93 8.43,19 7.66,19C5.45,18.96 3.79,18.3 2.68,17.04C1.56,15.77 1,14.16 1,12.21C1.05,9.9 1.72,8.13 3,6.89C4.32,5.64 5.96,5 7.94,5C8.69,5 9.34,5.07 9.88,5.19C10.42,5.31 10.82,5.44 11.08,5.59L10.5,8.08L9.44,7.74C9.04,7.64 8.58,7.59 8.05,7.59C6.89,7.58 5.93,7.95 5.18,8.69C4.42,9.42 4.03,10.54 4,12.03C4,13.39 4.37,14.45 5.08,15.23C5.79,16 6.79,16.4 8.07,16.41L9.4,16.29C9.83,16.21 10.19,16.1 10.5,15.97M11,11H13V9H15V11H17V13H15V15H13V13H11V11Z\" /></symbol>"
+    "<symbol id=\"i-image\" viewBox=\"0 0 24 24\"><path fill=\"#ff9e80\" d=\"M8.5,13.5L11,16.5L14.5,12L19,18H5M21,19V5C21,3.89 20.1,3 19,3H5A2,2 0 0,0 3,5V19A2,2 0 0,0 5,21H19A2,2 0 0,0 21,19Z\" /></symbol>"
+    "<symbol id=\"i-video\" viewBox=\"0 0 24 24\"><path fill=\"#ff5252\" d=\"M18,4L20,8H17L15,4H13L15,8H12L10,4H8L10,8H7L5,4H4A2,2 0 0,0 2,6V18A2,2 0 0,0 4,20H20A2,2 0 0,0 22,18V4H18Z\" /></symbol>"
+    "<symbol id=\"i-audio\" viewBox=\"0 0 24 24\"><path fill=\"#69f0ae\" d=\"M14,3.23V5.29C16.89,6.15 19,8.83 19,12C19,15.17 16.89,17.84 14,18.7V20.77C18,19.86 21,16.28 21,12C21,7.72 18,4.14 14,3.23M16.5,12C16.5,10.23 15.5,8.71 14,7.97V16C15.5,15.29 16.5,13.76 16.5,12M3,9V15H7L12,20V4L7,9H3Z\" /></symbol>"
+    "<symbol id=\"i-pdf\" viewBox=\"0 0 24 24\"><path fill=\"#ff5252\" d=\"M19,3A2,2 0 0,1 21,5V19A2,2 0 0,1 19,21H5C3.89,21 3,20.1 3,19V5C3,3.89 3.89,3 5,3H19M10.59,10.08C10.57,10.13 10.3,11.84 8.5,14.77C8.5,14.77 5,14 5.5,11.5C5.83,10.04 6.15,8.95 7.86,9.15C9.82,9.38 10.38,9.96 10.59,10.08M15.5,14.5C14,14.5 11.5,13.26 10,10.5C10.5,9.65 10.62,9.56 10.81,9.43C11.38,9.08 13.69,7.95 15.5,9C17.35,10.05 18.29,10.53 18.38,12.42C18.45,14.16 17,14.5 15.5,14.5M18.5,15C18.5,15 17,18 13,19C9.03,20 5.08,19.5 5.08,19.5C6.45,15.4 7.23,13.5 8.5,12C9.09,13.31 10.5,14.5 12,14.5C14,14.5 14.35,14.25 15.25,13.66C16.23,15.27 18.5,15 18.5,15Z\" /></symbol>"
+    "<symbol id=\"i-archive\" viewBox=\"0 0 24 24\"><path fill=\"#ffd740\" d=\"M14,17H12V15H10V13H12V15H14M14,9H12V11H14V13H12V11H10V9H12V7H10V5H12V7H14M19,3H5C3.89,3 3,3.89 3,5V19A2,2 0 0,0 5,21H19A2,2 0 0,0 21,19V5C21,3.89 20.1,3 19,3Z\" /></symbol>"
+    "<symbol id=\"i-file\" viewBox=\"0 0 24 24\"><path fill=\"#f0f0f0\" d=\"M14,2H6A2,2 0 0,0 4,4V20A2,2 0 0,0 6,22H18A2,2 0 0,0 20,20V8L14,2M18,20H6V4H13V9H18V20Z\" /></symbol>"
+    "</svg>"
+    "<header>"
+    "  <div class=\"navigation\">"
+    "    <button class=\"nav-button\" onclick=\"history.back()\">"
+    "      <svg viewBox=\"0 0 24 24\"><path d=\"M20,11V13H8L13.5,18.5L12.08,19.92L4.16,12L12.08,4.08L13.5,5.5L8,11H20Z\"></path></svg>"
+    "    </button>"
+    "    <button class=\"nav-button\" onclick=\"history.forward()\">"
+    "      <svg viewBox=\"0 0 24 24\"><path d=\"M4,11V13H16L10.5,18.5L11.92,19.92L19.84,12L11.92,4.08L10.5,5.5L16,11H4Z\"></path></svg>"
+    "    </button>"
+    "  </div>"
+    "  <div class=\"breadcrumb\">";
+
+constexpr char EXPLORER_ROOT_CRUMB[] =
+    "  <svg style=\"width:20px;height:20px;margin-right:4px;\" viewBox=\"0 0 24 24\">"
+    "    <path fill=\"currentColor\" d=\"M10,20V14H14V20H19V12H22L12,3L2,12H5V20H10Z\" />"
+    "  </svg>"
+    "  Root"
+    "</a>";
+
+constexpr char EXPLORER_TOOLBAR[] =
+    "  </div>"
+    "  <div class=\"view-options\">"
+    "    <button class=\"nav-button\" title=\"Grid View\">"
+    "      <svg viewBox=\"0 0 24 24\"><path d=\"M3,3H11V11H3V3M3,13H11V21H3V13M13,3H21V11H13V3M13,13H21V21H13V13Z\"></path></svg>"
+    "    </button>"
+    "    <button class=\"nav-button\" title=\"List View\">"
+    "      <svg viewBox=\"0 0 24 24\"><path d=\"M3,4H21V8H3V4M3,10H21V14H3V10M3,16H21V20H3V16Z\"></path></svg>"
+    "    </button>"
+    "  </div>"
+    "</header>"
+    "<div class=\"container\">";
+
+constexpr char EXPLORER_WARNING[] =
+    "<div class=\"warning-banner\">"
+    "  <h3>"
+    "    <svg style=\"width:24px;height:24px\" viewBox=\"0 0 24 24\">"
+    "      <path fill=\"currentColor\" d=\"M13,13H11V7H13M13,17H11V15H13M12,2A10,10 0 0,0 2,12A10,10 0 0,0 12,22A10,10 0 0,0 22,12A10,10 0 0,0 12,2Z\" />"
+    "    </svg>"
+    "    MTWS Explorer Component"
+    "  </h3>"
+    "  <p>This is the built-in file explorer of My Tiny Web Server.</p>"
+    "  <p>No index.html or index.htm file was found in this directory.</p>"
+    "</div>";
+
+constexpr char EXPLORER_GRID[] =
+    "<div class=\"explorer\">"
+    "  <div class=\"explorer-body\">"
+    "    <div class=\"file-grid\">";
+
+constexpr char EXPLORER_PARENT[] =
+    "<a href=\"..\" class=\"file-item\">"
+    "  <div class=\"file-icon\"><svg viewBox=\"0 0 24 24\"><use href=\"#i-folder\" /></svg></div>"
+    "  <div class=\"file-name\">..</div>"
+    "</a>";
+
+constexpr char EXPLORER_GRID_END[] =
+    "    </div>"
+    "  </div>"
+    "</div>";
+
+constexpr char EXPLORER_FOOTER[] =
+    "<div class=\"footer\">"
+    "  Powered by My Tiny Web Server (MTWS)"
+    "</div>"
+    "</div></body></html>";
+
+void appendHtmlEscaped(std::string& out, std::string_view text) {
+    for (char c : text) {
+        switch (c) {
+            case '&': out += "&amp;"; break;
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            case '"': out += "&quot;"; break;
+            case '\'': out += "&#39;"; break;
+            default: out += c;
+        }
+    }
+}
+
+// Percent-encode everything but unreserved characters, so names with spaces, '#', '?' or '+' link correctly
+void appendUrlEncoded(std::string& out, std::string_view text) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (unsigned char c : text) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            out += c;
+        } else {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+}
+
+// A rendered directory, valid as long as the directory's mtime does not change
+struct DirectoryListing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    std::vector<std::string> pages; // file-item markup, EXPLORER_PAGE_SIZE entries per page
+};
+
+// Least recently used first out once MAX_CACHED_LISTINGS directories are cached
+std::mutex g_listingMutex;
+std::list<std::pair<std::string, std::shared_ptr<const DirectoryListing>>> g_listingLru;
+std::unordered_map<std::string, decltype(g_listingLru)::iterator> g_listings;
+
+// The web root (the working directory); request paths are resolved relative to it
+int g_rootFd = AT_FDCWD;
+
+struct DirectoryEntry {
+    std::string name;
+    bool isDirectory;
+};
+
+// Read a directory with getdents64. d_type saves a stat per entry; only filesystems that don't fill it
+// in (and symlinks, which should show as what they point to) need one.
+bool readDirectory(int dirFd, std::vector<DirectoryEntry>& entries) {
+    std::vector<char> buffer(64 * 1024);
+    while (true) {
+        long n = syscall(SYS_getdents64, dirFd, buffer.data(), buffer.size());
+        if (n < 0) return false;
+        if (n == 0) return true;
+        
+        for (long offset = 0; offset < n;) {
+            const struct dirent64* entry = reinterpret_cast<const struct dirent64*>(buffer.data() + offset);
+            offset += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            
+            bool isDirectory = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+                struct stat st;
+                isDirectory = fstatat(dirFd, entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+            }
+            entries.push_back(DirectoryEntry{entry->d_name, isDirectory});
+        }
+    }
+}
+
+std::shared_ptr<const DirectoryListing> buildListing(int dirFd, const struct stat& dirStat) {
+    std::vector<DirectoryEntry> entries;
+    if (!readDirectory(dirFd, entries)) return nullptr;
+    
+    // Directories first, then files, each sorted by name so pages stay stable
+    std::sort(entries.begin(), entries.end(), [](const DirectoryEntry& a, const DirectoryEntry& b) {
+        if (a.isDirectory != b.isDirectory) return a.isDirectory;
+        return a.name < b.name;
+    });
+    
+    auto listing = std::make_shared<DirectoryListing>();
+    listing->dev = dirStat.st_dev;
+    listing->ino = dirStat.st_ino;
+    listing->mtime = dirStat.st_mtim;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (i % EXPLORER_PAGE_SIZE == 0) listing->pages.emplace_back();
+        std::string& html = listing->pages.back();
+        const DirectoryEntry& entry = entries[i];
+        
+        html += "<a href=\"";
+        appendUrlEncoded(html, entry.name);
+        if (entry.isDirectory) html += '/';
+        html += "\" class=\"file-item\"><div class=\"file-icon\"><svg viewBox=\"0 0 24 24\"><use href=\"#";
+        html += entry.isDirectory ? "i-folder" : getFileIcon(entry.name);
+        html += "\" /></svg></div><div class=\"file-name\">";
+        appendHtmlEscaped(html, entry.name);
+        html += "</div></a>";
+    }
+    if (listing->pages.empty()) listing->pages.emplace_back();
+    return listing;
+}
+
+// Rendered listings are reused until the directory changes (entries added, removed or renamed)
+std::shared_ptr<const DirectoryListing> getListing(const std::string& path, struct stat& dirStat) {
+    int dirFd = openat(g_rootFd, path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) return nullptr;
+    if (fstat(dirFd, &dirStat) < 0) {
+        close(dirFd);
+        return nullptr;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(g_listingMutex);
+        auto it = g_listings.find(path);
+        if (it != g_listings.end()) {
+            const DirectoryListing& cached = *it->second->second;
+            if (cached.dev == dirStat.st_dev && cached.ino == dirStat.st_ino && 
+                cached.mtime.tv_sec == dirStat.st_mtim.tv_sec && cached.mtime.tv_nsec == dirStat.st_mtim.tv_nsec) {
+                close(dirFd);
+                g_listingLru.splice(g_listingLru.begin(), g_listingLru, it->second);
+                return it->second->second;
+            }
+        }
+    }
+    
+    std::shared_ptr<const DirectoryListing> listing = buildListing(dirFd, dirStat);
+    close(dirFd);
+    if (!listing) return nullptr;
+    
+    std::lock_guard<std::mutex> lock(g_listingMutex);
+    auto it = g_listings.find(path);
+    if (it != g_listings.end()) {
+        it->second->second = listing;
+        g_listingLru.splice(g_listingLru.begin(), g_listingLru, it->second);
+        return listing;
+    }
+    if (g_listings.size() >= MAX_CACHED_LISTINGS) {
+        g_listings.erase(g_listingLru.back().first);
+        g_listingLru.pop_back();
+    }
+    g_listingLru.emplace_front(path, listing);
+    g_listings.emplace(path, g_listingLru.begin());
+    return listing;
+}
+
+// Render one page (1-based) of the explorer for a directory; 'dirStat' receives the directory's stat.
+// 'warning' shows the banner saying the site has no index page.
+bool generateExplorerHTML(const std::string& path, size_t page, bool warning, std::string& html, struct stat& dirStat) {
+    std::shared_ptr<const DirectoryListing> listing = getListing(path, dirStat);
+    if (!listing) return false;
+    size_t pageCount = listing->pages.size();
+    page = std::min(std::max<size_t>(page, 1), pageCount);
+    const std::string& items = listing->pages[page - 1];
+    
+    html.reserve(sizeof(EXPLORER_HEAD) + sizeof(EXPLORER_TOOLBAR) + sizeof(EXPLORER_WARNING) + items.size() + 2048);
+    html += EXPLORER_HEAD;
+
+    // Build breadcrumb navigation
+    bool root = path == "." || path == "./";
+    html += root ? "<a href=\"/\" class=\"breadcrumb-item active\">" : "<a href=\"/\" class=\"breadcrumb-item\">";
+    html += EXPLORER_ROOT_CRUMB;
+    if (!root) {
+        html += "<span class=\"breadcrumb-separator\">/</span>";
+        
+        std::vector<std::string_view> pathParts;
+        std::string_view rest(path);
+        if (!rest.empty() && rest.front() == '.') rest.remove_prefix(1);
+        while (!rest.empty()) {
+            size_t slash = rest.find('/');
+            std::string_view part = rest.substr(0, slash);
+            if (!part.empty()) pathParts.push_back(part);
+            rest.remove_prefix(slash == std::string_view::npos ? rest.size() : slash + 1);
+        }
+        
+        std::string currentPath;
+        for (size_t i = 0; i < pathParts.size(); ++i) {
+            currentPath += '/';
+            appendUrlEncoded(currentPath, pathParts[i]);
+            bool isLast = (i == pathParts.size() - 1);
+            
+            html += "<a href=\"" + currentPath + "\" class=\"breadcrumb-item " + (isLast ? "active" : "") + "\">";
+            appendHtmlEscaped(html, pathParts[i]);
+            html += "</a>";
+            if (!isLast) html += "<span class=\"breadcrumb-separator\">/</span>";
+        }
+    }
+    html += EXPLORER_TOOLBAR;
+    
+    if (warning) html += EXPLORER_WARNING;
+    
+    html += EXPLORER_GRID;
+    if (!root) html += EXPLORER_PARENT;
+    html += items;
+    html += EXPLORER_GRID_END;
+    
+    // Large directories are split into pages so no response grows without bound
+    if (pageCount > 1) {
+        html += "<div class=\"pager\">";
+        if (page > 1) html += "<a href=\"?page=" + std::to_string(page - 1) + "\">&larr; Previous</a>";
+        html += "<span>Page " + std::to_string(page) + " of " + std::to_string(pageCount) + "</span>";
+        if (page < pageCount) html += "<a href=\"?page=" + std::to_string(page + 1) + "\">Next &rarr;</a>";
+        html += "</div>";
+    }
+    html += EXPLORER_FOOTER;
+    return true;
+}
+
+bool checkPortAvailable(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return false;
+    
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    
+    int result = bind(sock, (struct sockaddr*)&address, sizeof(address));
+    close(sock);
+    
+    return result >= 0;
+}
+
+bool tryStartServer(int port, int& server_fd, int cpu = -1) {
+    sockaddr_in address{};
+    int opt = 1;
+
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return false;
+    }
+    
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        close(server_fd);
+        return false;
+    }
+    
+    // Prefer this listener for connections that arrive on the worker's CPU
+    if (cpu >= 0) {
+        setsockopt(server_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(server_fd);
+        return false;
+    }
+    
+    return true;
+}
+
+// Function to get the server's IP address
+std::string getLocalIP() {
+    char hostbuffer[256];
+    if (gethostname(hostbuffer, sizeof(hostbuffer)) != 0) {
+        return "127.0.0.1";
+    }
+    
+    struct hostent* host_entry = gethostbyname(hostbuffer);
+    if (host_entry == nullptr) {
+        return "127.0.0.1";
+    }
+    
+    char* ip = inet_ntoa(*((struct in_addr*)host_entry->h_addr_list[0]));
+    return std::string(ip);
+}
+
+// Responses
+const int MAX_STATUS = 600;
+const char* const NOT_FOUND_PAGE = "<html><head><title>404 Not Found</title><style>body{font-family:system-ui;background:#121212;color:#f0f0f0;display:flex;align-items:center;justify-content:center;height:100vh;margin:0;flex-direction:column;}.container{text-align:center;animation:fadeIn 0.5s ease-out;}h1{color:#ff5577;font-size:3rem;margin-bottom:1rem;}p{font-size:1.2rem;opacity:0.8;}@keyframes fadeIn{from{opacity:0;transform:translateY(-20px);}to{opacity:1;transform:translateY(0);}}</style></head><body><div class='container'><h1>404 Not Found</h1><p>The requested resource could not be found on this server.</p></div></body></html>";
+
+// An open file that is closed once the last response using it has been sent
+struct OpenFile {
+    int fd;
+    explicit OpenFile(int fd) : fd(fd) {}
+    ~OpenFile() { close(fd); }
+};
+
+struct CachedFile;
+struct CannedResponse;
+
+struct ByteRange {
+    off_t first;
+    off_t last; // inclusive
+};
+
+// Header fields are pmr strings so a worker can build the response in its request arena
+struct HttpResponse {
+    HttpResponse() = default;
+    explicit HttpResponse(std::pmr::memory_resource* arena) 
+        : contentType("text/html", arena), headers(arena), etag(arena), cacheControl(arena), contentEncoding(arena), ranges(arena), 
+          boundary(arena) {}
+    
+    int status = 200;
+    std::pmr::string contentType = "text/html";
+    std::pmr::string headers; // extra header lines, each terminated by CRLF
+    std::string body;
+    // When set, the body is sent from this block (a compressed variant) without copying it
+    std::shared_ptr<const std::string> sharedBody;
+    // When set, the body is sent straight from this file instead of from 'body'
+    std::shared_ptr<OpenFile> file;
+    off_t fileOffset = 0;
+    size_t fileLength = 0;
+    // Validators and caching policy
+    time_t lastModified = 0;
+    std::pmr::string etag;
+    std::pmr::string cacheControl;
+    std::pmr::string contentEncoding;
+    // Several ranges of 'file' sent as multipart/byteranges
+    std::pmr::vector<ByteRange> ranges;
+    std::pmr::string boundary;
+    // Small file served from the file cache as a pre-serialized response
+    std::shared_ptr<const CachedFile> cached;
+    // Error page serialized at startup; status, headers and sharedBody hold the same response
+    std::shared_ptr<const CannedResponse> canned;
+    // Nothing here answers the request; an upstream does
+    bool proxy = false;
+};
+
+const char* statusText(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Content Too Large";
+        case 416: return "Range Not Satisfiable";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        case 505: return "HTTP Version Not Supported";
+        default: return "Unknown";
+    }
+}
+
+// Part header that precedes each range of a multipart/byteranges body
+std::string multipartHeader(const HttpResponse& response, const ByteRange& range) {
+    return "\r\n--" + std::string(response.boundary) + "\r\nContent-Type: " + std::string(response.contentType) + 
+           "\r\nContent-Range: bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + 
+           "/" + std::to_string(response.fileLength) + "\r\n\r\n";
+}
+
+std::string multipartTrailer(const HttpResponse& response) {
+    return "\r\n--" + std::string(response.boundary) + "--\r\n";
+}
+
+size_t contentLength(const HttpResponse& response) {
+    if (!response.file) return response.sharedBody ? response.sharedBody->size() : response.body.size();
+    if (response.ranges.empty()) return response.fileLength;
+    
+    size_t length = multipartTrailer(response).size();
+    for (const auto& range : response.ranges) {
+        length += multipartHeader(response, range).size() + (range.last - range.first + 1);
+    }
+    return length;
+}
+
+// Format a timestamp as an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT"
+void appendHttpDate(std::pmr::string& out, time_t time) {
+    tm parts;
+    gmtime_r(&time, &parts);
+    char buffer[40];
+    out.append(buffer, strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &parts));
+}
+
+std::string formatHttpDate(time_t time) {
+    std::pmr::string out;
+    appendHttpDate(out, time);
+    return std::string(out);
+}
+
+// Entity tag derived from inode, size and modification time; weak tags mark generated content
+std::string makeETag(const struct stat& st, bool weak) {
+    char buffer[80];
+    unsigned long long mtime = (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    snprintf(buffer, sizeof(buffer), "%s\"%llx-%llx-%llx\"", weak ? "W/" : "", 
+             (unsigned long long)st.st_ino, (unsigned long long)st.st_size, mtime);
+    return buffer;
+}
+
+void appendNumber(std::pmr::string& out, unsigned long long value) {
+    char buffer[24];
+    out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer);
+}
+
+void appendHeader(std::pmr::string& out, std::string_view name, std::string_view value) {
+    out.append(name);
+    out.append(": ", 2);
+    out.append(value);
+    out.append("\r\n", 2);
+}
+
+// Status lines, serialized once by prepareResponses()
+std::string g_statusLines[MAX_STATUS];
+
+void appendStatusLine(std::pmr::string& out, int status) {
+    if (status >= 0 && status < MAX_STATUS && !g_statusLines[status].empty()) {
+        out += g_statusLines[status];
+        return;
+    }
+    out += "HTTP/1.1 ";
+    appendNumber(out, status);
+    out += ' ';
+    out += statusText(status);
+    out += "\r\n";
+}
+
+// The Date and Server lines of every response, rebuilt at most once per second per thread. Responses
+// serialized ahead of time are sent with this block slotted in after their status line.
+const std::shared_ptr<const std::string>& serverHeaders() {
+    thread_local std::shared_ptr<const std::string> lines;
+    thread_local time_t second = -1;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if (now.tv_sec != second) {
+        std::pmr::string block = "Date: ";
+        appendHttpDate(block, now.tv_sec);
+        block += "\r\nServer: MTWS\r\n";
+        lines = std::make_shared<const std::string>(block);
+        second = now.tv_sec;
+    }
+    return lines;
+}
+
+// Headers after the Date and Server lines, up to and including the blank line; HTTP/1.0 clients only keep
+// the connection if told so
+void appendHead(std::pmr::string& out, const HttpResponse& response, bool keepAlive, bool http10) {
+    if (response.status != 304 && response.status != 204) {
+        if (response.ranges.empty()) {
+            appendHeader(out, "Content-Type", response.contentType);
+        } else {
+            out += "Content-Type: multipart/byteranges; boundary=";
+            out += response.boundary;
+            out += "\r\n";
+        }
+        out += "Content-Length: ";
+        appendNumber(out, contentLength(response));
+        out += "\r\n";
+    }
+    if (!response.etag.empty()) appendHeader(out, "ETag", response.etag);
+    if (response.lastModified) {
+        out += "Last-Modified: ";
+        appendHttpDate(out, response.lastModified);
+        out += "\r\n";
+    }
+    if (!response.cacheControl.empty()) appendHeader(out, "Cache-Control", response.cacheControl);
+    if (!response.contentEncoding.empty()) appendHeader(out, "Content-Encoding", response.contentEncoding);
+    out += response.headers;
+    if (!keepAlive) {
+        out += "Connection: close\r\n";
+    } else if (http10) {
+        out += "Connection: keep-alive\r\n";
+    }
+    out += "\r\n";
+}
+
+// Append status line, headers and in-memory body to 'out'
+void serializeResponse(std::pmr::string& out, const HttpResponse& response, bool keepAlive, bool http10, bool includeBody = true) {
+    bool withBody = !response.file && !response.sharedBody && includeBody;
+    const std::string& lines = *serverHeaders();
+    out.reserve(out.size() + 256 + lines.size() + response.headers.size() + response.etag.size() + response.cacheControl.size() + 
+                (withBody ? response.body.size() : 0));
+    appendStatusLine(out, response.status);
+    out += lines;
+    appendHead(out, response, keepAlive, http10);
+    if (withBody) out += response.body;
+}
+
+// A keep-alive HTTP/1.1 response that is stored and sent later; queueSerialized() adds the Date and Server lines
+std::string serializeStored(const HttpResponse& response) {
+    std::pmr::string out;
+    out.reserve(256 + response.headers.size() + response.etag.size() + response.body.size());
+    appendStatusLine(out, response.status);
+    appendHead(out, response, true, false);
+    out += response.body;
+    return std::string(out);
+}
+
+// Error pages, serialized once at startup so answering one builds nothing
+struct CannedResponse {
+    std::string headers; // extra header lines
+    std::shared_ptr<const std::string> body;
+    std::string response; // complete keep-alive HTTP/1.1 response without Date and Server
+    size_t headerLength = 0;
+};
+
+std::shared_ptr<const CannedResponse> g_cannedResponses[MAX_STATUS];
+
+void prepareResponses() {
+    for (int status = 100; status < MAX_STATUS; status++) {
+        if (strcmp(statusText(status), "Unknown") == 0) continue;
+        g_statusLines[status] = "HTTP/1.1 " + std::to_string(status) + " " + statusText(status) + "\r\n";
+        if (status < 400) continue;
+        
+        auto canned = std::make_shared<CannedResponse>();
+        if (status == 405 || status == 501) canned->headers = "Allow: GET, HEAD\r\n";
+        if (status == 429 || status == 503) canned->headers = "Retry-After: 1\r\n";
+        HttpResponse response;
+        response.status = status;
+        response.headers = canned->headers;
+        response.body = status == 404 ? NOT_FOUND_PAGE : "<h1>" + std::to_string(status) + " " + statusText(status) + "</h1>";
+        canned->response = serializeStored(response);
+        canned->headerLength = canned->response.size() - response.body.size();
+        canned->body = std::make_shared<const std::string>(std::move(response.body));
+        g_cannedResponses[status] = std::move(canned);
+    }
+}
+
+// Turn 'response' into the error page for 'status'
+void cannedResponse(HttpResponse& response, int status) {
+    const auto& canned = g_cannedResponses[status];
+    response.status = status;
+    response.headers = canned->headers;
+    response.body.clear();
+    response.sharedBody = canned->body;
+    response.canned = canned;
+}
+
+// Make an open regular file the response body, so it is sent without copying it through user space.
+// Takes ownership of 'fd'.
+void fileResponse(int fd, const struct stat& st, HttpResponse& response) {
+    response.file = std::make_shared<OpenFile>(fd);
+    response.fileOffset = 0;
+    response.fileLength = st.st_size;
+    response.lastModified = st.st_mtime;
+    response.etag = makeETag(st, false);
+}
+
+// Open a regular file relative to 'dirFd'. O_NONBLOCK keeps a FIFO with that name from blocking the open.
+bool openFileAt(int dirFd, const char* name, HttpResponse& response) {
+    int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) return false;
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || fcntl(fd, F_SETFL, 0) < 0) {
+        close(fd);
+        return false;
+    }
+    fileResponse(fd, st, response);
+    return true;
+}
+
+bool openFileResponse(const std::string& filePath, HttpResponse& response) {
+    return openFileAt(AT_FDCWD, filePath.c_str(), response);
+}
+
+// Parse an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT"; returns -1 if malformed
+time_t parseHttpDate(const std::string& value) {
+    tm parsed{};
+    const char* end = strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &parsed);
+    if (!end || *end != '\0') return -1;
+    return timegm(&parsed);
+}
+
+// Parse a "bytes=" Range header against a file of the given size.
+// Returns false if the header should be ignored; 'ranges' is left empty if nothing is satisfiable.
+bool parseRangeHeader(std::string_view value, off_t size, std::pmr::vector<ByteRange>& ranges) {
+    const size_t MAX_RANGES = 16;
+    if (value.compare(0, 6, "bytes=") != 0) return false;
+    value.remove_prefix(6);
+    
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view spec = trimWhitespace(value.substr(0, comma));
+        value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+        size_t dash = spec.find('-');
+        if (dash == std::string_view::npos) return false;
+        std::string_view firstStr = spec.substr(0, dash);
+        std::string_view lastStr = spec.substr(dash + 1);
+        if (firstStr.find_first_not_of("0123456789") != std::string_view::npos ||
+            lastStr.find_first_not_of("0123456789") != std::string_view::npos ||
+            (firstStr.empty() && lastStr.empty()) || firstStr.size() > 18 || lastStr.size() > 18) {
+            return false;
+        }
+        long long first = 0, last = 0;
+        std::from_chars(firstStr.data(), firstStr.data() + firstStr.size(), first);
+        std::from_chars(lastStr.data(), lastStr.data() + lastStr.size(), last);
+        
+        ByteRange range;
+        if (firstStr.empty()) {
+            // Suffix range: the last N bytes
+            if (last == 0) continue;
+            range.first = last >= size ? 0 : size - last;
+            range.last = size - 1;
+        } else {
+            range.first = first;
+            range.last = lastStr.empty() ? size - 1 : std::min<off_t>(last, size - 1);
+            if (!lastStr.empty() && last < range.first) return false;
+        }
+        if (range.first >= size) continue;
+        ranges.push_back(range);
+    }
+    
+    // Many or overlapping ranges are a classic amplification trick; merge them and cap the count
+    std::sort(ranges.begin(), ranges.end(), [](const ByteRange& a, const ByteRange& b) { return a.first < b.first; });
+    size_t merged = 0;
+    for (const auto& range : ranges) {
+        if (merged > 0 && range.first <= ranges[merged - 1].last + 1) {
+            ranges[merged - 1].last = std::max(ranges[merged - 1].last, range.last);
+        } else {
+            ranges[merged++] = range;
+        }
+    }
+    ranges.resize(merged);
+    return ranges.size() <= MAX_RANGES;
+}
+
+// Turn a full 200 file response into 206/416 when the client asked for part of it
+void applyRange(std::string_view rangeHeader, std::string_view ifRange, HttpResponse& response) {
+    response.headers += "Accept-Ranges: bytes\r\n";
+    if (rangeHeader.empty() || response.status != 200 || !response.file) return;
+    
+    // If-Range: only send a part if the client's copy is still current, otherwise send everything.
+    // Entity tags must match strongly; weak tags never do.
+    if (!ifRange.empty()) {
+        if (ifRange.front() == '"') {
+            if (response.etag.empty() || response.etag.front() != '"' || ifRange != response.etag) return;
+        } else {
+            time_t date = parseHttpDate(std::string(ifRange));
+            if (date < 0 || date != response.lastModified) return;
+        }
+    }
+    
+    off_t size = response.fileLength;
+    std::pmr::vector<ByteRange> ranges(response.ranges.get_allocator());
+    if (!parseRangeHeader(rangeHeader, size, ranges)) return;
+    
+    if (ranges.empty()) {
+        response.status = 416;
+        response.headers += "Content-Range: bytes */";
+        appendNumber(response.headers, size);
+        response.headers += "\r\n";
+        response.file.reset();
+        response.body.clear();
+        return;
+    }
+    
+    response.status = 206;
+    if (ranges.size() == 1) {
+        response.headers += "Content-Range: bytes ";
+        appendNumber(response.headers, ranges[0].first);
+        response.headers += '-';
+        appendNumber(response.headers, ranges[0].last);
+        response.headers += '/';
+        appendNumber(response.headers, size);
+        response.headers += "\r\n";
+        response.fileOffset = ranges[0].first;
+        response.fileLength = ranges[0].last - ranges[0].first + 1;
+    } else {
+        static std::atomic<unsigned> counter(0);
+        char boundary[40];
+        snprintf(boundary, sizeof(boundary), "MTWS_%08x%08x", (unsigned)getpid(), counter.fetch_add(1));
+        response.boundary = boundary;
+        response.ranges = std::move(ranges);
+    }
+}
+
+// Conditional requests
+std::vector<std::pair<std::string, std::string>> g_cacheControlRules; // path pattern -> Cache-Control value
+
+// Cache-Control policy for a request path; the first matching --cache-control pattern wins
+std::string cacheControlFor(const std::string& path) {
+    for (const auto& rule : g_cacheControlRules) {
+        if (fnmatch(rule.first.c_str(), path.c_str(), 0) == 0) return rule.second;
+    }
+    return "";
+}
+
+// Does an If-None-Match list contain the tag? Uses weak comparison, so W/ prefixes are ignored.
+bool etagListMatches(std::string_view list, std::string_view tag) {
+    if (tag.compare(0, 2, "W/") == 0) tag.remove_prefix(2);
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string_view item = trimWhitespace(list.substr(0, comma));
+        if (item == "*") return true;
+        if (item.compare(0, 2, "W/") == 0) item.remove_prefix(2);
+        if (item == tag) return true;
+        if (comma == std::string_view::npos) break;
+        list.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// If-None-Match takes precedence over If-Modified-Since
+bool isNotModified(std::string_view ifNoneMatch, std::string_view ifModifiedSince, const HttpResponse& response) {
+    if (!ifNoneMatch.empty()) {
+        return !response.etag.empty() && etagListMatches(ifNoneMatch, response.etag);
+    }
+    if (!ifModifiedSince.empty() && response.lastModified) {
+        time_t since = parseHttpDate(std::string(ifModifiedSince));
+        return since >= 0 && response.lastModified <= since;
+    }
+    return false;
+}
+
+// Background work
+// Each thread has its own queue. Jobs are dealt out round robin and a thread whose queue is empty takes
+// jobs from the others, so a job stuck on a slow disk only holds up itself.
+struct ThreadPool {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::mutex idleMutex;
+    std::condition_variable idle;
+    std::atomic<size_t> depth{0}; // jobs queued and not started yet
+    std::atomic<size_t> nextQueue{0};
+    size_t maxQueue;
+    
+    ThreadPool(int threads, size_t maxQueue) : maxQueue(maxQueue) {
+        for (int i = 0; i < threads; i++) {
+            queues.emplace_back(new Queue);
+        }
+        for (int i = 0; i < threads; i++) {
+            std::thread([this, i] { run(i); }).detach();
+        }
+    }
+    
+    // Returns false if the queue is full; the caller does the work itself or goes without the result
+    bool submit(std::function<void()> job) {
+        if (depth.load(std::memory_order_relaxed) >= maxQueue) return false;
+        {
+            // Counted first so 'depth' never drops below zero; an idle thread that wakes up before the
+            // job is queued just looks again
+            std::lock_guard<std::mutex> lock(idleMutex);
+            depth++;
+        }
+        Queue& queue = *queues[nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.jobs.push_back(std::move(job));
+        }
+        idle.notify_one();
+        return true;
+    }
+    
+    // The oldest job of this thread's queue, or of the first other queue that has one
+    bool take(size_t self, std::function<void()>& job) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue& queue = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.jobs.empty()) continue;
+            job = std::move(queue.jobs.front());
+            queue.jobs.pop_front();
+            depth--;
+            return true;
+        }
+        return false;
+    }
+    
+    void run(size_t self) {
+        while (true) {
+            std::function<void()> job;
+            if (take(self, job)) {
+                job();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idleMutex);
+            idle.wait(lock, [this] { return depth.load() > 0; });
+        }
+    }
+};
+
+// Filesystem work (stat, open, directory listings) runs here instead of on the event loops,
+// so a slow disk never stalls the network
+int g_ioThreads = 4; // 0 does filesystem work on the event loops
+ThreadPool* g_ioPool = nullptr;
+
+void startIoPool() {
+    if (g_ioThreads > 0) g_ioPool = new ThreadPool(g_ioThreads, 65536);
+}
+
+// Metrics
+// Every worker counts into its own cache-line aligned block, so nothing is shared on the request path.
+// The metrics endpoint and the stats command add the blocks up when asked.
+const int LATENCY_SUB_BUCKETS = 16; // per power of two, so each bucket is at most ~6% wide
+const int LATENCY_BUCKETS = 34 * LATENCY_SUB_BUCKETS; // microseconds up to 2^37 (about 38 hours)
+
+struct alignas(64) WorkerMetrics {
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> bytesOut;
+    std::atomic<uint64_t> connectionsAccepted;
+    std::atomic<uint64_t> connectionsClosed;
+    std::atomic<uint64_t> cacheHits;
+    std::atomic<uint64_t> cacheMisses;
+    std::atomic<uint64_t> ioJobs; // requests handed to the I/O pool
+    std::atomic<uint64_t> ioCancelled; // ... whose client went away before they were answered
+    std::atomic<uint64_t> readsPaused; // times a connection stopped being read because its output piled up
+    std::atomic<uint64_t> timeouts; // connections closed by a header, body or send timeout
+    std::atomic<uint64_t> connectionsRefused; // closed right away: the client had too many open
+    std::atomic<uint64_t> rateLimited; // requests answered with 429
+    std::atomic<uint64_t> shed; // requests answered with 503 because the server was overloaded
+    std::atomic<uint64_t> upstreamRequests; // requests forwarded to an upstream
+    std::atomic<uint64_t> upstreamErrors; // ... attempts that failed (refused, reset, timed out)
+    std::atomic<uint64_t> acceptQueue; // connections waiting to be accepted, sampled every second
+    std::atomic<uint64_t> allocations; // calls into the global allocator (MTWS_COUNT_ALLOCATIONS builds only)
+    std::atomic<uint64_t> latencySum;  // microseconds
+    std::atomic<uint64_t> statuses[MAX_STATUS];
+    std::atomic<uint64_t> latency[LATENCY_BUCKETS];
+};
+
+WorkerMetrics g_metrics[MAX_WORKERS]; // zero-initialized, and kept across restarts
+std::atomic<int> g_metricsWorkers(0);  // highest worker count so far
+thread_local WorkerMetrics* t_metrics = nullptr; // the calling worker's block; null on other threads
+
+// Only the owning worker writes its block, so a plain load and store is enough
+inline void bump(std::atomic<uint64_t>& counter, uint64_t amount = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+#ifdef MTWS_COUNT_ALLOCATIONS
+// Debug builds count every call into the global allocator, so the stats show how many a request costs
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // GCC does not see that new and delete below are a pair
+thread_local uint64_t t_allocations = 0;
+
+void* operator new(size_t size) {
+    t_allocations++;
+    void* block = malloc(size ? size : 1);
+    if (!block) throw std::bad_alloc();
+    return block;
+}
+
+void operator delete(void* block) noexcept { free(block); }
+void operator delete(void* block, size_t) noexcept { free(block); }
+#endif
+
+time_t monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+uint64_t monotonicMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// HDR-style bucketing: exact below 16us, then 16 linear sub-buckets per power of two
+int latencyBucket(uint64_t micros) {
+    if (micros < LATENCY_SUB_BUCKETS) return micros;
+    int exponent = 63 - __builtin_clzll(micros);
+    int bucket = (exponent - 3) * LATENCY_SUB_BUCKETS + ((micros >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1));
+    return std::min(bucket, LATENCY_BUCKETS - 1);
+}
+
+// Smallest value that no longer falls into the bucket
+uint64_t latencyBucketEnd(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) return bucket + 1;
+    int exponent = bucket / LATENCY_SUB_BUCKETS + 3;
+    uint64_t width = 1ULL << (exponent - 4);
+    return (LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) * width + width;
+}
+
+void recordLatency(uint64_t micros) {
+    if (!t_metrics) return;
+    bump(t_metrics->latency[latencyBucket(micros)]);
+    bump(t_metrics->latencySum, micros);
+}
+
+// Only text-like content shrinks enough to be worth compressing
+bool isCompressible(std::string_view contentType) {
+    return contentType.compare(0, 5, "text/") == 0 || contentType == "application/javascript" || 
+           contentType == "application/json" || contentType == "image/svg+xml" || contentType == "application/xml";
+}
+
+// A precompressed copy of a file that sits next to it
+struct Sidecar {
+    int encoding;
+    std::shared_ptr<OpenFile> file;
+    size_t size;
+};
+
+// File cache
+const int CACHE_SHARDS = 16;
+const size_t CACHE_SMALL_FILE = 32 * 1024; // files up to this size are kept in memory as a complete response
+const size_t CACHE_ENTRY_OVERHEAD = 256;
+size_t g_cacheMaxBytes = 64 * 1024 * 1024; // 0 disables the cache
+size_t g_cacheMaxEntries = 4096;
+std::atomic<bool> g_cacheEnabled(false);
+
+// What a request path resolved to. Only files carry a response; the others just save the lookup.
+enum Resolution { RESOLVED_FILE, RESOLVED_LISTING, RESOLVED_MISSING };
+
+// A shard's entries by an on-disk name, so an inotify event only visits the entries it affects
+using CacheIndex = std::multimap<std::string_view, CachedFile*>;
+
+// A resolved request path: metadata plus either the open file or, for small files, the whole response
+
+struct CachedFile {
+    std::string key;       // decoded request path
+    Resolution kind = RESOLVED_FILE;
+    std::string filePath;  // normalized path of the file (or listed directory) on disk
+    std::string dir;       // watched directory whose changes can change the resolution
+    std::string contentType;
+    off_t size = 0;
+    time_t mtime = 0;
+    std::string etag;
+    std::string cacheControl;
+    std::shared_ptr<OpenFile> file; // large files only
+    std::string response;           // small files only: complete keep-alive 200 response
+    std::vector<Sidecar> sidecars;  // precompressed copies
+    size_t headerLength = 0;
+    size_t cost = 0;
+    std::atomic<bool> referenced{true}; // CLOCK reference bit
+    size_t slot = 0;                    // position in the shard's CLOCK ring
+    CacheIndex::iterator byPath, byDir; // positions in the shard's indexes
+};
+
+struct alignas(64) CacheShard {
+    std::shared_mutex mutex;
+    std::unordered_map<std::string_view, std::shared_ptr<CachedFile>> entries; // keys view the entries' own 'key'
+    std::vector<std::shared_ptr<CachedFile>> ring;
+    CacheIndex byPath; // keys view the entries' 'filePath'
+    CacheIndex byDir;  // keys view the entries' 'dir'
+    size_t hand = 0;
+    size_t bytes = 0;
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> invalidations{0};
+};
+
+CacheShard g_cacheShards[CACHE_SHARDS];
+// Bumped by invalidations, striped by the on-disk name that changed. A path being resolved only has
+// to watch the stripes of its own name and the directories above it.
+const size_t CACHE_GENERATIONS = 256;
+std::atomic<uint64_t> g_cacheGenerations[CACHE_GENERATIONS];
+int g_inotifyFd = -1;
+std::mutex g_watchMutex;
+// inotify watch descriptor -> every name the directory was watched under. A directory reached through a
+// symlink has several names but only one watch, and events have to reach the entries under each of them.
+std::unordered_map<int, std::vector<std::string>> g_watchDirs;
+std::unordered_set<std::string> g_watchedDirs;
+
+CacheShard& cacheShard(std::string_view key) {
+    return g_cacheShards[std::hash<std::string_view>()(key) % CACHE_SHARDS];
+}
+
+// 'name' is a normalized path relative to the web root, as the watcher spells it ("." for the root)
+void cacheBumpGeneration(std::string_view name) {
+    g_cacheGenerations[std::hash<std::string_view>()(name) % CACHE_GENERATIONS].fetch_add(1);
+}
+
+// Changes whenever something is invalidated that could change what 'key' (a decoded request path) resolves to
+uint64_t cacheGeneration(std::string_view key) {
+    std::hash<std::string_view> hash;
+    uint64_t sum = g_cacheGenerations[hash(".") % CACHE_GENERATIONS].load();
+    for (size_t i = 2; i <= key.size(); i++) {
+        if ((i == key.size() || key[i] == '/') && key[i - 1] != '/') {
+            sum += g_cacheGenerations[hash(key.substr(1, i - 1)) % CACHE_GENERATIONS].load();
+        }
+    }
+    return sum;
+}
+
+// 'count' is false for a second look at a path whose first lookup was counted already
+std::shared_ptr<const CachedFile> cacheLookup(std::string_view key, bool count = true) {
+    if (!g_cacheEnabled.load(std::memory_order_relaxed)) return nullptr;
+    CacheShard& shard = cacheShard(key);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {
+        if (t_metrics && count) bump(t_metrics->cacheMisses);
+        return nullptr;
+    }
+    if (!it->second->referenced.load(std::memory_order_relaxed)) {
+        it->second->referenced.store(true, std::memory_order_relaxed);
+    }
+    if (t_metrics && count) bump(t_metrics->cacheHits);
+    return it->second;
+}
+
+// Caller holds the shard's exclusive lock
+void cacheRemoveLocked(CacheShard& shard, const std::shared_ptr<CachedFile>& entry) {
+    size_t slot = entry->slot;
+    shard.ring[slot] = shard.ring.back();
+    shard.ring[slot]->slot = slot;
+    shard.ring.pop_back();
+    if (shard.hand >= shard.ring.size()) shard.hand = 0;
+    shard.bytes -= entry->cost;
+    shard.byPath.erase(entry->byPath);
+    shard.byDir.erase(entry->byDir);
+    shard.entries.erase(entry->key);
+}
+
+// Watch a directory so changes to anything cached from it invalidate the cache
+bool watchDirectory(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(g_watchMutex);
+    if (g_watchedDirs.count(dir)) return true;
+    if (g_inotifyFd < 0) return false;
+    
+    int wd = inotify_add_watch(g_inotifyFd, dir.c_str(), IN_ONLYDIR | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | 
+                                                        IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0) return false;
+    g_watchDirs[wd].push_back(dir);
+    g_watchedDirs.insert(dir);
+    return true;
+}
+
+// Add an entry, evicting others as needed. 'generation' is the value of cacheGeneration() before the
+// path was looked up; if anything it depends on changed on disk since, the entry is dropped.
+void cacheInsert(const std::shared_ptr<CachedFile>& entry, uint64_t generation) {
+    entry->cost = entry->response.size() + entry->key.size() + entry->filePath.size() + CACHE_ENTRY_OVERHEAD;
+    
+    const std::string& key = entry->key;
+    CacheShard& shard = cacheShard(key);
+    size_t maxBytes = g_cacheMaxBytes / CACHE_SHARDS;
+    size_t maxEntries = std::max<size_t>(1, g_cacheMaxEntries / CACHE_SHARDS);
+    if (entry->cost > maxBytes) return;
+    
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    // Something changed on disk while the path was being resolved
+    if (cacheGeneration(key) != generation) return;
+    
+    auto existing = shard.entries.find(key);
+    if (existing != shard.entries.end()) cacheRemoveLocked(shard, existing->second);
+    
+    // CLOCK eviction: skip entries used since the hand last passed them
+    while (!shard.ring.empty() && (shard.bytes + entry->cost > maxBytes || shard.ring.size() >= maxEntries)) {
+        std::shared_ptr<CachedFile> victim = shard.ring[shard.hand];
+        if (victim->referenced.exchange(false, std::memory_order_relaxed)) {
+            shard.hand = (shard.hand + 1) % shard.ring.size();
+            continue;
+        }
+        cacheRemoveLocked(shard, victim);
+        shard.evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    entry->slot = shard.ring.size();
+    shard.ring.push_back(entry);
+    shard.entries.emplace(entry->key, entry);
+    entry->byPath = shard.byPath.emplace(entry->filePath, entry.get());
+    entry->byDir = shard.byDir.emplace(entry->dir, entry.get());
+    shard.bytes += entry->cost;
+}
+
+// Remember a path that resolved to a file. 'response' is the full 200 response for the file and
+// 'generation' the value of cacheGeneration() before the file was looked up.
+void cacheFile(const std::string& key, const std::string& filePath, const HttpResponse& response, 
+               const std::vector<Sidecar>& sidecars, uint64_t generation) {
+    if (!g_cacheEnabled || !response.file) return;
+    
+    fs::path normalized = fs::path(filePath).lexically_normal();
+    std::string dir = normalized.parent_path().string();
+    if (dir.empty()) dir = ".";
+    if (!watchDirectory(dir)) return;
+    
+    // The watch only covers changes from now on; make sure the open file is still what the path names
+    struct stat opened, current;
+    if (fstat(response.file->fd, &opened) < 0 || stat(filePath.c_str(), &current) < 0 ||
+        opened.st_dev != current.st_dev || opened.st_ino != current.st_ino) {
+        return;
+    }
+    
+    auto entry = std::make_shared<CachedFile>();
+    entry->key = key;
+    entry->filePath = normalized.string();
+    entry->dir = dir;
+    entry->contentType = response.contentType;
+    entry->size = opened.st_size;
+    entry->mtime = opened.st_mtime;
+    entry->etag = makeETag(opened, false);
+    entry->cacheControl = response.cacheControl;
+    entry->sidecars = sidecars;
+    
+    if ((size_t)opened.st_size <= CACHE_SMALL_FILE) {
+        HttpResponse full;
+        full.contentType = entry->contentType;
+        full.lastModified = entry->mtime;
+        full.etag = entry->etag;
+        full.cacheControl = entry->cacheControl;
+        full.headers = "Accept-Ranges: bytes\r\n";
+        if (isCompressible(full.contentType)) full.headers += "Vary: Accept-Encoding\r\n";
+        full.body.resize(opened.st_size);
+        size_t done = 0;
+        while (done < full.body.size()) {
+            ssize_t n = pread(response.file->fd, &full.body[done], full.body.size() - done, done);
+            if (n <= 0) return;
+            done += n;
+        }
+        entry->response = serializeStored(full);
+        entry->headerLength = entry->response.size() - full.body.size();
+    } else {
+        entry->file = response.file;
+    }
+    cacheInsert(entry, generation);
+}
+
+// Watch the nearest existing directory on the way to 'filePath' (normalized); returns it or "" on failure
+std::string watchNearestDirectory(const std::string& filePath) {
+    fs::path dir = fs::path(filePath).parent_path();
+    while (true) {
+        std::string name = dir.empty() ? "." : dir.string();
+        if (watchDirectory(name)) return name;
+        if (name == "." || (errno != ENOENT && errno != ENOTDIR)) return "";
+        dir = dir.parent_path();
+    }
+}
+
+// Remember a path that resolved to nothing on disk. The nearest existing directory is watched, so
+// creating the file or any directory on the way to it drops the entry again.
+void cacheMissing(const std::string& key, uint64_t generation) {
+    if (!g_cacheEnabled) return;
+    auto entry = std::make_shared<CachedFile>();
+    entry->key = key;
+    entry->kind = RESOLVED_MISSING;
+    entry->filePath = fs::path("." + key).lexically_normal().string();
+    entry->dir = watchNearestDirectory(entry->filePath);
+    if (entry->dir.empty()) return;
+    
+    // The watch only covers changes from now on
+    struct stat st;
+    if (fstatat(g_rootFd, key.c_str() + 1, &st, 0) == 0 || (errno != ENOENT && errno != ENOTDIR)) return;
+    cacheInsert(entry, generation);
+}
+
+// Remember a directory that has no index page, so later requests go straight to the explorer
+void cacheListing(const std::string& key, const std::string& dirPath, uint64_t generation) {
+    if (!g_cacheEnabled) return;
+    auto entry = std::make_shared<CachedFile>();
+    entry->key = key;
+    entry->kind = RESOLVED_LISTING;
+    entry->filePath = fs::path(dirPath).lexically_normal().string();
+    while (entry->filePath.size() > 1 && entry->filePath.back() == '/') entry->filePath.pop_back();
+    entry->dir = entry->filePath;
+    if (!watchDirectory(entry->dir)) return;
+    
+    struct stat st;
+    for (const char* index : {"/index.html", "/index.htm"}) {
+        if (stat((entry->dir + index).c_str(), &st) == 0) return;
+    }
+    cacheInsert(entry, generation);
+}
+
+// Entries of a shard that a change to 'path' in 'dir' affects. Caller holds the shard's lock.
+void cacheMatchesLocked(CacheShard& shard, const std::string& dir, const std::string& path, 
+                        const std::string& base, bool structural, std::vector<CachedFile*>& matches) {
+    matches.clear();
+    auto range = shard.byPath.equal_range(path);
+    for (auto it = range.first; it != range.second; ++it) matches.push_back(it->second);
+    // Names like "docs.html" sort between "docs" and "docs/", so the entries below start at the prefix
+    std::string prefix = path + "/";
+    for (auto it = shard.byPath.lower_bound(prefix); it != shard.byPath.end(); ++it) {
+        if (it->first.compare(0, prefix.size(), prefix) != 0) break;
+        matches.push_back(it->second);
+    }
+    if (!base.empty()) {
+        auto range = shard.byPath.equal_range(base);
+        for (auto it = range.first; it != range.second; ++it) matches.push_back(it->second);
+    }
+    if (structural) {
+        auto range = shard.byDir.equal_range(dir);
+        for (auto it = range.first; it != range.second; ++it) matches.push_back(it->second);
+    }
+    std::sort(matches.begin(), matches.end());
+    matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+}
+
+// Drop entries for 'path' and everything below it. A new or moved-in name can also change
+// which index file a directory resolves to, so it drops everything served from 'dir'.
+void cacheInvalidate(const std::string& dir, const std::string& path, bool structural) {
+    // A precompressed copy invalidates the file it belongs to
+    std::string base;
+    for (std::string_view suffix : {".br", ".zst", ".gz"}) {
+        if (path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            base = path.substr(0, path.size() - suffix.size());
+        }
+    }
+    
+    // Inserts that started resolving before this point are refused from now on. A directory's own
+    // request path resolves through its index page, so that counts as a change to the directory.
+    std::string_view name = std::string_view(path).substr(path.rfind('/') + 1);
+    cacheBumpGeneration(path);
+    if (!base.empty()) cacheBumpGeneration(base);
+    if (structural || name == "index.html" || name == "index.htm") cacheBumpGeneration(dir);
+    
+    std::vector<CachedFile*> matches;
+    for (auto& shard : g_cacheShards) {
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            cacheMatchesLocked(shard, dir, path, base, structural, matches);
+        }
+        if (matches.empty()) continue;
+        
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        cacheMatchesLocked(shard, dir, path, base, structural, matches);
+        for (CachedFile* match : matches) {
+            std::shared_ptr<CachedFile> entry = shard.ring[match->slot];
+            cacheRemoveLocked(shard, entry);
+            shard.invalidations.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void cacheClear() {
+    for (auto& generation : g_cacheGenerations) generation.fetch_add(1);
+    for (auto& shard : g_cacheShards) {
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.entries.clear();
+        shard.ring.clear();
+        shard.byPath.clear();
+        shard.byDir.clear();
+        shard.hand = 0;
+        shard.bytes = 0;
+    }
+}
+
+// Background thread that turns inotify events into cache invalidations
+void cacheWatcher() {
+    alignas(inotify_event) char buffer[64 * 1024];
+    while (true) {
+        ssize_t len = read(g_inotifyFd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) continue;
+            break;
+        }
+        
+        for (char* ptr = buffer; ptr < buffer + len;) {
+            inotify_event* event = reinterpret_cast<inotify_event*>(ptr);
+            ptr += sizeof(inotify_event) + event->len;
+            
+            if (event->mask & IN_Q_OVERFLOW) {
+                cacheClear();
+                continue;
+            }
+            
+            std::vector<std::string> dirs;
+            {
+                std::lock_guard<std::mutex> lock(g_watchMutex);
+                auto it = g_watchDirs.find(event->wd);
+                if (it == g_watchDirs.end()) continue;
+                dirs = it->second;
+                if (event->mask & IN_IGNORED) {
+                    for (const std::string& dir : dirs) g_watchedDirs.erase(dir);
+                    g_watchDirs.erase(it);
+                }
+            }
+            
+            for (const std::string& dir : dirs) {
+                if (event->len > 0) {
+                    std::string path = dir == "." ? std::string(event->name) : dir + "/" + event->name;
+                    cacheInvalidate(dir, path, event->mask & (IN_CREATE | IN_MOVED_TO));
+                } else {
+                    // The watched directory itself went away or moved
+                    cacheInvalidate(dir, dir, true);
+                }
+            }
+        }
+    }
+    log(LogLevel::WARN, "File cache watcher stopped; disabling cache");
+    g_cacheEnabled = false;
+    cacheClear();
+}
+
+void startFileCache() {
+    if (g_cacheMaxBytes == 0) return;
+    g_inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (g_inotifyFd < 0) {
+        log(LogLevel::WARN, "inotify unavailable; file cache disabled");
+        return;
+    }
+    g_cacheEnabled = true;
+    std::thread watcher(cacheWatcher);
+    watcher.detach();
+}
+
+// All workers' counters added up
+struct MetricsSnapshot {
+    int workers = 0;
+    std::vector<uint64_t> requests, bytesOut, connectionsActive, acceptQueue; // per worker
+    uint64_t connectionsAccepted = 0;
+    uint64_t cacheHits = 0, cacheMisses = 0;
+    uint64_t ioJobs = 0, ioCancelled = 0, ioQueued = 0;
+    uint64_t readsPaused = 0, timeouts = 0;
+    uint64_t connectionsRefused = 0, rateLimited = 0, shed = 0;
+    uint64_t upstreamRequests = 0, upstreamErrors = 0;
+    uint64_t allocations = 0;
+    uint64_t latencySum = 0, latencyCount = 0;
+    std::vector<uint64_t> statuses = std::vector<uint64_t>(MAX_STATUS);
+    std::vector<uint64_t> latency = std::vector<uint64_t>(LATENCY_BUCKETS);
+};
+
+MetricsSnapshot collectMetrics() {
+    MetricsSnapshot snapshot;
+    snapshot.workers = g_metricsWorkers.load();
+    for (int i = 0; i < snapshot.workers; i++) {
+        WorkerMetrics& metrics = g_metrics[i];
+        uint64_t accepted = metrics.connectionsAccepted.load(std::memory_order_relaxed);
+        uint64_t closed = metrics.connectionsClosed.load(std::memory_order_relaxed);
+        snapshot.requests.push_back(metrics.requests.load(std::memory_order_relaxed));
+        snapshot.bytesOut.push_back(metrics.bytesOut.load(std::memory_order_relaxed));
+        snapshot.connectionsActive.push_back(accepted > closed ? accepted - closed : 0);
+        snapshot.acceptQueue.push_back(metrics.acceptQueue.load(std::memory_order_relaxed));
+        snapshot.connectionsAccepted += accepted;
+        snapshot.cacheHits += metrics.cacheHits.load(std::memory_order_relaxed);
+        snapshot.cacheMisses += metrics.cacheMisses.load(std::memory_order_relaxed);
+        snapshot.ioJobs += metrics.ioJobs.load(std::memory_order_relaxed);
+        snapshot.ioCancelled += metrics.ioCancelled.load(std::memory_order_relaxed);
+        snapshot.readsPaused += metrics.readsPaused.load(std::memory_order_relaxed);
+        snapshot.timeouts += metrics.timeouts.load(std::memory_order_relaxed);
+        snapshot.connectionsRefused += metrics.connectionsRefused.load(std::memory_order_relaxed);
+        snapshot.rateLimited += metrics.rateLimited.load(std::memory_order_relaxed);
+        snapshot.shed += metrics.shed.load(std::memory_order_relaxed);
+        snapshot.upstreamRequests += metrics.upstreamRequests.load(std::memory_order_relaxed);
+        snapshot.upstreamErrors += metrics.upstreamErrors.load(std::memory_order_relaxed);
+        snapshot.allocations += metrics.allocations.load(std::memory_order_relaxed);
+        snapshot.latencySum += metrics.latencySum.load(std::memory_order_relaxed);
+        for (int status = 0; status < MAX_STATUS; status++) {
+            snapshot.statuses[status] += metrics.statuses[status].load(std::memory_order_relaxed);
+        }
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            uint64_t count = metrics.latency[bucket].load(std::memory_order_relaxed);
+            snapshot.latency[bucket] += count;
+            snapshot.latencyCount += count;
+        }
+    }
+    if (g_ioPool) snapshot.ioQueued = g_ioPool->depth.load();
+    return snapshot;
+}
+
+// Upper bound of the latency below which 'fraction' of all requests completed
+uint64_t latencyPercentile(const MetricsSnapshot& snapshot, double fraction) {
+    if (snapshot.latencyCount == 0) return 0;
+    uint64_t target = std::max<uint64_t>(1, (uint64_t)(fraction * snapshot.latencyCount + 0.5));
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += snapshot.latency[bucket];
+        if (seen >= target) return latencyBucketEnd(bucket) - 1;
+    }
+    return latencyBucketEnd(LATENCY_BUCKETS - 1) - 1;
+}
+
+// Connections the kernel dropped because an accept queue was full. The counters are system-wide.
+bool readListenDrops(uint64_t& overflows, uint64_t& drops) {
+    std::ifstream netstat("/proc/net/netstat");
+    std::string names, values;
+    while (std::getline(netstat, names) && std::getline(netstat, values)) {
+        if (names.compare(0, 7, "TcpExt:") != 0) continue;
+        std::istringstream nameStream(names), valueStream(values);
+        std::string name, value;
+        bool found = false;
+        while (nameStream >> name && valueStream >> value) {
+            if (name == "ListenOverflows") overflows = std::stoull(value), found = true;
+            if (name == "ListenDrops") drops = std::stoull(value);
+        }
+        return found;
+    }
+    return false;
+}
+
+std::string formatMicros(uint64_t micros) {
+    char buffer[32];
+    if (micros < 1000) snprintf(buffer, sizeof(buffer), "%lluus", (unsigned long long)micros);
+    else if (micros < 1000000) snprintf(buffer, sizeof(buffer), "%.2fms", micros / 1000.0);
+    else snprintf(buffer, sizeof(buffer), "%.2fs", micros / 1000000.0);
+    return buffer;
+}
+
+void logCacheStats() {
+    size_t entries = 0, bytes = 0;
+    uint64_t evictions = 0, invalidations = 0;
+    for (auto& shard : g_cacheShards) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        entries += shard.ring.size();
+        bytes += shard.bytes;
+        evictions += shard.evictions;
+        invalidations += shard.invalidations;
+    }
+    MetricsSnapshot snapshot = collectMetrics();
+    log(LogLevel::INFO, "File cache: " + std::to_string(entries) + " entries, " + std::to_string(bytes / 1024) + " KiB" + 
+                        (g_cacheEnabled ? "" : " (disabled)"));
+    log(LogLevel::INFO, "  hits " + std::to_string(snapshot.cacheHits) + ", misses " + std::to_string(snapshot.cacheMisses) + 
+                        ", evictions " + std::to_string(evictions) + ", invalidations " + std::to_string(invalidations));
+}
+
+// Summary for the stats console command
+void logStats() {
+    MetricsSnapshot snapshot = collectMetrics();
+    uint64_t requests = 0, bytesOut = 0, active = 0, queued = 0;
+    for (int i = 0; i < snapshot.workers; i++) {
+        requests += snapshot.requests[i];
+        bytesOut += snapshot.bytesOut[i];
+        active += snapshot.connectionsActive[i];
+        queued += snapshot.acceptQueue[i];
+    }
+    
+    std::string statuses;
+    for (int status = 0; status < MAX_STATUS; status++) {
+        if (snapshot.statuses[status] == 0) continue;
+        statuses += (statuses.empty() ? "" : ", ") + std::to_string(status) + " x" + std::to_string(snapshot.statuses[status]);
+    }
+    log(LogLevel::INFO, "Requests: " + std::to_string(requests) + " (" + (statuses.empty() ? "none" : statuses) + ")");
+    char sent[32];
+    snprintf(sent, sizeof(sent), "%.2f", bytesOut / (1024.0 * 1024.0));
+    log(LogLevel::INFO, std::string("Sent: ") + sent + " MiB, reading paused " + std::to_string(snapshot.readsPaused) + 
+                        " times for clients that read slowly");
+#ifdef MTWS_COUNT_ALLOCATIONS
+    char allocations[32];
+    snprintf(allocations, sizeof(allocations), "%.2f", requests ? (double)snapshot.allocations / requests : 0.0);
+    log(LogLevel::INFO, std::string("Allocations: ") + allocations + " per request (" + std::to_string(snapshot.allocations) + " on the workers)");
+#endif
+    
+    std::string perWorker;
+    for (int i = 0; i < snapshot.workers; i++) {
+        perWorker += (i ? ", " : "") + std::to_string(snapshot.connectionsActive[i]);
+    }
+    log(LogLevel::INFO, "Connections: " + std::to_string(active) + " active (per worker: " + perWorker + "), " + 
+                        std::to_string(snapshot.connectionsAccepted) + " accepted, " + std::to_string(queued) + " waiting to be accepted, " + 
+                        std::to_string(snapshot.timeouts) + " timed out");
+    uint64_t overflows = 0, drops = 0;
+    if (readListenDrops(overflows, drops)) {
+        log(LogLevel::INFO, "Accept queue overflows (system-wide): " + std::to_string(overflows) + ", listen drops: " + std::to_string(drops));
+    }
+    if (snapshot.latencyCount > 0) {
+        log(LogLevel::INFO, "Latency: p50 " + formatMicros(latencyPercentile(snapshot, 0.5)) + 
+                            ", p90 " + formatMicros(latencyPercentile(snapshot, 0.9)) + 
+                            ", p99 " + formatMicros(latencyPercentile(snapshot, 0.99)) + 
+                            ", p99.9 " + formatMicros(latencyPercentile(snapshot, 0.999)) + 
+                            ", max " + formatMicros(latencyPercentile(snapshot, 1.0)) + 
+                            ", mean " + formatMicros(snapshot.latencySum / snapshot.latencyCount));
+    }
+    if (snapshot.connectionsRefused + snapshot.rateLimited + snapshot.shed > 0) {
+        log(LogLevel::INFO, "Admission: " + std::to_string(snapshot.connectionsRefused) + " connections refused, " + 
+                            std::to_string(snapshot.rateLimited) + " requests rate limited, " + 
+                            std::to_string(snapshot.shed) + " shed under overload");
+    }
+    if (g_ioPool) {
+        log(LogLevel::INFO, "I/O pool: " + std::to_string(g_ioThreads) + " threads, " + std::to_string(snapshot.ioQueued) + " queued, " + 
+                            std::to_string(snapshot.ioJobs) + " jobs, " + std::to_string(snapshot.ioCancelled) + " cancelled");
+    }
+    if (!g_upstreams.empty()) {
+        log(LogLevel::INFO, "Proxy: " + std::to_string(snapshot.upstreamRequests) + " requests forwarded, " + 
+                            std::to_string(snapshot.upstreamErrors) + " upstream errors");
+        for (const auto& upstream : g_upstreams) {
+            bool down = upstream->downUntil.load() > monotonicSeconds();
+            log(LogLevel::INFO, "  - " + upstream->name + ": " + std::to_string(upstream->active.load()) + " active" + (down ? ", down" : ""));
+        }
+    }
+    logCacheStats();
+}
+
+// Prometheus text exposition format, served at METRICS_PATH
+std::string metricsText() {
+    MetricsSnapshot snapshot = collectMetrics();
+    std::string out;
+    auto family = [&out](const char* name, const char* type, const char* help) {
+        out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+    };
+    auto perWorker = [&out, &snapshot](const char* name, const std::vector<uint64_t>& values) {
+        for (int i = 0; i < snapshot.workers; i++) {
+            out += std::string(name) + "{worker=\"" + std::to_string(i) + "\"} " + std::to_string(values[i]) + "\n";
+        }
+    };
+    
+    family("mtws_requests_total", "counter", "Requests answered.");
+    perWorker("mtws_requests_total", snapshot.requests);
+    family("mtws_sent_bytes_total", "counter", "Bytes written to clients, headers included.");
+    perWorker("mtws_sent_bytes_total", snapshot.bytesOut);
+    family("mtws_connections_active", "gauge", "Open client connections.");
+    perWorker("mtws_connections_active", snapshot.connectionsActive);
+    family("mtws_accept_queue_length", "gauge", "Connections waiting in the listen backlog.");
+    perWorker("mtws_accept_queue_length", snapshot.acceptQueue);
+    family("mtws_connections_accepted_total", "counter", "Client connections accepted.");
+    out += "mtws_connections_accepted_total " + std::to_string(snapshot.connectionsAccepted) + "\n";
+    
+    family("mtws_responses_total", "counter", "Responses by status code.");
+    for (int status = 0; status < MAX_STATUS; status++) {
+        if (snapshot.statuses[status] == 0) continue;
+        out += "mtws_responses_total{code=\"" + std::to_string(status) + "\"} " + std::to_string(snapshot.statuses[status]) + "\n";
+    }
+    
+    family("mtws_file_cache_hits_total", "counter", "Requests answered from the file cache.");
+    out += "mtws_file_cache_hits_total " + std::to_string(snapshot.cacheHits) + "\n";
+    family("mtws_file_cache_misses_total", "counter", "Requests that had to look at the filesystem.");
+    out += "mtws_file_cache_misses_total " + std::to_string(snapshot.cacheMisses) + "\n";
+    
+    family("mtws_io_queue_depth", "gauge", "Filesystem jobs waiting for an I/O thread.");
+    out += "mtws_io_queue_depth " + std::to_string(snapshot.ioQueued) + "\n";
+    family("mtws_io_jobs_total", "counter", "Requests whose filesystem work ran on the I/O pool.");
+    out += "mtws_io_jobs_total " + std::to_string(snapshot.ioJobs) + "\n";
+    family("mtws_io_cancelled_total", "counter", "I/O pool jobs dropped because the client disconnected.");
+    out += "mtws_io_cancelled_total " + std::to_string(snapshot.ioCancelled) + "\n";
+    
+    family("mtws_timeouts_total", "counter", "Connections closed because a request head, request body or send timed out.");
+    out += "mtws_timeouts_total " + std::to_string(snapshot.timeouts) + "\n";
+    family("mtws_reads_paused_total", "counter", "Times a connection was not read because its unsent output reached the high watermark.");
+    out += "mtws_reads_paused_total " + std::to_string(snapshot.readsPaused) + "\n";
+    family("mtws_connections_refused_total", "counter", "Connections closed right away because the client had too many open.");
+    out += "mtws_connections_refused_total " + std::to_string(snapshot.connectionsRefused) + "\n";
+    family("mtws_rate_limited_total", "counter", "Requests answered with 429 because the client exceeded its request rate.");
+    out += "mtws_rate_limited_total " + std::to_string(snapshot.rateLimited) + "\n";
+    family("mtws_shed_total", "counter", "Requests answered with 503 because the server was overloaded.");
+    out += "mtws_shed_total " + std::to_string(snapshot.shed) + "\n";
+#ifdef MTWS_COUNT_ALLOCATIONS
+    family("mtws_allocations_total", "counter", "Calls into the global allocator on the worker threads.");
+    out += "mtws_allocations_total " + std::to_string(snapshot.allocations) + "\n";
+#endif
+    
+    if (!g_upstreams.empty()) {
+        family("mtws_upstream_requests_total", "counter", "Requests forwarded to an upstream.");
+        out += "mtws_upstream_requests_total " + std::to_string(snapshot.upstreamRequests) + "\n";
+        family("mtws_upstream_errors_total", "counter", "Upstream attempts that were refused, reset or timed out.");
+        out += "mtws_upstream_errors_total " + std::to_string(snapshot.upstreamErrors) + "\n";
+        family("mtws_upstream_up", "gauge", "Whether an upstream is used (0 while it is passed over after failing).");
+        for (const auto& upstream : g_upstreams) {
+            bool down = upstream->downUntil.load() > monotonicSeconds();
+            out += "mtws_upstream_up{upstream=\"" + upstream->name + "\"} " + (down ? "0" : "1") + "\n";
+        }
+    }
+    
+    uint64_t overflows = 0, drops = 0;
+    if (readListenDrops(overflows, drops)) {
+        family("mtws_listen_overflows_total", "counter", "Connections dropped because an accept queue was full (system-wide).");
+        out += "mtws_listen_overflows_total " + std::to_string(overflows) + "\n";
+        family("mtws_listen_drops_total", "counter", "Connections dropped while being accepted (system-wide).");
+        out += "mtws_listen_drops_total " + std::to_string(drops) + "\n";
+    }
+    
+    // Cumulative buckets at the usual boundaries, taken from the finer internal histogram
+    static const uint64_t bounds[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 
+                                      250000, 500000, 1000000, 2500000, 5000000, 10000000};
+    family("mtws_request_duration_seconds", "histogram", "Time from reading a request to writing the last byte of its response.");
+    int bucket = 0;
+    uint64_t cumulative = 0;
+    char line[128];
+    for (uint64_t bound : bounds) {
+        while (bucket < LATENCY_BUCKETS && latencyBucketEnd(bucket) - 1 <= bound) cumulative += snapshot.latency[bucket++];
+        snprintf(line, sizeof(line), "mtws_request_duration_seconds_bucket{le=\"%g\"} %llu\n", bound / 1e6, (unsigned long long)cumulative);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "mtws_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)snapshot.latencyCount);
+    out += line;
+    snprintf(line, sizeof(line), "mtws_request_duration_seconds_sum %.6f\n", snapshot.latencySum / 1e6);
+    out += line;
+    out += "mtws_request_duration_seconds_count " + std::to_string(snapshot.latencyCount) + "\n";
+    
+    family("mtws_log_lines_dropped_total", "counter", "Log lines dropped because logging fell behind.");
+    out += "mtws_log_lines_dropped_total " + std::to_string(g_logDropped.load()) + "\n";
+    return out;
+}
+
+// Fill in the response for a cache hit
+void cachedResponse(const std::shared_ptr<const CachedFile>& entry, HttpResponse& response) {
+    response.contentType = entry->contentType;
+    response.lastModified = entry->mtime;
+    response.etag = entry->etag;
+    response.cacheControl = entry->cacheControl;
+    if (entry->file) {
+        response.file = entry->file;
+        response.fileLength = entry->size;
+    } else {
+        response.cached = entry;
+    }
+}
+
+// Request parsing
+const size_t MAX_REQUEST_SIZE = 64 * 1024;
+const int MAX_HEADERS = 64;
+
+// Byte scanning used by the parser. Finds the first of up to three bytes, 16 or 32 bytes at a time.
+typedef const char* (*ScanFunction)(const char* p, const char* end, char a, char b, char c);
+
+const char* scanScalar(const char* p, const char* end, char a, char b, char c) {
+    for (; p < end; p++) {
+        if (*p == a || *p == b || *p == c) return p;
+    }
+    return end;
+}
+
+#if defined(__x86_64__)
+const char* scanSse2(const char* p, const char* end, char a, char b, char c) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)), 
+                                    _mm_cmpeq_epi8(chunk, vc));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return scanScalar(p, end, a, b, c);
+}
+
+__attribute__((target("avx2")))
+const char* scanAvx2(const char* p, const char* end, char a, char b, char c) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb)), 
+                                       _mm256_cmpeq_epi8(chunk, vc));
+        unsigned mask = _mm256_movemask_epi8(hits);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return scanSse2(p, end, a, b, c);
+}
+
+ScanFunction pickScanFunction() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? scanAvx2 : scanSse2;
+}
+#else
+ScanFunction pickScanFunction() {
+    return scanScalar;
+}
+#endif
+
+const ScanFunction g_scan = pickScanFunction();
+
+inline const char* scanFor(const char* p, const char* end, char a, char b, char c) {
+    return g_scan(p, end, a, b, c);
+}
+
+inline const char* scanFor(const char* p, const char* end, char a, char b) {
+    return g_scan(p, end, a, b, b);
+}
+
+inline const char* scanFor(const char* p, const char* end, char a) {
+    return g_scan(p, end, a, a, a);
+}
+
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+// A parsed request head. All views point into the connection's input buffer.
+struct RequestHead {
+    std::string_view method;
+    std::string_view target; // as sent
+    std::string_view path; // percent-decoded and normalized; a view of 'target' if that changed nothing
+    std::string_view query;
+    bool http10 = false;
+    bool keepAlive = true;
+    bool chunked = false;
+    size_t contentLength = 0;
+    std::string_view range;
+    std::string_view ifRange;
+    std::string_view ifNoneMatch;
+    std::string_view ifModifiedSince;
+    std::string_view acceptEncoding;
+    HttpHeader headers[MAX_HEADERS];
+    int headerCount = 0;
+    size_t length = 0; // bytes up to and including the terminating blank line
+    std::string decodedPath; // holds 'path' when the target had to be decoded or normalized
+    
+    std::string_view header(const char* name) const;
+    void rebase(const char* from, const char* to);
+};
+
+enum class ParseStatus { INCOMPLETE, COMPLETE, INVALID, TOO_LARGE };
+
+bool equalsIgnoreCase(std::string_view a, const char* b) {
+    size_t len = strlen(b);
+    return a.size() == len && strncasecmp(a.data(), b, len) == 0;
+}
+
+std::string_view RequestHead::header(const char* name) const {
+    for (int i = 0; i < headerCount; i++) {
+        if (equalsIgnoreCase(headers[i].name, name)) return headers[i].value;
+    }
+    return std::string_view();
+}
+
+// The request bytes moved from 'from' to 'to' (the input buffer grew or was compacted, or the head was
+// copied); follow them
+void RequestHead::rebase(const char* from, const char* to) {
+    auto follow = [from, to, this](std::string_view& view) {
+        if (view.data() >= from && view.data() <= from + length) view = std::string_view(to + (view.data() - from), view.size());
+    };
+    for (std::string_view* view : {&method, &target, &path, &query, &range, &ifRange, &ifNoneMatch, &ifModifiedSince, &acceptEncoding}) {
+        follow(*view);
+    }
+    // A copied head's path still views the original's storage
+    if (!decodedPath.empty()) path = decodedPath;
+    for (int i = 0; i < headerCount; i++) {
+        follow(headers[i].name);
+        follow(headers[i].value);
+    }
+}
+
+// Does a comma separated header value contain the given token?
+bool hasToken(std::string_view value, const char* token) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        if (equalsIgnoreCase(trimWhitespace(value.substr(0, comma)), token)) return true;
+        if (comma == std::string_view::npos) break;
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+inline int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Percent-decode a path in place ('+' also means space); returns the new length or -1 if it contains NUL
+ssize_t decodePath(char* path, size_t len) {
+    char* end = path + len;
+    char* out = path;
+    const char* p = path;
+    while (p < end) {
+        const char* special = scanFor(p, end, '%', '+');
+        if (out != p) memmove(out, p, special - p);
+        out += special - p;
+        p = special;
+        if (p == end) break;
+        
+        if (*p == '+') {
+            *out++ = ' ';
+            p++;
+            continue;
+        }
+        int hi = end - p >= 3 ? hexValue(p[1]) : -1;
+        int lo = hi >= 0 ? hexValue(p[2]) : -1;
+        if (hi < 0 || lo < 0) {
+            *out++ = *p++;
+            continue;
+        }
+        char decoded = static_cast<char>(hi * 16 + lo);
+        if (decoded == '\0') return -1;
+        *out++ = decoded;
+        p += 3;
+    }
+    return out - path;
+}
+
+// Collapse empty and "." segments of a decoded path in place, keeping a trailing '/'.
+// Returns the new length or -1 if a segment is "..", so no path can leave the web root.
+ssize_t normalizePath(char* path, size_t len) {
+    const char* end = path + len;
+    const char* p = path; // always at a '/'
+    char* out = path;
+    while (p < end) {
+        const char* segment = p + 1;
+        const char* next = std::find(segment, end, '/');
+        size_t size = next - segment;
+        if (size == 2 && segment[0] == '.' && segment[1] == '.') return -1;
+        if (size == 0 || (size == 1 && segment[0] == '.')) {
+            if (next == end) *out++ = '/';
+        } else {
+            *out++ = '/';
+            memmove(out, segment, size);
+            out += size;
+        }
+        p = next;
+    }
+    return out - path;
+}
+
+// The path and query of a target, also when it came in absolute form ("http://host/path?query")
+std::string_view originForm(std::string_view target) {
+    if (target.compare(0, 7, "http://") == 0 || target.compare(0, 8, "https://") == 0) {
+        size_t slash = target.find('/', target.find("//") + 2);
+        return slash == std::string_view::npos ? std::string_view("/") : target.substr(slash);
+    }
+    return target;
+}
+
+bool isTokenChar(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || strchr("!#$%&'*+-.^_`|~", c);
+}
+
+// End of the line holding 'p' without its terminator: lines end in CRLF, or in a lone LF (RFC 9112 2.2).
+// 'end' is just past the last line's LF.
+inline const char* lineEnd(const char* p, const char* end) {
+    const char* lf = scanFor(p, end, '\n');
+    return lf > p && lf[-1] == '\r' ? lf - 1 : lf;
+}
+
+// Step from the end of a line (as returned by lineEnd) to the start of the next one
+inline const char* nextLine(const char* eol) {
+    return eol + (*eol == '\r' ? 2 : 1);
+}
+
+// Parse one request head starting at offset; bytes may arrive in any number of pieces.
+// 'scanned' remembers how far past offset the search for the blank line got last time.
+ParseStatus parseRequestHead(std::string& buf, size_t offset, size_t& scanned, RequestHead& head) {
+    if (offset >= buf.size()) return ParseStatus::INCOMPLETE;
+    char* data = &buf[0];
+    const char* bufEnd = data + buf.size();
+    size_t start = offset;
+    
+    // Tolerate empty lines between pipelined requests
+    while (offset < buf.size() && (data[offset] == '\n' || (data[offset] == '\r' && offset + 1 < buf.size() && data[offset + 1] == '\n'))) {
+        offset += data[offset] == '\n' ? 1 : 2;
+    }
+    
+    // Find the blank line that ends the head: a LF followed by LF or CRLF
+    const char* p = data + std::max(offset, start + scanned);
+    const char* headEnd = nullptr;
+    while (true) {
+        p = scanFor(p, bufEnd, '\n');
+        if (bufEnd - p < 2 || (p[1] == '\r' && bufEnd - p < 3)) break;
+        if (p[1] == '\n' || (p[1] == '\r' && p[2] == '\n')) {
+            headEnd = p + 1;
+            break;
+        }
+        p++;
+    }
+    if (!headEnd) {
+        scanned = p - (data + start);
+        return buf.size() - offset > MAX_REQUEST_SIZE ? ParseStatus::TOO_LARGE : ParseStatus::INCOMPLETE;
+    }
+    scanned = 0;
+    if ((size_t)(headEnd - (data + offset)) > MAX_REQUEST_SIZE) return ParseStatus::TOO_LARGE;
+    
+    head = RequestHead();
+    head.length = nextLine(headEnd) - (data + start);
+    const char* end = headEnd; // just past the last header line's LF
+    
+    // Request line: method SP target SP version CRLF
+    const char* line = data + offset;
+    const char* sp = scanFor(line, end, ' ', '\r', '\n');
+    if (sp == line || *sp != ' ') return ParseStatus::INVALID;
+    head.method = std::string_view(line, sp - line);
+    for (char c : head.method) {
+        if (!isTokenChar(c)) return ParseStatus::INVALID;
+    }
+    
+    const char* targetStart = sp + 1;
+    sp = scanFor(targetStart, end, ' ', '\r', '\n');
+    if (sp == targetStart || *sp != ' ') return ParseStatus::INVALID;
+    head.target = std::string_view(targetStart, sp - targetStart);
+    
+    const char* versionStart = sp + 1;
+    const char* eol = lineEnd(versionStart, end);
+    std::string_view version(versionStart, eol - versionStart);
+    if (version == "HTTP/1.0") {
+        head.http10 = true;
+        head.keepAlive = false;
+    } else if (version != "HTTP/1.1") {
+        return ParseStatus::INVALID;
+    }
+    
+    // Header fields
+    bool sawContentLength = false;
+    for (line = nextLine(eol); line < end; ) {
+        if (*line == ' ' || *line == '\t') return ParseStatus::INVALID; // obsolete line folding
+        const char* colon = scanFor(line, end, ':', '\r', '\n');
+        if (colon == line || *colon != ':') return ParseStatus::INVALID;
+        std::string_view name(line, colon - line);
+        if (name.back() == ' ' || name.back() == '\t') return ParseStatus::INVALID;
+        eol = lineEnd(colon + 1, end);
+        // A bare CR inside a field could end the line for some other parser on the way
+        if (scanFor(colon + 1, eol, '\r') != eol) return ParseStatus::INVALID;
+        std::string_view value = trimWhitespace(std::string_view(colon + 1, eol - colon - 1));
+        line = nextLine(eol);
+        
+        if (head.headerCount == MAX_HEADERS) return ParseStatus::TOO_LARGE;
+        head.headers[head.headerCount++] = HttpHeader{name, value};
+        
+        if (equalsIgnoreCase(name, "Connection")) {
+            if (hasToken(value, "close")) head.keepAlive = false;
+            else if (hasToken(value, "keep-alive")) head.keepAlive = true;
+        } else if (equalsIgnoreCase(name, "Content-Length")) {
+            if (value.empty() || value.size() > 18) return ParseStatus::INVALID;
+            size_t length = 0;
+            for (char c : value) {
+                if (c < '0' || c > '9') return ParseStatus::INVALID;
+                length = length * 10 + (c - '0');
+            }
+            if (sawContentLength && length != head.contentLength) return ParseStatus::INVALID;
+            sawContentLength = true;
+            head.contentLength = length;
+        } else if (equalsIgnoreCase(name, "Transfer-Encoding")) {
+            head.chunked = !equalsIgnoreCase(value, "identity");
+        } else if (equalsIgnoreCase(name, "Range")) {
+            head.range = value;
+        } else if (equalsIgnoreCase(name, "If-Range")) {
+            head.ifRange = value;
+        } else if (equalsIgnoreCase(name, "If-None-Match")) {
+            head.ifNoneMatch = value;
+        } else if (equalsIgnoreCase(name, "If-Modified-Since")) {
+            head.ifModifiedSince = value;
+        } else if (equalsIgnoreCase(name, "Accept-Encoding")) {
+            head.acceptEncoding = value;
+        }
+    }
+    // A body framed two different ways is a request smuggling attempt
+    if (sawContentLength && head.chunked) return ParseStatus::INVALID;
+    
+    // Split the target into path and query, accepting absolute-form targets
+    std::string_view target = originForm(head.target);
+    size_t question = target.find('?');
+    if (question != std::string_view::npos) {
+        head.query = target.substr(question + 1);
+        target = target.substr(0, question);
+    }
+    if (target.empty() || target.front() != '/') {
+        head.path = std::string_view("/");
+    } else if (target.find_first_of("%+") == std::string_view::npos && target.find("//") == std::string_view::npos &&
+               target.find("/.") == std::string_view::npos) {
+        head.path = target;
+    } else {
+        // The target itself stays as sent for plugins and upstreams
+        head.decodedPath.assign(target);
+        ssize_t decodedLength = decodePath(&head.decodedPath[0], head.decodedPath.size());
+        if (decodedLength >= 0) decodedLength = normalizePath(&head.decodedPath[0], decodedLength);
+        if (decodedLength < 0) return ParseStatus::INVALID;
+        head.decodedPath.resize(decodedLength);
+        head.path = head.decodedPath;
+    }
+    
+    return ParseStatus::COMPLETE;
+}
+
+// Compression
+// Encodings in server preference order. Precompressed sidecar files (foo.js.br, foo.js.zst, foo.js.gz)
+// are always used; on-the-fly compression needs the encoder compiled in (-DMTWS_WITH_BROTLI, ...).
+enum Encoding { ENCODING_BROTLI, ENCODING_ZSTD, ENCODING_GZIP, ENCODING_COUNT };
+const char* const ENCODING_NAMES[ENCODING_COUNT] = {"br", "zstd", "gzip"};
+const char* const ENCODING_SUFFIXES[ENCODING_COUNT] = {".br", ".zst", ".gz"};
+
+const size_t COMPRESS_MIN_SIZE = 256;
+const size_t COMPRESS_MAX_SIZE = 16 * 1024 * 1024;
+const int VARIANT_SHARDS = 16;
+size_t g_variantCacheBytes = 32 * 1024 * 1024; // memory for compressed variants
+int g_compressThreads = 1;
+ThreadPool* g_compressPool = nullptr;
+
+bool encoderAvailable(int encoding) {
+    switch (encoding) {
+#ifdef MTWS_WITH_BROTLI
+        case ENCODING_BROTLI: return true;
+#endif
+#ifdef MTWS_WITH_ZSTD
+        case ENCODING_ZSTD: return true;
+#endif
+#ifdef MTWS_WITH_GZIP
+        case ENCODING_GZIP: return true;
+#endif
+        default: return false;
+    }
+}
+
+bool compressData(int encoding, [[maybe_unused]] const std::string& input, [[maybe_unused]] std::string& output) {
+    switch (encoding) {
+#ifdef MTWS_WITH_BROTLI
+        case ENCODING_BROTLI: {
+            size_t size = BrotliEncoderMaxCompressedSize(input.size());
+            if (size == 0) return false;
+            output.resize(size);
+            if (!BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, input.size(), 
+                                       reinterpret_cast<const uint8_t*>(input.data()), &size, 
+                                       reinterpret_cast<uint8_t*>(&output[0]))) {
+                return false;
+            }
+            output.resize(size);
+            return true;
+        }
+#endif
+#ifdef MTWS_WITH_ZSTD
+        case ENCODING_ZSTD: {
+            output.resize(ZSTD_compressBound(input.size()));
+            size_t size = ZSTD_compress(&output[0], output.size(), input.data(), input.size(), 19);
+            if (ZSTD_isError(size)) return false;
+            output.resize(size);
+            return true;
+        }
+#endif
+#ifdef MTWS_WITH_GZIP
+        case ENCODING_GZIP: {
+            z_stream stream{};
+            // windowBits 15 + 16 selects the gzip container
+            if (deflateInit2(&stream, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+            output.resize(deflateBound(&stream, input.size()));
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+            stream.avail_in = input.size();
+            stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+            stream.avail_out = output.size();
+            int result = deflate(&stream, Z_FINISH);
+            deflateEnd(&stream);
+            if (result != Z_STREAM_END) return false;
+            output.resize(stream.total_out);
+            return true;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+// Order the encodings the client accepts by q-value, breaking ties by server preference
+int negotiateEncodings(std::string_view acceptEncoding, int order[ENCODING_COUNT]) {
+    double q[ENCODING_COUNT] = {-1, -1, -1};
+    double wildcard = -1;
+    while (!acceptEncoding.empty()) {
+        size_t comma = acceptEncoding.find(',');
+        std::string_view item = trimWhitespace(acceptEncoding.substr(0, comma));
+        acceptEncoding.remove_prefix(comma == std::string_view::npos ? acceptEncoding.size() : comma + 1);
+        
+        double value = 1.0;
+        size_t semicolon = item.find(';');
+        if (semicolon != std::string_view::npos) {
+            std::string_view param = trimWhitespace(item.substr(semicolon + 1));
+            if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                value = atof(std::string(param.substr(2)).c_str());
+            }
+            item = trimWhitespace(item.substr(0, semicolon));
+        }
+        if (item == "*") {
+            wildcard = value;
+            continue;
+        }
+        for (int i = 0; i < ENCODING_COUNT; i++) {
+            if (equalsIgnoreCase(item, ENCODING_NAMES[i])) q[i] = value;
+        }
+    }
+    
+    int count = 0;
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        if (q[i] < 0) q[i] = wildcard;
+        if (q[i] > 0) order[count++] = i;
+    }
+    // A stable insertion sort; std::stable_sort would allocate a temporary buffer for these few entries
+    for (int i = 1; i < count; i++) {
+        for (int j = i; j > 0 && q[order[j]] > q[order[j - 1]]; j--) std::swap(order[j], order[j - 1]);
+    }
+    return count;
+}
+
+// Open precompressed copies that are at least as new as the original
+std::vector<Sidecar> probeSidecars(const std::string& filePath, time_t mtime) {
+    std::vector<Sidecar> sidecars;
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        HttpResponse variant;
+        if (openFileResponse(filePath + ENCODING_SUFFIXES[i], variant) && variant.lastModified >= mtime) {
+            sidecars.push_back(Sidecar{i, variant.file, variant.fileLength});
+        }
+    }
+    return sidecars;
+}
+
+// Cache of compressed variants keyed by entity tag and encoding; an empty variant means "not worth it"
+struct alignas(64) VariantShard {
+    std::mutex mutex;
+    std::list<std::pair<std::string, std::shared_ptr<const std::string>>> lru;
+    std::unordered_map<std::string, decltype(lru)::iterator> index;
+    size_t bytes = 0;
+};
+
+VariantShard g_variantShards[VARIANT_SHARDS];
+std::mutex g_compressPendingMutex;
+std::unordered_set<std::string> g_compressPending;
+
+std::string variantKey(std::string_view etag, int encoding) {
+    return std::string(etag) + ENCODING_SUFFIXES[encoding];
+}
+
+VariantShard& variantShard(const std::string& key) {
+    return g_variantShards[std::hash<std::string>()(key) % VARIANT_SHARDS];
+}
+
+std::shared_ptr<const std::string> variantLookup(const std::string& key) {
+    VariantShard& shard = variantShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) return nullptr;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->second;
+}
+
+void variantInsert(const std::string& key, std::shared_ptr<const std::string> data) {
+    VariantShard& shard = variantShard(key);
+    size_t maxBytes = g_variantCacheBytes / VARIANT_SHARDS;
+    size_t cost = data->size() + key.size() + CACHE_ENTRY_OVERHEAD;
+    if (cost > maxBytes) return;
+    
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.index.count(key)) return;
+    while (!shard.lru.empty() && shard.bytes + cost > maxBytes) {
+        auto& victim = shard.lru.back();
+        shard.bytes -= victim.second->size() + victim.first.size() + CACHE_ENTRY_OVERHEAD;
+        shard.index.erase(victim.first);
+        shard.lru.pop_back();
+    }
+    shard.lru.emplace_front(key, std::move(data));
+    shard.index[key] = shard.lru.begin();
+    shard.bytes += cost;
+}
+
+// Compress in the background so the event loop never waits; the result is used by later requests
+void scheduleCompression(const std::string& key, int encoding, std::function<bool(std::string&)> readContent) {
+    if (!g_compressPool) return;
+    {
+        std::lock_guard<std::mutex> lock(g_compressPendingMutex);
+        if (!g_compressPending.insert(key).second) return;
+    }
+    bool queued = g_compressPool->submit([key, encoding, readContent] {
+        std::string input, output;
+        auto variant = std::make_shared<std::string>();
+        if (readContent(input) && compressData(encoding, input, output) && output.size() < input.size()) {
+            *variant = std::move(output);
+        }
+        variantInsert(key, variant);
+        std::lock_guard<std::mutex> lock(g_compressPendingMutex);
+        g_compressPending.erase(key);
+    });
+    if (!queued) {
+        std::lock_guard<std::mutex> lock(g_compressPendingMutex);
+        g_compressPending.erase(key);
+    }
+}
+
+// Compress the identity body of 'response' in the background
+void scheduleVariant(int encoding, const HttpResponse& response, size_t size) {
+    std::string key = variantKey(response.etag, encoding);
+    if (response.cached) {
+        std::shared_ptr<const CachedFile> cached = response.cached;
+        scheduleCompression(key, encoding, [cached](std::string& out) {
+            out = cached->response.substr(cached->headerLength);
+            return true;
+        });
+    } else if (response.file) {
+        std::shared_ptr<OpenFile> file = response.file;
+        scheduleCompression(key, encoding, [file, size](std::string& out) {
+            out.resize(size);
+            size_t done = 0;
+            while (done < size) {
+                ssize_t n = pread(file->fd, &out[done], size - done, done);
+                if (n <= 0) return false;
+                done += n;
+            }
+            return true;
+        });
+    } else {
+        std::string body = response.body;
+        scheduleCompression(key, encoding, [body](std::string& out) {
+            out = body;
+            return true;
+        });
+    }
+}
+
+// Switch a 200 response to the most preferred variant that is ready: a sidecar file or an earlier
+// compression result. Variants that are not ready yet are compressed for the next request.
+void negotiateCompression(std::string_view acceptEncoding, const std::vector<Sidecar>& sidecars, HttpResponse& response) {
+    int order[ENCODING_COUNT];
+    int count = negotiateEncodings(acceptEncoding, order);
+    if (count == 0 || response.etag.empty()) return;
+    
+    size_t size = response.cached ? response.cached->size : response.file ? response.fileLength : response.body.size();
+    if (size < COMPRESS_MIN_SIZE) return;
+    
+    int missing = -1;
+    for (int i = 0; i < count; i++) {
+        int encoding = order[i];
+        std::pmr::string variantTag = response.etag.substr(0, response.etag.size() - 1) + "-" + ENCODING_NAMES[encoding] + "\"";
+        
+        for (const auto& sidecar : sidecars) {
+            if (sidecar.encoding != encoding) continue;
+            if (missing >= 0) scheduleVariant(missing, response, size);
+            response.file = sidecar.file;
+            response.fileOffset = 0;
+            response.fileLength = sidecar.size;
+            response.cached.reset();
+            response.body.clear();
+            response.etag = variantTag;
+            response.contentEncoding = ENCODING_NAMES[encoding];
+            return;
+        }
+        
+        if (!encoderAvailable(encoding) || size > COMPRESS_MAX_SIZE) continue;
+        std::shared_ptr<const std::string> variant = variantLookup(variantKey(response.etag, encoding));
+        if (!variant) {
+            if (missing < 0) missing = encoding;
+            continue;
+        }
+        if (variant->empty()) break; // compressing this did not pay off
+        if (missing >= 0) scheduleVariant(missing, response, size);
+        response.sharedBody = variant;
+        response.body.clear();
+        response.file.reset();
+        response.cached.reset();
+        response.etag = variantTag;
+        response.contentEncoding = ENCODING_NAMES[encoding];
+        return;
+    }
+    if (missing >= 0) scheduleVariant(missing, response, size);
+}
+
+void startCompression() {
+    bool any = false;
+    for (int i = 0; i < ENCODING_COUNT; i++) any = any || encoderAvailable(i);
+    if (any && g_compressThreads > 0) {
+        g_compressPool = new ThreadPool(g_compressThreads, 1024);
+    }
+}
+
+// The page number requested through "?page=N", 1 if there is none
+size_t explorerPage(std::string_view query) {
+    while (!query.empty()) {
+        size_t amp = query.find('&');
+        std::string_view param = query.substr(0, amp);
+        query.remove_prefix(amp == std::string_view::npos ? query.size() : amp + 1);
+        if (param.compare(0, 5, "page=") != 0) continue;
+        size_t page = 0;
+        for (char c : param.substr(5)) {
+            if (c < '0' || c > '9' || page > 1000000) return 1;
+            page = page * 10 + (c - '0');
+        }
+        return page;
+    }
+    return 1;
+}
+
+// Does the web root have an index page? "/" resolves as "/index.html", so once it has been requested the
+// resolver cache knows: a listing is only cached there while the root has neither index page.
+bool rootHasIndex() {
+    std::shared_ptr<const CachedFile> root = cacheLookup("/index.html", false);
+    if (root && root->kind != RESOLVED_MISSING) return root->kind == RESOLVED_FILE;
+    return faccessat(g_rootFd, "index.html", F_OK, 0) == 0 || faccessat(g_rootFd, "index.htm", F_OK, 0) == 0;
+}
+
+// Serve the explorer for a directory. A listing only changes when entries are added, removed or renamed,
+// which updates the directory mtime, so the directory's stat makes the validators.
+void explorerResponse(const std::string& dir, std::string_view query, HttpResponse& response) {
+    struct stat st;
+    size_t page = explorerPage(query);
+    if (!generateExplorerHTML(dir, page, !rootHasIndex(), response.body, st)) {
+        response.status = 500;
+        response.cacheControl.clear();
+        response.body = "<h1>500 Internal Server Error</h1><p>Could not read directory</p>";
+        return;
+    }
+    response.etag = makeETag(st, true);
+    if (page > 1) response.etag.insert(response.etag.size() - 1, "-p" + std::to_string(page));
+    response.lastModified = st.st_mtime;
+}
+
+// Pick the content encoding, then answer conditional requests with 304 and range requests with 206/416
+void finishResponse(const RequestHead& head, const std::vector<Sidecar>& sidecars, HttpResponse& response) {
+    if (response.status != 200 || response.proxy) return;
+    if (isCompressible(response.contentType)) {
+        response.headers += "Vary: Accept-Encoding\r\n";
+        // Ranges always address the identity body
+        if (head.range.empty()) negotiateCompression(head.acceptEncoding, sidecars, response);
+    }
+    if (isNotModified(head.ifNoneMatch, head.ifModifiedSince, response)) {
+        response.status = 304;
+        response.contentEncoding.clear();
+        response.file.reset();
+        response.cached.reset();
+        response.sharedBody.reset();
+        response.body.clear();
+        return;
+    }
+    if (response.file) applyRange(head.range, head.ifRange, response);
+}
+
+// The request path with "/" mapped to the index page
+std::string_view requestPath(const RequestHead& head) {
+    if (head.path == "/") return "/index.html";
+    return head.path;
+}
+
+// Answer everything that needs no filesystem access: errors, built-in paths and cache hits.
+// Returns false if the request has to look at the filesystem.
+bool respondFromMemory(const RequestHead& head, HttpResponse& response) {
+    if (head.method != "GET" && head.method != "HEAD") {
+        if (!g_upstreams.empty()) {
+            response.proxy = true;
+            return true;
+        }
+        bool known = head.method == "POST" || head.method == "PUT" || head.method == "DELETE" || head.method == "PATCH" || 
+                     head.method == "OPTIONS" || head.method == "CONNECT" || head.method == "TRACE";
+        cannedResponse(response, known ? 405 : 501);
+        return true;
+    }
+    
+    std::string_view path = requestPath(head);
+    if (path == METRICS_PATH) {
+        response.contentType = "text/plain; version=0.0.4";
+        response.cacheControl = "no-store";
+        response.body = metricsText();
+        return true;
+    }
+    if (path == EXPLORER_CSS_PATH) {
+        char etag[32];
+        snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)EXPLORER_CSS_HASH);
+        response.contentType = "text/css";
+        response.body.assign(EXPLORER_CSS, sizeof(EXPLORER_CSS) - 1);
+        response.etag = etag;
+        response.cacheControl = "public, max-age=86400";
+        finishResponse(head, {}, response);
+        return true;
+    }
+    
+    // Hot path: paths resolved before are answered without touching the filesystem
+    std::shared_ptr<const CachedFile> cached = cacheLookup(path);
+    if (cached && cached->kind == RESOLVED_MISSING) {
+        if (!g_upstreams.empty()) {
+            response.proxy = true;
+        } else {
+            cannedResponse(response, 404);
+        }
+        return true;
+    }
+    if (cached && cached->kind == RESOLVED_FILE && (cached->file || head.range.empty())) {
+        cachedResponse(cached, response);
+        finishResponse(head, cached->sidecars, response);
+        return true;
+    }
+    return false;
+}
+
+// Resolve a path against the filesystem: a file, a directory's index page, the explorer or a 404.
+// The path is normalized already, so a single openat() below the web root finds it; the outcome is cached.
+// May block on the disk, so it normally runs on the I/O pool; finishResponse() completes the response.
+void resolveRequest(const std::string& path, std::string_view query, HttpResponse& response, std::vector<Sidecar>& sidecars) {
+    uint64_t generation = cacheGeneration(path);
+    std::string filePath = "." + path;
+    response.cacheControl = cacheControlFor(path);
+    
+    // A directory known to have no index page goes straight to the explorer
+    std::shared_ptr<const CachedFile> resolved = cacheLookup(path, false);
+    if (resolved && resolved->kind == RESOLVED_LISTING) {
+        explorerResponse(resolved->filePath == "." ? "." : filePath, query, response);
+        return;
+    }
+    
+    int fd = openat(g_rootFd, path.c_str() + 1, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    bool denied = fd < 0 && errno == EACCES;
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    
+    if (denied || (fd >= 0 && S_ISREG(st.st_mode) && fcntl(fd, F_SETFL, 0) < 0)) {
+        if (fd >= 0) close(fd);
+        response.status = 500;
+        response.cacheControl.clear();
+        response.body = "<h1>500 Internal Server Error</h1><p>Could not open file: " + path + "</p>";
+    } else if (fd >= 0 && S_ISREG(st.st_mode)) {
+        // Serve the file
+        fileResponse(fd, st, response);
+        response.contentType = getMimeType(filePath);
+        if (isCompressible(response.contentType)) sidecars = probeSidecars(filePath, response.lastModified);
+        cacheFile(path, filePath, response, sidecars, generation);
+    } else if (fd >= 0 && S_ISDIR(st.st_mode)) {
+        // Check for index.html in the directory
+        std::string indexPath = filePath + "/index.html";
+        std::string indexPathHtm = filePath + "/index.htm";
+        
+        if (openFileAt(fd, "index.html", response)) {
+            sidecars = probeSidecars(indexPath, response.lastModified);
+            cacheFile(path, indexPath, response, sidecars, generation);
+        } else if (openFileAt(fd, "index.htm", response)) {
+            sidecars = probeSidecars(indexPathHtm, response.lastModified);
+            cacheFile(path, indexPathHtm, response, sidecars, generation);
+        } else {
+            // Generate directory listing
+            explorerResponse(filePath, query, response);
+            if (response.status == 200) cacheListing(path, filePath, generation);
+        }
+        close(fd);
+    } else {
+        if (fd >= 0) close(fd);
+        // Behind a proxy the application owns the front page
+        if (!g_upstreams.empty()) {
+            response.proxy = true;
+            cacheMissing(path, generation);
+        } else if (path == "/index.html" || path == "/index.htm") {
+            explorerResponse(".", query, response);
+            if (response.status == 200) cacheListing(path, ".", generation);
+        } else {
+            response.cacheControl.clear();
+            cannedResponse(response, 404);
+            cacheMissing(path, generation);
+        }
+    }
+}
+
+// Plugins
+// Shared libraries implementing mtws_plugin.h. The loaded plugins form an immutable table that is only
+// ever replaced as a whole: workers switch to a new table between requests, and a plugin that was stopped
+// or reloaded is shut down and unloaded once no worker uses the old table any more. Loading, stopping
+// and reloading therefore never pause traffic.
+const size_t PLUGIN_MAX_BODY = 1024 * 1024; // request bodies are handed over complete, so they are capped
+const char RESERVED_PREFIX[] = "/__mtws/";
+
+struct LoadedPlugin {
+    std::string name;
+    std::string prefix;
+    std::string file;
+    std::string mount; // prefix given when loading, overriding the plugin's own
+    int memfd = -1;
+    void* library = nullptr;
+    const mtws_plugin* entry = nullptr;
+    void* state = nullptr;
+    bool started = false;
+    
+    ~LoadedPlugin() {
+        if (started && entry->shutdown) entry->shutdown(state);
+        if (library) dlclose(library);
+        if (memfd >= 0) close(memfd);
+    }
+};
+
+struct PluginTable {
+    std::vector<std::shared_ptr<LoadedPlugin>> plugins; // longest prefix first
+};
+
+std::mutex g_pluginMutex; // serializes loading and stopping
+std::shared_ptr<const PluginTable> g_pluginTable = std::make_shared<PluginTable>();
+std::atomic<uint64_t> g_pluginVersion(0); // bumped after every change, so workers only reload the pointer then
+thread_local std::shared_ptr<const PluginTable> t_plugins;
+thread_local uint64_t t_pluginVersion = UINT64_MAX;
+
+// The answer a handler is building. Its body becomes an output segment of the connection as it is.
+struct mtws_response {
+    HttpResponse& response;
+    std::string body;
+    const LoadedPlugin& plugin;
+};
+
+void pluginSetStatus(mtws_response* response, int status) {
+    if (status >= 200 && status <= 599) response->response.status = status;
+}
+
+void pluginAddHeader(mtws_response* response, const char* name, const char* value) {
+    std::string_view headerName(name ? name : ""), headerValue(value ? value : "");
+    if (headerName.empty() || !std::all_of(headerName.begin(), headerName.end(), isTokenChar) || 
+        headerValue.find_first_of("\r\n") != std::string_view::npos) {
+        log(LogLevel::WARN, "Plugin '" + response->plugin.name + "' sent a malformed header; it was left out");
+        return;
+    }
+    if (equalsIgnoreCase(headerName, "Content-Type")) {
+        response->response.contentType = headerValue;
+    } else if (!equalsIgnoreCase(headerName, "Content-Length") && !equalsIgnoreCase(headerName, "Connection") && 
+               !equalsIgnoreCase(headerName, "Transfer-Encoding")) {
+        response->response.headers.append(headerName).append(": ").append(headerValue).append("\r\n");
+    }
+}
+
+void pluginWrite(mtws_response* response, const void* data, size_t size) {
+    if (size > 0) response->body.append(static_cast<const char*>(data), size);
+}
+
+void pluginLog(int level, const char* message) {
+    log(level == MTWS_LOG_ERROR ? LogLevel::ERROR : level == MTWS_LOG_WARN ? LogLevel::WARN : LogLevel::INFO, 
+        message ? message : "");
+}
+
+const mtws_host PLUGIN_HOST = {MTWS_PLUGIN_ABI, pluginSetStatus, pluginAddHeader, pluginWrite, pluginLog};
+
+// Switch to the current plugin table. Only called between requests, so a handler never sees it change.
+void refreshPlugins() {
+    uint64_t version = g_pluginVersion.load(std::memory_order_acquire);
+    if (version == t_pluginVersion) return;
+    t_plugins = std::atomic_load(&g_pluginTable);
+    t_pluginVersion = version;
+}
+
+const LoadedPlugin* findPlugin(std::string_view path) {
+    if (!t_plugins || t_plugins->plugins.empty() || path.compare(0, sizeof(RESERVED_PREFIX) - 1, RESERVED_PREFIX) == 0) {
+        return nullptr;
+    }
+    for (const auto& plugin : t_plugins->plugins) {
+        if (path.compare(0, plugin->prefix.size(), plugin->prefix) == 0) return plugin.get();
+    }
+    return nullptr;
+}
+
+// Let a plugin answer a request whose body has arrived completely; returns false if it declined
+bool runPlugin(const LoadedPlugin& plugin, const RequestHead& head, std::string_view body, const in_addr& peer, HttpResponse& response) {
+    auto view = [](std::string_view text) { return mtws_string{text.data(), text.size()}; };
+    thread_local mtws_header headers[MAX_HEADERS];
+    for (int i = 0; i < head.headerCount; i++) headers[i] = {view(head.headers[i].name), view(head.headers[i].value)};
+    char address[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &peer, address, sizeof(address));
+    mtws_request request = {view(head.method), view(head.target), view(head.path), view(head.query), head.http10 ? 0 : 1, 
+                            headers, (size_t)head.headerCount, view(body), {address, strlen(address)}};
+    
+    response.contentType = "text/plain";
+    mtws_response out{response, std::string(), plugin};
+    int result = MTWS_ERROR;
+    try {
+        result = plugin.entry->handle(plugin.state, &request, &out);
+    } catch (...) {
+    }
+    if (result == MTWS_DECLINED) {
+        response = HttpResponse();
+        return false;
+    }
+    if (result != MTWS_HANDLED) {
+        log(LogLevel::ERROR, "Plugin '" + plugin.name + "' failed to answer " + std::string(head.path));
+        response = HttpResponse();
+        cannedResponse(response, 500);
+        return true;
+    }
+    if (!out.body.empty()) response.sharedBody = std::make_shared<const std::string>(std::move(out.body));
+    return true;
+}
+
+// Publish a changed copy of the plugin table; caller holds g_pluginMutex
+void publishPlugins(std::shared_ptr<PluginTable> table) {
+    std::stable_sort(table->plugins.begin(), table->plugins.end(), [](const auto& a, const auto& b) {
+        return a->prefix.size() > b->prefix.size();
+    });
+    std::atomic_store(&g_pluginTable, std::shared_ptr<const PluginTable>(std::move(table)));
+    g_pluginVersion.fetch_add(1, std::memory_order_release);
+}
+
+// Load a plugin, replacing a loaded one of the same name. The library is copied into memory first, so
+// the file can be rebuilt while the old version is still running and the new version is really loaded.
+bool loadPlugin(const std::string& file, const std::string& mount) {
+    auto plugin = std::make_shared<LoadedPlugin>();
+    plugin->file = file;
+    plugin->mount = mount;
+    
+    int source = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (source < 0) {
+        log(LogLevel::ERROR, "Could not open plugin " + file + ": " + strerror(errno));
+        return false;
+    }
+    struct stat st;
+    plugin->memfd = memfd_create("mtws-plugin", MFD_CLOEXEC);
+    bool copied = plugin->memfd >= 0 && fstat(source, &st) == 0;
+    off_t offset = 0;
+    while (copied && offset < st.st_size) {
+        copied = sendfile(plugin->memfd, source, &offset, st.st_size - offset) > 0;
+    }
+    close(source);
+    if (!copied) {
+        log(LogLevel::ERROR, "Could not read plugin " + file + ": " + strerror(errno));
+        return false;
+    }
+    
+    // The descriptor stays open while the library is loaded, so no two libraries share this name
+    std::string memoryPath = "/proc/self/fd/" + std::to_string(plugin->memfd);
+    plugin->library = dlopen(memoryPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!plugin->library) {
+        log(LogLevel::ERROR, "Could not load plugin " + file + ": " + dlerror());
+        return false;
+    }
+    auto entryPoint = reinterpret_cast<const mtws_plugin* (*)()>(dlsym(plugin->library, "mtws_plugin_entry"));
+    plugin->entry = entryPoint ? entryPoint() : nullptr;
+    if (!plugin->entry || plugin->entry->abi != MTWS_PLUGIN_ABI || !plugin->entry->name || !plugin->entry->handle) {
+        log(LogLevel::ERROR, "Plugin " + file + " does not implement this version of mtws_plugin.h");
+        return false;
+    }
+    plugin->name = plugin->entry->name;
+    plugin->prefix = !mount.empty() ? mount : plugin->entry->prefix ? plugin->entry->prefix : "";
+    if (plugin->prefix.empty() || plugin->prefix[0] != '/') {
+        log(LogLevel::ERROR, "Plugin '" + plugin->name + "' needs a path prefix starting with '/'");
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(g_pluginMutex);
+    auto table = std::make_shared<PluginTable>(*g_pluginTable);
+    auto replaced = table->plugins.end();
+    for (auto it = table->plugins.begin(); it != table->plugins.end(); ++it) {
+        if ((*it)->name == plugin->name) {
+            replaced = it;
+        } else if ((*it)->prefix == plugin->prefix) {
+            log(LogLevel::ERROR, "Plugin '" + (*it)->name + "' already serves " + plugin->prefix);
+            return false;
+        }
+    }
+    if (plugin->entry->init && plugin->entry->init(&PLUGIN_HOST, &plugin->state) != 0) {
+        log(LogLevel::ERROR, "Plugin '" + plugin->name + "' failed to start");
+        return false;
+    }
+    plugin->started = true;
+    
+    bool reloaded = replaced != table->plugins.end();
+    if (reloaded) *replaced = plugin;
+    else table->plugins.push_back(plugin);
+    log(LogLevel::INFO, "Plugin '" + plugin->name + "' " + (reloaded ? "reloaded" : "loaded") + " from " + file + 
+        ", serving " + plugin->prefix);
+    publishPlugins(std::move(table));
+    return true;
+}
+
+bool stopPlugin(const std::string& name) {
+    std::lock_guard<std::mutex> lock(g_pluginMutex);
+    auto table = std::make_shared<PluginTable>(*g_pluginTable);
+    auto it = std::find_if(table->plugins.begin(), table->plugins.end(), [&](const auto& plugin) { return plugin->name == name; });
+    if (it == table->plugins.end()) return false;
+    table->plugins.erase(it);
+    publishPlugins(std::move(table));
+    return true;
+}
+
+// Event loop
+const int MAX_EVENTS = 256;
+const size_t SENDFILE_CHUNK = 1 << 20; // upper bound for a single sendfile() call
+const int OUTPUT_IOV_MAX = 32; // memory segments gathered into one send; a pre-serialized response takes three
+// A connection with this much unsent output in memory is not read from (and its pipelined requests
+// wait) until the output drains below the low watermark. File ranges are not counted, they cost no memory.
+const size_t OUTPUT_HIGH_WATERMARK = 256 * 1024;
+const size_t OUTPUT_LOW_WATERMARK = 64 * 1024;
+
+// Pending output: bytes owned by the segment, a block shared with a cache, or a file range
+struct OutputSegment {
+    OutputSegment() = default;
+    explicit OutputSegment(std::pmr::memory_resource* memory) : data(memory) {}
+    
+    std::pmr::string data;
+    std::shared_ptr<const std::string> shared; // sent instead of 'data' when set, up to sharedEnd
+    size_t sharedEnd = 0;
+    size_t offset = 0;
+    std::shared_ptr<OpenFile> file;
+    off_t fileOffset = 0;
+    size_t fileRemaining = 0;
+    bool fromPipe = false; // the next pipeRemaining bytes of the connection's pipe
+    size_t pipeRemaining = 0;
+    
+    const char* bytes() const { return shared ? shared->data() : data.data(); }
+    size_t size() const { return shared ? sharedEnd : data.size(); }
+};
+
+// A request waiting for the I/O pool. The connection and the job share it; closing the connection cancels it.
+struct PendingIo {
+    std::atomic<bool> cancelled{false};
+    bool done = false; // set by the owning worker once the completion has arrived
+    int fd;
+    RequestHead head; // views into the connection's input as it was when the job was submitted
+    const char* base; // where the request started in that input
+    uint64_t arrival;
+    std::string path;
+    std::string query;
+    HttpResponse response;
+    std::vector<Sidecar> sidecars;
+};
+
+// Finished jobs, handed back to the worker that submitted them
+struct CompletionQueue {
+    std::mutex mutex;
+    int wakeFd = -1; // the worker's eventfd while it runs
+    std::vector<std::shared_ptr<PendingIo>> done;
+};
+
+CompletionQueue g_completions[MAX_WORKERS];
+thread_local int t_workerId = -1;
+
+// Timeouts
+// Each connection has at most one entry in its worker's timer wheel, filed under the second at which its
+// current timeout could expire at the earliest. Reading and writing never touch the wheel; when an entry
+// comes due, the deadline is worked out again from the connection's timestamps and the entry is filed
+// again or the connection is closed. There are four levels of 64 slots, one second per slot at the bottom;
+// an entry moves down a level when the level below it wraps around. Deadlines more than about twelve days
+// away are filed at twelve days and filed again then.
+const int WHEEL_BITS = 6;
+const int WHEEL_SLOTS = 1 << WHEEL_BITS;
+const int WHEEL_LEVELS = 4;
+const time_t WHEEL_SPAN = (time_t)1 << (WHEEL_BITS * (WHEEL_LEVELS - 1) + 2);
+
+thread_local time_t t_now = 0; // monotonic seconds, refreshed by the worker's event loop
+
+// Entries are kept per fd in doubly linked lists, one list per slot
+struct TimerWheel {
+    struct Entry {
+        int next = -1;
+        int prev = -1;
+        int slot = -1; // -1 while not filed
+        time_t expires = 0;
+    };
+    std::vector<Entry> entries; // indexed by fd
+    int heads[WHEEL_LEVELS * WHEEL_SLOTS];
+    time_t current = 0; // every second up to this one has been processed
+    
+    void start(time_t now) {
+        std::fill(std::begin(heads), std::end(heads), -1);
+        entries.clear();
+        current = now;
+    }
+    
+    bool scheduled(int fd) const {
+        return (size_t)fd < entries.size() && entries[fd].slot >= 0;
+    }
+    
+    // File the entry under the lowest level whose current rotation still reaches its second
+    void link(int fd) {
+        Entry& entry = entries[fd];
+        int level = 0;
+        while (level < WHEEL_LEVELS - 1 && 
+               (entry.expires >> (WHEEL_BITS * (level + 1))) != (current >> (WHEEL_BITS * (level + 1)))) {
+            level++;
+        }
+        entry.slot = level * WHEEL_SLOTS + ((entry.expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+        entry.prev = -1;
+        entry.next = heads[entry.slot];
+        if (entry.next >= 0) entries[entry.next].prev = fd;
+        heads[entry.slot] = fd;
+    }
+    
+    void cancel(int fd) {
+        if (!scheduled(fd)) return;
+        Entry& entry = entries[fd];
+        if (entry.prev >= 0) entries[entry.prev].next = entry.next;
+        else heads[entry.slot] = entry.next;
+        if (entry.next >= 0) entries[entry.next].prev = entry.prev;
+        entry.slot = -1;
+    }
+    
+    // (Re)file an entry; a deadline that has passed comes due with the next second
+    void schedule(int fd, time_t expires) {
+        if ((size_t)fd >= entries.size()) entries.resize(fd + 1);
+        cancel(fd);
+        entries[fd].expires = std::min(std::max(expires, current + 1), current + WHEEL_SPAN);
+        link(fd);
+    }
+    
+    // Process every second up to 'now' and collect the fds whose entries came due
+    void advance(time_t now, std::vector<int>& due) {
+        while (current < now) {
+            current++;
+            // At the start of a rotation, spread the matching slot of each level above over the ones below
+            int top = 0;
+            while (top < WHEEL_LEVELS - 1 && (current & (((time_t)1 << (WHEEL_BITS * (top + 1))) - 1)) == 0) top++;
+            for (int level = top; level > 0; level--) {
+                int slot = level * WHEEL_SLOTS + ((current >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+                int fd = heads[slot];
+                heads[slot] = -1;
+                while (fd >= 0) {
+                    int next = entries[fd].next;
+                    link(fd);
+                    fd = next;
+                }
+            }
+            int slot = current & (WHEEL_SLOTS - 1);
+            for (int fd = heads[slot]; fd >= 0; fd = entries[fd].next) {
+                entries[fd].slot = -1;
+                due.push_back(fd);
+            }
+            heads[slot] = -1;
+        }
+    }
+};
+
+enum class TimeoutKind { NONE, HEADER, BODY, IDLE, SEND, UPSTREAM };
+
+// Reverse proxy
+const int PROXY_MAX_FAILS = 3; // failed attempts in a row after which an upstream is passed over ...
+const time_t PROXY_FAIL_TIMEOUT = 10; // ... for this many seconds
+const size_t PROXY_IDLE_MAX = 32; // idle connections a worker keeps open per upstream
+const size_t PROXY_HEAD_MAX = 64 * 1024; // largest response head accepted from an upstream
+const size_t PROXY_PIPE_SIZE = 256 * 1024; // response bodies are spliced through a pipe this large (epoll engine)
+
+// A connection to an upstream, owned by the worker that opened it
+struct UpstreamConn {
+    int fd;
+    int upstream; // index in g_upstreams
+    int client = -1; // the connection whose request it carries, -1 while it waits in the pool
+    bool idle = false; // in the worker's pool
+    bool reused = false; // has carried a request before
+    bool pollingIn = false; // io_uring engine: readiness polls that are armed
+    bool pollingOut = false;
+    bool closed = false; // io_uring engine: closed once its polls have completed
+};
+
+enum class BodyFraming { NONE, LENGTH, CHUNKED, CLOSE };
+enum class ChunkState { SIZE, EXTENSION, DATA, DATA_END, TRAILER_START, TRAILER, DONE };
+
+// A request an upstream is answering
+struct ProxyExchange {
+    std::string headBytes; // copy of the client's request head ...
+    RequestHead head; // ... and the head parsed from it
+    uint64_t arrival = 0;
+    int upstreamFd = -1;
+    int lastUpstream = -1; // upstream of the previous failed attempt
+    int attempts = 0;
+    // Request side
+    std::string out; // bytes for the upstream: the request head, then the body as it arrives
+    size_t outOffset = 0;
+    size_t requestHeadLength = 0; // the head's part of 'out' while none of it has been sent
+    bool reached = false; // some of the request went out on the current attempt
+    size_t forward = 0; // request body bytes the client has yet to send
+    // Response side
+    std::string in; // the response head while it arrives
+    bool received = false; // the upstream has started answering
+    bool headSent = false; // the response head is queued for the client, so no 502 can replace it
+    int status = 0;
+    bool keepAlive = true; // the client connection stays open afterwards ...
+    bool upstreamKeepAlive = true; // ... and so does the upstream connection
+    BodyFraming framing = BodyFraming::NONE;
+    size_t remaining = 0; // body bytes left (LENGTH) or left of the current chunk (CHUNKED)
+    ChunkState chunkState = ChunkState::SIZE;
+    int chunkDigits = 0;
+    bool dechunk = false; // HTTP/1.0 client: only the data of the chunks is passed on
+    size_t bodyBytes = 0; // body bytes queued for the client
+    bool blocked = false; // the upstream is not read until the client takes more output
+    time_t lastActive = 0; // last time the upstream sent or took something
+    std::string error; // why the current attempt failed
+    
+    size_t backlog() const { return out.size() - outOffset; }
+};
+
+// Admission control
+// Clients are told apart by address. Each one has an entry in a sharded table that counts its open
+// connections and holds its request rate limit as a token bucket in GCRA form: a single "theoretical
+// arrival time" that every request moves forward with one compare-and-swap, so answering a request
+// takes no lock. The shard's lock is only taken when a connection opens, and entries of clients with
+// no connection left and a full bucket are dropped lazily once a shard grows.
+const int CLIENT_SHARDS = 64;
+const size_t CLIENT_SWEEP_SIZE = 1024; // entries a shard holds before idle ones are looked for
+int g_maxClientConnections = 0; // open connections per client, 0 for no limit
+int g_rateLimit = 0; // requests per second per client, 0 for no limit
+int g_rateBurst = 0; // requests a client may send at once; 0 means one second's worth
+int g_overloadLag = 100; // milliseconds a pass over a worker's ready events may take before work is shed, 0 for never
+size_t g_overloadQueue = 1024; // I/O pool jobs waiting before work is shed, 0 for never
+
+struct ClientState {
+    std::atomic<uint64_t> due{0}; // when the bucket is full again, in monotonic microseconds
+    std::atomic<int> connections{0};
+};
+
+struct alignas(64) ClientShard {
+    std::mutex mutex;
+    std::unordered_map<uint32_t, std::unique_ptr<ClientState>> clients;
+    size_t sweepAt = CLIENT_SWEEP_SIZE;
+};
+
+ClientShard g_clientShards[CLIENT_SHARDS];
+
+bool admissionEnabled() {
+    return g_maxClientConnections > 0 || g_rateLimit > 0;
+}
+
+// Count a new connection from 'address'; returns null if the client has too many open already
+ClientState* admitConnection(in_addr address) {
+    uint32_t key = address.s_addr;
+    ClientShard& shard = g_clientShards[(key * 2654435761u) >> 26]; // top 6 bits of a Fibonacci hash
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.clients.size() >= shard.sweepAt) {
+        uint64_t now = monotonicMicros();
+        for (auto it = shard.clients.begin(); it != shard.clients.end();) {
+            const ClientState& client = *it->second;
+            if (client.connections.load() == 0 && client.due.load(std::memory_order_relaxed) <= now) {
+                it = shard.clients.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        shard.sweepAt = std::max(CLIENT_SWEEP_SIZE, shard.clients.size() * 2);
+    }
+    
+    std::unique_ptr<ClientState>& client = shard.clients[key];
+    if (!client) client.reset(new ClientState);
+    if (g_maxClientConnections > 0 && client->connections.load() >= g_maxClientConnections) return nullptr;
+    client->connections.fetch_add(1);
+    return client.get();
+}
+
+// Take a token from the client's bucket for one request; false if it is empty
+bool admitRequest(ClientState* client, uint64_t now) {
+    if (!client || g_rateLimit <= 0) return true;
+    uint64_t interval = 1000000 / g_rateLimit;
+    uint64_t tolerance = interval * ((g_rateBurst > 0 ? g_rateBurst : g_rateLimit) - 1);
+    uint64_t due = client->due.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t start = std::max(due, now);
+        if (start - now > tolerance) return false;
+        if (client->due.compare_exchange_weak(due, start + interval, std::memory_order_relaxed)) return true;
+    }
+}
+
+// Output queues take their memory from the owning worker's pool, so steady traffic does not call malloc
+struct Connection {
+    Connection(int fd, std::pmr::memory_resource* memory) : fd(fd), out(memory), inFlight(memory) {}
+    ~Connection() {
+        if (client) client->connections.fetch_sub(1);
+    }
+    
+    int fd;
+    std::string in;
+    size_t inOffset = 0;
+    size_t scanned = 0; // input after inOffset already searched for the end of the request head
+    std::pmr::deque<OutputSegment> out;
+    size_t memoryQueued = 0; // unsent bytes of the memory segments in 'out'
+    bool paused = false; // not read from until memoryQueued drops to OUTPUT_LOW_WATERMARK
+    size_t discard = 0; // request body bytes still to be skipped
+    int requests = 0;
+    bool closing = false; // close once all pending output is written
+    time_t lastActive = 0; // last time input arrived (monotonic seconds)
+    time_t lastSent = 0; // last time the socket took output
+    TimeoutKind timeout = TimeoutKind::NONE; // what the connection is waiting for...
+    time_t timeoutSince = 0; // ... since when ...
+    int timeoutRequest = 0; // ... and for which request
+    in_addr peer{}; // client address for the access log
+    ClientState* client = nullptr; // admission control entry, if admission control is on
+    uint64_t bytesQueued = 0;
+    uint64_t bytesSent = 0;
+    std::pmr::deque<std::pair<uint64_t, uint64_t>> inFlight; // (bytesQueued at the end of a response, arrival time)
+    std::shared_ptr<PendingIo> io; // the request at inOffset while the I/O pool works on it
+    bool awaitingBody = false; // the request at inOffset goes to a plugin once its body is complete
+    RequestHead bodyHead; // its parsed head ...
+    const char* bodyBase = nullptr; // ... and where the input buffer kept it when it was parsed
+    std::unique_ptr<ProxyExchange> proxy; // the request an upstream is answering; the ones behind it wait
+    int pipe[2] = {-1, -1}; // file bodies (io_uring) and upstream answers (epoll) are spliced through a pipe
+    size_t pipeSize = 0;
+    size_t piped = 0; // bytes sitting in the pipe
+    
+    // io_uring engine only
+    int slot = -1; // index in the registered file table, -1 if the socket is not in it
+    int pending = 0; // submitted operations that have not completed yet
+    bool receiving = false; // a multishot recv is armed
+    bool sending = false; // output goes out one operation at a time so it stays in order
+    bool closed = false; // released once nothing is pending any more
+    iovec iov[OUTPUT_IOV_MAX]; // memory segments of the send in flight
+    msghdr message{};
+};
+
+// Scratch memory for the request a worker is answering. The response's header fields are carved out of a
+// fixed buffer that is rewound before the next request; only an unusually large response spills to the heap.
+const size_t REQUEST_ARENA_SIZE = 16 * 1024;
+
+struct RequestArena {
+    alignas(std::max_align_t) char buffer[REQUEST_ARENA_SIZE];
+    std::pmr::monotonic_buffer_resource resource{buffer, sizeof(buffer)};
+    
+    // Nothing allocated since the last rewind may still be in use
+    void rewind() { resource.release(); }
+};
+
+struct UringLoop;
+
+// Each worker owns a listening socket bound with SO_REUSEPORT and its own event loop (epoll or io_uring);
+// nothing on the request path is shared between workers
+struct Worker {
+    int id = 0;
+    int cpu = -1;
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;
+    std::pmr::unsynchronized_pool_resource memory; // connections' output queues; declared before 'conns', which use it
+    RequestArena arena;
+    std::vector<std::unique_ptr<Connection>> conns;
+    size_t open = 0; // connections in 'conns', including ones io_uring has not released yet
+    TimerWheel timers;
+    uint64_t passStart = 0; // when the current pass over ready events began (monotonic microseconds)
+    uint64_t lastPass = 0;  // how long the previous pass took
+    bool draining = false;
+    time_t drainDeadline = 0;
+    UringLoop* uring = nullptr; // set while the worker runs the io_uring engine
+    std::vector<std::unique_ptr<UpstreamConn>> upstreams; // indexed by fd
+    std::vector<std::vector<int>> idleUpstreams; // pooled connections per upstream, most recently used last
+    size_t nextUpstream = 0; // round robin position
+};
+
+thread_local Worker* t_worker = nullptr;
+
+// A worker is behind when a pass over its ready events takes too long (everything it handles waits that
+// long), and the I/O pool is when too many jobs queue up. Either way only cheap answers are given.
+bool isOverloaded(const Worker& worker, uint64_t now) {
+    uint64_t lag = std::max(worker.lastPass, now - worker.passStart);
+    if (g_overloadLag > 0 && lag > (uint64_t)g_overloadLag * 1000) return true;
+    return g_overloadQueue > 0 && g_ioPool && g_ioPool->depth.load(std::memory_order_relaxed) >= g_overloadQueue;
+}
+
+void uringClose(UringLoop& loop, Connection& conn);
+void uringSend(UringLoop& loop, Connection& conn);
+void uringStopAccepting(UringLoop& loop);
+void uringResume(UringLoop& loop, Connection& conn);
+void uringWatchUpstream(UringLoop& loop, UpstreamConn& up, bool readable, bool writable);
+void uringForgetUpstream(UringLoop& loop, UpstreamConn& up);
+void detachUpstream(Worker& worker, ProxyExchange& exchange, bool reuse);
+void forwardBody(Worker& worker, Connection& conn);
+bool startProxy(Worker& worker, Connection& conn, const RequestHead& head, uint64_t arrival, HttpResponse& response);
+void pumpExchange(Worker& worker, Connection& conn);
+
+// Tell the I/O pool not to bother with the connection's request, if it has not started it yet
+void cancelIo(Connection& conn) {
+    if (!conn.io) return;
+    conn.io->cancelled = true;
+    conn.io.reset();
+    bump(t_metrics->ioCancelled);
+}
+
+// Give up on the answer an upstream is sending; its connection is closed, as it is in the middle of it
+void abortProxy(Worker& worker, Connection& conn) {
+    if (!conn.proxy) return;
+    detachUpstream(worker, *conn.proxy, false);
+    conn.proxy.reset();
+}
+
+void closeConnection(Worker& worker, int fd) {
+    Connection& conn = *worker.conns[fd];
+    cancelIo(conn);
+    if (worker.uring) {
+        uringClose(*worker.uring, conn);
+        return;
+    }
+    abortProxy(worker, conn);
+    bump(t_metrics->connectionsClosed);
+    worker.timers.cancel(fd);
+    epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    if (conn.pipe[0] >= 0) {
+        close(conn.pipe[0]);
+        close(conn.pipe[1]);
+    }
+    worker.conns[fd].reset();
+    worker.open--;
+}
+
+// Account for bytes the socket took, and finish the latency of every response they complete
+void countSent(Connection& conn, size_t sent) {
+    conn.lastSent = t_now;
+    conn.bytesSent += sent;
+    bump(t_metrics->bytesOut, sent);
+    if (conn.inFlight.empty() || conn.inFlight.front().first > conn.bytesSent) return;
+    uint64_t now = monotonicMicros();
+    while (!conn.inFlight.empty() && conn.inFlight.front().first <= conn.bytesSent) {
+        recordLatency(now - conn.inFlight.front().second);
+        conn.inFlight.pop_front();
+    }
+}
+
+// Point 'iov' at the memory segments at the front of the output queue, so they go out in one send.
+// Returns the number used; 'more' tells whether anything is queued behind them.
+int gatherOutput(const Connection& conn, iovec* iov, bool& more) {
+    int count = 0;
+    for (const auto& seg : conn.out) {
+        if (seg.file || seg.fromPipe || count == OUTPUT_IOV_MAX) break;
+        iov[count].iov_base = const_cast<char*>(seg.bytes() + seg.offset);
+        iov[count].iov_len = seg.size() - seg.offset;
+        count++;
+    }
+    more = (size_t)count < conn.out.size();
+    return count;
+}
+
+// Drop what the socket took from the memory segments at the front of the output queue
+void consumeOutput(Connection& conn, size_t sent) {
+    countSent(conn, sent);
+    conn.memoryQueued -= sent;
+    while (sent > 0) {
+        OutputSegment& seg = conn.out.front();
+        size_t left = seg.size() - seg.offset;
+        if (sent < left) {
+            seg.offset += sent;
+            return;
+        }
+        sent -= left;
+        conn.out.pop_front();
+    }
+}
+
+// Write as much pending output as the socket accepts; returns false once the connection is done
+bool flushConnection(Connection& conn) {
+    iovec iov[OUTPUT_IOV_MAX];
+    while (!conn.out.empty()) {
+        OutputSegment& seg = conn.out.front();
+        if (seg.file) {
+            if (seg.fileRemaining == 0) {
+                conn.out.pop_front();
+                continue;
+            }
+            ssize_t sent = sendfile(conn.fd, seg.file->fd, &seg.fileOffset, std::min(seg.fileRemaining, SENDFILE_CHUNK));
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            if (sent == 0) return false; // file shrank after the headers went out
+            seg.fileRemaining -= sent;
+            countSent(conn, sent);
+            continue;
+        }
+        if (seg.fromPipe) {
+            if (seg.pipeRemaining == 0) {
+                conn.out.pop_front();
+                continue;
+            }
+            ssize_t sent = splice(conn.pipe[0], nullptr, conn.fd, nullptr, seg.pipeRemaining, 
+                                  SPLICE_F_NONBLOCK | SPLICE_F_MOVE | (conn.out.size() > 1 ? SPLICE_F_MORE : 0));
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            seg.pipeRemaining -= sent;
+            conn.piped -= sent;
+            countSent(conn, sent);
+            continue;
+        }
+        
+        // sendmsg() is writev() with flags: MSG_MORE lets the kernel put headers and the start of a
+        // file body into the same packet
+        msghdr message{};
+        bool more;
+        message.msg_iov = iov;
+        message.msg_iovlen = gatherOutput(conn, iov, more);
+        ssize_t sent = sendmsg(conn.fd, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        consumeOutput(conn, sent);
+    }
+    // A closing connection still waits for the answer the I/O pool or an upstream is working on
+    return !conn.closing || conn.io || conn.proxy;
+}
+
+// The memory segment at the end of the output queue, to append to. A segment an io_uring send is reading
+// from is left alone: appending could move its bytes.
+std::pmr::string& outputTail(Connection& conn) {
+    bool inSend = conn.sending && conn.out.size() <= conn.message.msg_iovlen;
+    if (conn.out.empty() || conn.out.back().file || conn.out.back().shared || conn.out.back().fromPipe || inSend) {
+        conn.out.emplace_back(conn.out.get_allocator().resource());
+    }
+    return conn.out.back().data;
+}
+
+void queueOutput(Connection& conn, std::string_view data) {
+    if (data.empty()) return;
+    conn.bytesQueued += data.size();
+    conn.memoryQueued += data.size();
+    outputTail(conn).append(data);
+}
+
+// Queue 'length' bytes of a block owned by a cache, starting at 'begin'; the segment keeps it alive until sent
+void queueShared(Connection& conn, std::shared_ptr<const std::string> block, size_t length, size_t begin = 0) {
+    if (length == 0) return;
+    conn.bytesQueued += length;
+    conn.memoryQueued += length;
+    OutputSegment seg;
+    seg.shared = std::move(block);
+    seg.offset = begin;
+    seg.sharedEnd = begin + length;
+    conn.out.push_back(std::move(seg));
+}
+
+// Queue a keep-alive HTTP/1.1 response serialized ahead of time: its status line, this thread's Date and
+// Server lines, then the rest, as three segments that go out in one send without being copied.
+// Returns the number of body bytes queued.
+size_t queueSerialized(Connection& conn, std::shared_ptr<const std::string> bytes, size_t headerLength, bool headOnly) {
+    size_t statusLength = bytes->find('\n') + 1;
+    size_t end = headOnly ? headerLength : bytes->size();
+    const auto& lines = serverHeaders();
+    queueShared(conn, bytes, statusLength);
+    queueShared(conn, lines, lines->size());
+    queueShared(conn, std::move(bytes), end - statusLength, statusLength);
+    return end - headerLength;
+}
+
+void queueFile(Connection& conn, const std::shared_ptr<OpenFile>& file, off_t offset, size_t length) {
+    if (length == 0) return;
+    conn.bytesQueued += length;
+    OutputSegment seg;
+    seg.file = file;
+    seg.fileOffset = offset;
+    seg.fileRemaining = length;
+    conn.out.push_back(std::move(seg));
+}
+
+// Data spliced through a pipe never passes through user space; the pipe's size bounds how much goes per splice
+bool openPipe(Connection& conn, size_t size) {
+    if (pipe2(conn.pipe, O_CLOEXEC) < 0) return false;
+    fcntl(conn.pipe[1], F_SETPIPE_SZ, (int)size);
+    int actual = fcntl(conn.pipe[1], F_GETPIPE_SZ);
+    conn.pipeSize = actual > 0 ? actual : 65536;
+    return true;
+}
+
+// Account for bytes just spliced into the connection's pipe; they go out after everything queued before them
+void queuePiped(Connection& conn, size_t length) {
+    conn.bytesQueued += length;
+    conn.piped += length;
+    if (conn.out.empty() || !conn.out.back().fromPipe) {
+        OutputSegment seg;
+        seg.fromPipe = true;
+        conn.out.push_back(std::move(seg));
+    }
+    conn.out.back().pipeRemaining += length;
+}
+
+// Queue headers and body; a HEAD request gets the same headers without the body.
+// Returns the number of body bytes queued.
+size_t queueResponse(Connection& conn, const HttpResponse& response, bool keepAlive, bool http10, bool headOnly) {
+    if (response.cached) {
+        // The cached bytes are a keep-alive HTTP/1.1 response; anything else is rebuilt from its body
+        if (keepAlive && !http10) {
+            std::shared_ptr<const std::string> bytes(response.cached, &response.cached->response);
+            return queueSerialized(conn, std::move(bytes), response.cached->headerLength, headOnly);
+        }
+        HttpResponse full = response;
+        full.cached.reset();
+        full.headers = "Accept-Ranges: bytes\r\n" + response.headers;
+        full.body = response.cached->response.substr(response.cached->headerLength);
+        return queueResponse(conn, full, keepAlive, http10, headOnly);
+    }
+    if (response.canned && keepAlive && !http10) {
+        std::shared_ptr<const std::string> bytes(response.canned, &response.canned->response);
+        return queueSerialized(conn, std::move(bytes), response.canned->headerLength, headOnly);
+    }
+    
+    std::pmr::string& out = outputTail(conn);
+    size_t queued = out.size();
+    serializeResponse(out, response, keepAlive, http10, !headOnly);
+    conn.bytesQueued += out.size() - queued;
+    conn.memoryQueued += out.size() - queued;
+    if (headOnly) return 0;
+    if (response.sharedBody) {
+        queueShared(conn, response.sharedBody, response.sharedBody->size());
+        return response.sharedBody->size();
+    }
+    if (!response.file) return response.body.size();
+    
+    if (response.ranges.empty()) {
+        queueFile(conn, response.file, response.fileOffset, response.fileLength);
+        return response.fileLength;
+    }
+    size_t length = 0;
+    for (const auto& range : response.ranges) {
+        std::string part = multipartHeader(response, range);
+        length += part.size() + range.last - range.first + 1;
+        queueOutput(conn, std::move(part));
+        queueFile(conn, response.file, range.first, range.last - range.first + 1);
+    }
+    std::string trailer = multipartTrailer(response);
+    length += trailer.size();
+    queueOutput(conn, std::move(trailer));
+    return length;
+}
+
+// Access log
+// One line per response in the Common or Combined Log Format
+void appendLogEscaped(std::string& out, std::string_view text) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (unsigned char c : text) {
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            out += "\\x";
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        } else {
+            out += c;
+        }
+    }
+}
+
+void logAccess(const Connection& conn, const RequestHead* head, int status, size_t bytes) {
+    if (g_accessLogFd < 0) return;
+    char address[INET_ADDRSTRLEN] = "-";
+    inet_ntop(AF_INET, &conn.peer, address, sizeof(address));
+    
+    thread_local std::string line;
+    line.clear();
+    line += address;
+    line += " - - [";
+    line += logClock().common;
+    line += "] \"";
+    if (head) {
+        appendLogEscaped(line, head->method);
+        line += ' ';
+        appendLogEscaped(line, head->target);
+        line += head->http10 ? " HTTP/1.0" : " HTTP/1.1";
+    } else {
+        line += '-';
+    }
+    line += "\" ";
+    line += std::to_string(status);
+    line += ' ';
+    line += bytes ? std::to_string(bytes) : "-";
+    if (g_accessLogCombined) {
+        std::string_view referer = head ? head->header("Referer") : std::string_view();
+        std::string_view userAgent = head ? head->header("User-Agent") : std::string_view();
+        line += " \"";
+        if (referer.empty()) line += '-';
+        appendLogEscaped(line, referer);
+        line += "\" \"";
+        if (userAgent.empty()) line += '-';
+        appendLogEscaped(line, userAgent);
+        line += '"';
+    }
+    line += '\n';
+    logAccessLine(line);
+}
+
+// Count a queued response and log it; its latency is recorded once its last byte is sent
+void finishRequest(Connection& conn, const RequestHead* head, int status, size_t bytes, uint64_t arrival) {
+    bump(t_metrics->requests);
+    if (status >= 0 && status < MAX_STATUS) bump(t_metrics->statuses[status]);
+    conn.inFlight.emplace_back(conn.bytesQueued, arrival);
+    logAccess(conn, head, status, bytes);
+#ifdef MTWS_COUNT_ALLOCATIONS
+    // Everything the worker allocated since the previous request is charged to this one
+    bump(t_metrics->allocations, t_allocations);
+    t_allocations = 0;
+#endif
+}
+
+// Queue a response that ends the connection, e.g. for a malformed request
+void rejectRequest(Connection& conn, int status, uint64_t arrival) {
+    HttpResponse response;
+    cannedResponse(response, status);
+    finishRequest(conn, nullptr, status, queueResponse(conn, response, false, false, false), arrival);
+    conn.closing = true;
+}
+
+// Hand a request's filesystem work to the I/O pool; returns false if it has to be done right here
+bool submitIo(Connection& conn, const RequestHead& head, uint64_t arrival) {
+    if (!g_ioPool || t_workerId < 0) return false;
+    auto io = std::make_shared<PendingIo>();
+    io->fd = conn.fd;
+    io->head = head;
+    io->base = conn.in.data() + conn.inOffset;
+    io->arrival = arrival;
+    io->path = requestPath(head);
+    io->query = std::string(head.query);
+    
+    int worker = t_workerId;
+    bool queued = g_ioPool->submit([io, worker] {
+        if (io->cancelled) return;
+        resolveRequest(io->path, io->query, io->response, io->sidecars);
+        CompletionQueue& completions = g_completions[worker];
+        std::lock_guard<std::mutex> lock(completions.mutex);
+        if (io->cancelled || completions.wakeFd < 0) return;
+        completions.done.push_back(io);
+        uint64_t one = 1;
+        ssize_t ignored = write(completions.wakeFd, &one, sizeof(one));
+        (void)ignored;
+    });
+    if (!queued) return false;
+    conn.io = io;
+    bump(t_metrics->ioJobs);
+    return true;
+}
+
+// Answer every complete request in the input buffer, in order. A request that needs the filesystem
+// pauses the connection until the I/O pool is done with it; requests behind it wait their turn.
+void processRequests(Connection& conn) {
+    uint64_t arrival = monotonicMicros();
+    refreshPlugins();
+    // The body of a request an upstream is answering goes straight on. Requests behind it wait in the input
+    // buffer, which is not read any further while the upstream lags behind or they pile up.
+    if (conn.proxy) {
+        if (conn.proxy->forward > 0) forwardBody(*t_worker, conn);
+        if (conn.proxy && !conn.paused && (conn.proxy->backlog() >= OUTPUT_HIGH_WATERMARK || 
+                                           conn.in.size() - conn.inOffset >= OUTPUT_HIGH_WATERMARK)) {
+            bump(t_metrics->readsPaused);
+            conn.paused = true;
+        }
+    }
+    while (conn.io || !conn.closing) {
+        if (conn.proxy) break;
+        // The previous request's response is gone, and with it everything it took from the arena
+        t_worker->arena.rewind();
+        RequestHead head;
+        HttpResponse response(&t_worker->arena.resource);
+        uint64_t requestArrival = arrival;
+        if (conn.io) {
+            if (!conn.io->done) break;
+            PendingIo& io = *conn.io;
+            head = io.head;
+            head.rebase(io.base, conn.in.data() + conn.inOffset);
+            response = std::move(io.response);
+            finishResponse(head, io.sidecars, response);
+            requestArrival = io.arrival;
+            conn.io.reset();
+        } else {
+            // Answers pile up faster than the client reads them: stop parsing (and reading) until they drain
+            if (conn.paused || conn.memoryQueued >= OUTPUT_HIGH_WATERMARK) {
+                if (!conn.paused) bump(t_metrics->readsPaused);
+                conn.paused = true;
+                break;
+            }
+            if (conn.discard > 0) {
+                size_t skip = std::min(conn.discard, conn.in.size() - conn.inOffset);
+                conn.inOffset += skip;
+                conn.discard -= skip;
+                if (conn.discard > 0) break;
+            }
+            
+            // A head waiting for its body was parsed already
+            ParseStatus status = ParseStatus::COMPLETE;
+            bool resumed = conn.awaitingBody;
+            if (conn.awaitingBody) {
+                head = conn.bodyHead;
+                head.rebase(conn.bodyBase, conn.in.data() + conn.inOffset);
+                conn.awaitingBody = false;
+            } else {
+                status = parseRequestHead(conn.in, conn.inOffset, conn.scanned, head);
+            }
+            if (status == ParseStatus::INCOMPLETE) break;
+            if (status == ParseStatus::INVALID) {
+                rejectRequest(conn, 400, arrival);
+                break;
+            }
+            if (status == ParseStatus::TOO_LARGE) {
+                rejectRequest(conn, 431, arrival);
+                break;
+            }
+            if (head.chunked) {
+                rejectRequest(conn, 501, arrival);
+                break;
+            }
+            
+            // A request whose body was awaited took its token already
+            bool limited = !resumed && !admitRequest(conn.client, arrival);
+            bool shed = !limited && isOverloaded(*t_worker, arrival);
+            const LoadedPlugin* plugin = limited ? nullptr : findPlugin(head.path);
+            if (plugin && !shed && head.contentLength > PLUGIN_MAX_BODY) {
+                rejectRequest(conn, 413, arrival);
+                break;
+            }
+            if (plugin && !shed && conn.in.size() - conn.inOffset < head.length + head.contentLength) {
+                conn.awaitingBody = true;
+                conn.bodyHead = head;
+                conn.bodyBase = conn.in.data() + conn.inOffset;
+                break;
+            }
+            
+            std::string_view body(conn.in.data() + conn.inOffset + head.length, plugin ? head.contentLength : 0);
+            if (limited) {
+                bump(t_metrics->rateLimited);
+                cannedResponse(response, 429);
+            } else if (shed) {
+                // Overloaded: only what is answered from memory costs no more than the 503 would
+                if (plugin || !respondFromMemory(head, response) || response.proxy) {
+                    bump(t_metrics->shed);
+                    response.proxy = false;
+                    cannedResponse(response, 503);
+                }
+            } else {
+                bool answered = plugin && runPlugin(*plugin, head, body, conn.peer, response);
+                if (!answered && !respondFromMemory(head, response)) {
+                    if (submitIo(conn, head, arrival)) break;
+                    std::vector<Sidecar> sidecars;
+                    resolveRequest(std::string(requestPath(head)), head.query, response, sidecars);
+                    finishResponse(head, sidecars, response);
+                }
+            }
+        }
+        // Nothing on disk answers it; if no upstream can be reached either, 'response' is a 502
+        if (response.proxy && startProxy(*t_worker, conn, head, requestArrival, response)) continue;
+        
+        conn.inOffset += head.length;
+        conn.discard = head.contentLength;
+        conn.requests++;
+        
+        bool keepAlive = head.keepAlive && conn.requests < g_maxKeepAliveRequests && g_running && !g_draining;
+        size_t bytes = queueResponse(conn, response, keepAlive, head.http10, head.method == "HEAD");
+        finishRequest(conn, &head, response.status, bytes, requestArrival);
+        if (!keepAlive) conn.closing = true;
+    }
+    
+    // Drop consumed input so the buffer does not grow across requests
+    if (conn.inOffset == conn.in.size()) {
+        conn.in.clear();
+        conn.inOffset = 0;
+    } else if (conn.inOffset > 0) {
+        conn.in.erase(0, conn.inOffset);
+        conn.inOffset = 0;
+    }
+}
+
+// Can a paused connection be read again? Its queued answers have to drain first, and so does the request
+// body an upstream has not taken yet.
+bool canResume(const Connection& conn) {
+    if (conn.memoryQueued > OUTPUT_LOW_WATERMARK) return false;
+    return !conn.proxy || (conn.proxy->backlog() <= OUTPUT_LOW_WATERMARK && conn.in.size() - conn.inOffset < OUTPUT_HIGH_WATERMARK);
+}
+
+// Has an upstream that was held back for a slow client got room to go on?
+bool relayHasRoom(const Connection& conn) {
+    return conn.memoryQueued <= OUTPUT_LOW_WATERMARK && conn.piped <= conn.pipeSize / 2;
+}
+
+// Read everything available, unless the connection is paused; returns false if it should be closed
+bool readConnection(Connection& conn) {
+    char buffer[16384];
+    while (true) {
+        bool eof = false;
+        while (!conn.paused) {
+            ssize_t bytes_read = read(conn.fd, buffer, sizeof(buffer));
+            if (bytes_read > 0) {
+                if (!conn.closing) conn.in.append(buffer, bytes_read);
+                continue;
+            }
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            eof = true;
+            break;
+        }
+        
+        conn.lastActive = t_now;
+        processRequests(conn);
+        
+        // A half-closed client still gets the answers to everything it sent; while paused some of them
+        // are still in the input buffer, and the end of the input is seen again after resuming
+        if (eof && !conn.paused) conn.closing = true;
+        if (!flushConnection(conn)) return false;
+        if (!conn.paused || !canResume(conn)) return true;
+        conn.paused = false;
+    }
+}
+
+// The socket took more output; a paused connection that has drained goes back to reading, and an
+// upstream that was waiting for the client goes on
+bool writeConnection(Connection& conn) {
+    if (!flushConnection(conn)) return false;
+    if (conn.proxy && conn.proxy->blocked && relayHasRoom(conn)) {
+        pumpExchange(*t_worker, conn);
+        if (!flushConnection(conn)) return false;
+    }
+    if (conn.paused && canResume(conn)) return readConnection(conn);
+    return true;
+}
+
+// When the connection's current timeout expires; 0 if it is waiting for the I/O pool and has none.
+// Starting a new request or switching what it waits for restarts the clock.
+time_t connectionDeadline(Connection& conn) {
+    TimeoutKind kind = TimeoutKind::IDLE;
+    if (!conn.out.empty()) kind = TimeoutKind::SEND;
+    else if (conn.proxy) kind = conn.proxy->forward > 0 && conn.proxy->backlog() == 0 ? TimeoutKind::BODY : TimeoutKind::UPSTREAM;
+    else if (conn.io) kind = TimeoutKind::NONE;
+    else if (conn.discard > 0 || conn.awaitingBody) kind = TimeoutKind::BODY;
+    else if (!conn.in.empty() || conn.requests == 0) kind = TimeoutKind::HEADER;
+    
+    if (kind != conn.timeout || conn.requests != conn.timeoutRequest) {
+        conn.timeout = kind;
+        conn.timeoutSince = t_now;
+        conn.timeoutRequest = conn.requests;
+    }
+    switch (kind) {
+        case TimeoutKind::HEADER: return conn.timeoutSince + g_headerTimeout;
+        case TimeoutKind::BODY: return std::max(conn.timeoutSince, conn.lastActive) + g_bodyTimeout;
+        case TimeoutKind::IDLE: return conn.timeoutSince + g_keepAliveTimeout;
+        case TimeoutKind::SEND: return std::max(conn.timeoutSince, conn.lastSent) + g_sendTimeout;
+        case TimeoutKind::UPSTREAM: return std::max(conn.timeoutSince, conn.proxy->lastActive) + g_proxyTimeout;
+        default: return 0;
+    }
+}
+
+// Called after every event on a connection. Costs a comparison unless the deadline moved closer.
+void armTimeout(Worker& worker, Connection& conn) {
+    time_t deadline = connectionDeadline(conn);
+    if (deadline == 0) {
+        worker.timers.cancel(conn.fd);
+    } else if (!worker.timers.scheduled(conn.fd) || deadline < worker.timers.entries[conn.fd].expires) {
+        worker.timers.schedule(conn.fd, deadline);
+    }
+}
+
+// Send what handling a connection queued, close it if it is done, and file its next timeout
+void settleConnection(Worker& worker, Connection& conn) {
+    int fd = conn.fd;
+    if (!worker.uring) {
+        if (!writeConnection(conn)) closeConnection(worker, fd);
+        else armTimeout(worker, conn);
+        return;
+    }
+    if (conn.closed) return;
+    if (conn.paused && canResume(conn)) uringResume(*worker.uring, conn);
+    uringSend(*worker.uring, conn);
+    // Closing a connection with nothing pending has released it already
+    Connection* left = worker.conns[fd].get();
+    if (left && !left->closed) armTimeout(worker, *left);
+}
+
+// Reverse proxy
+// Requests that nothing on disk answers go to the --proxy upstreams. Every worker keeps its own pool of
+// keep-alive connections to them, so a request normally costs no connect. Bodies are streamed both ways:
+// the client is not read while the upstream lags behind and the upstream is not read while the client
+// does. On the epoll engine, response bodies that are not chunked are spliced from the upstream's socket
+// to the client's without passing through user space.
+enum class Relay { WAIT, DONE, FAILED };
+
+// Parse "host:port", "[v6]:port" or "unix:/path"; host names are resolved once, at startup
+bool addUpstream(const std::string& spec) {
+    auto upstream = std::make_unique<Upstream>();
+    upstream->name = spec;
+    if (spec.compare(0, 5, "unix:") == 0) {
+        std::string path = spec.substr(5);
+        sockaddr_un address{};
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.data(), path.size());
+        memcpy(&upstream->address, &address, sizeof(address));
+        upstream->addressLength = offsetof(sockaddr_un, sun_path) + path.size() + 1;
+        upstream->host = "localhost";
+    } else {
+        size_t colon = spec.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == spec.size()) return false;
+        std::string host = spec.substr(0, colon);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+        addrinfo hints{};
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(host.c_str(), spec.c_str() + colon + 1, &hints, &result) != 0) return false;
+        memcpy(&upstream->address, result->ai_addr, result->ai_addrlen);
+        upstream->addressLength = result->ai_addrlen;
+        freeaddrinfo(result);
+        upstream->host = spec;
+    }
+    g_upstreams.push_back(std::move(upstream));
+    return true;
+}
+
+// Pick the upstream for the next attempt: the next in turn, or the one answering the fewest requests.
+// Upstreams marked down are passed over, and so is the one that just failed, unless nothing else is left.
+int pickUpstream(Worker& worker, int avoid) {
+    size_t count = g_upstreams.size();
+    int best = -1;
+    for (int pass = 0; pass < 2 && best < 0; pass++) {
+        for (size_t i = 0; i < count; i++) {
+            int index = (worker.nextUpstream + i) % count;
+            const Upstream& upstream = *g_upstreams[index];
+            if (pass == 0 && (index == avoid || upstream.downUntil.load(std::memory_order_relaxed) > t_now)) continue;
+            if (best < 0 || (g_proxyLeastConnections && upstream.active.load(std::memory_order_relaxed) < 
+                                                        g_upstreams[best]->active.load(std::memory_order_relaxed))) {
+                best = index;
+            }
+            if (!g_proxyLeastConnections) break;
+        }
+    }
+    worker.nextUpstream = (best + 1) % count;
+    return best;
+}
+
+int openUpstream(Worker& worker, int index) {
+    const Upstream& upstream = *g_upstreams[index];
+    int fd = socket(upstream.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (upstream.address.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (connect(fd, (const sockaddr*)&upstream.address, upstream.addressLength) < 0 && errno != EINPROGRESS) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    // Edge-triggered like the clients: an exchange reads and writes until the socket would block
+    if (!worker.uring) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            int error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+    }
+    if ((size_t)fd >= worker.upstreams.size()) worker.upstreams.resize(fd + 1);
+    worker.upstreams[fd].reset(new UpstreamConn{fd, index});
+    return fd;
+}
+
+// io_uring reports readiness once per poll, so it is asked again whenever an exchange has to wait;
+// epoll watches every upstream connection from the start
+void watchUpstream(Worker& worker, UpstreamConn& up, bool readable, bool writable) {
+    if (worker.uring) uringWatchUpstream(*worker.uring, up, readable, writable);
+}
+
+// With io_uring the fd is only closed once its polls are gone, so it cannot be reused while one may complete
+void closeUpstream(Worker& worker, int fd) {
+    UpstreamConn& up = *worker.upstreams[fd];
+    if (up.idle) {
+        std::vector<int>& idle = worker.idleUpstreams[up.upstream];
+        idle.erase(std::find(idle.begin(), idle.end(), fd));
+        up.idle = false;
+    }
+    if (worker.uring && (up.pollingIn || up.pollingOut)) {
+        uringForgetUpstream(*worker.uring, up);
+        return;
+    }
+    close(fd);
+    worker.upstreams[fd].reset();
+}
+
+// The worker is stopping
+void closeUpstreams(Worker& worker) {
+    for (auto& up : worker.upstreams) {
+        if (up) close(up->fd);
+    }
+    worker.upstreams.clear();
+    for (auto& idle : worker.idleUpstreams) idle.clear();
+}
+
+// An idle connection has nothing to read; an end of file or stray bytes mean the upstream is done with it
+bool idleUpstreamUsable(int fd) {
+    char byte;
+    return recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// A pooled connection to the upstream, most recently used first, or a new one
+int acquireUpstream(Worker& worker, int index) {
+    std::vector<int>& idle = worker.idleUpstreams[index];
+    while (!idle.empty()) {
+        int fd = idle.back();
+        if (idleUpstreamUsable(fd)) {
+            idle.pop_back();
+            worker.upstreams[fd]->idle = false;
+            return fd;
+        }
+        closeUpstream(worker, fd);
+    }
+    return openUpstream(worker, index);
+}
+
+// Let go of an exchange's upstream connection, into the worker's pool if it can carry another request
+void detachUpstream(Worker& worker, ProxyExchange& exchange, bool reuse) {
+    if (exchange.upstreamFd < 0) return;
+    UpstreamConn& up = *worker.upstreams[exchange.upstreamFd];
+    exchange.upstreamFd = -1;
+    g_upstreams[up.upstream]->active.fetch_sub(1, std::memory_order_relaxed);
+    up.client = -1;
+    std::vector<int>& idle = worker.idleUpstreams[up.upstream];
+    if (!reuse || idle.size() >= PROXY_IDLE_MAX) {
+        closeUpstream(worker, up.fd);
+        return;
+    }
+    up.idle = true;
+    up.reused = true;
+    idle.push_back(up.fd);
+    watchUpstream(worker, up, true, false); // so it is closed as soon as the upstream closes its end
+}
+
+// Passive health checks: an upstream that fails PROXY_MAX_FAILS times in a row is passed over for
+// PROXY_FAIL_TIMEOUT seconds, then gets another chance
+void upstreamFailed(Upstream& upstream, const std::string& reason) {
+    if (upstream.failures.fetch_add(1, std::memory_order_relaxed) + 1 < PROXY_MAX_FAILS) return;
+    if (upstream.downUntil.exchange(t_now + PROXY_FAIL_TIMEOUT) <= t_now) {
+        log(LogLevel::WARN, "Upstream " + upstream.name + " is down (" + reason + "); passing it over for " + 
+                            std::to_string(PROXY_FAIL_TIMEOUT) + "s");
+    }
+}
+
+void upstreamSucceeded(Upstream& upstream) {
+    if (upstream.failures.load(std::memory_order_relaxed) == 0) return;
+    upstream.failures.store(0, std::memory_order_relaxed);
+    if (upstream.downUntil.exchange(0) != 0) log(LogLevel::INFO, "Upstream " + upstream.name + " is back up");
+}
+
+// Headers that describe one connection rather than the message, so they are not passed on
+bool isHopByHop(std::string_view name) {
+    for (const char* hop : {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding", "Upgrade"}) {
+        if (equalsIgnoreCase(name, hop)) return true;
+    }
+    return false;
+}
+
+// The request as the upstream gets it: HTTP/1.1 on a persistent connection, without the client's
+// hop-by-hop headers, and with the client's address added to X-Forwarded-For
+std::string upstreamRequestHead(const RequestHead& head, const Upstream& upstream, const in_addr& peer) {
+    std::string out;
+    out.reserve(head.length + 128);
+    out.append(head.method);
+    out += ' ';
+    // Byte for byte as the client sent it; only an absolute-form target loses its scheme and host
+    out.append(originForm(head.target));
+    out += " HTTP/1.1\r\n";
+    
+    bool host = false;
+    std::string forwardedFor;
+    for (int i = 0; i < head.headerCount; i++) {
+        const HttpHeader& header = head.headers[i];
+        if (isHopByHop(header.name) || equalsIgnoreCase(header.name, "Expect")) continue;
+        if (equalsIgnoreCase(header.name, "X-Forwarded-For")) {
+            forwardedFor.append(header.value);
+            forwardedFor += ", ";
+            continue;
+        }
+        if (equalsIgnoreCase(header.name, "Host")) host = true;
+        out.append(header.name);
+        out += ": ";
+        out.append(header.value);
+        out += "\r\n";
+    }
+    if (!host) out += "Host: " + upstream.host + "\r\n";
+    char address[INET_ADDRSTRLEN] = "unknown";
+    inet_ntop(AF_INET, &peer, address, sizeof(address));
+    out += "X-Forwarded-For: " + forwardedFor + address + "\r\nX-Forwarded-Proto: http\r\n\r\n";
+    return out;
+}
+
+// Find an upstream for the exchange and put the request head in front of the body bytes that have not
+// been sent. Returns false once every upstream has been tried.
+bool attachUpstream(Worker& worker, Connection& conn) {
+    ProxyExchange& exchange = *conn.proxy;
+    while (exchange.attempts <= (int)g_upstreams.size()) {
+        exchange.attempts++;
+        int index = pickUpstream(worker, exchange.lastUpstream);
+        exchange.lastUpstream = index;
+        int fd = acquireUpstream(worker, index);
+        if (fd < 0) {
+            bump(t_metrics->upstreamErrors);
+            upstreamFailed(*g_upstreams[index], strerror(errno));
+            continue;
+        }
+        UpstreamConn& up = *worker.upstreams[fd];
+        up.client = conn.fd;
+        g_upstreams[index]->active.fetch_add(1, std::memory_order_relaxed);
+        exchange.upstreamFd = fd;
+        exchange.lastActive = t_now;
+        // A request without a body starts over on the new connection
+        if (exchange.reached) {
+            exchange.out.clear();
+            exchange.outOffset = 0;
+            exchange.requestHeadLength = 0;
+            exchange.reached = false;
+        }
+        std::string head = upstreamRequestHead(exchange.head, *g_upstreams[index], conn.peer);
+        exchange.out.replace(0, exchange.requestHeadLength, head);
+        exchange.requestHeadLength = head.size();
+        watchUpstream(worker, up, true, false);
+        return true;
+    }
+    return false;
+}
+
+// Send the upstream what it has not taken yet; false if the connection failed
+bool sendUpstream(Worker& worker, Connection& conn) {
+    ProxyExchange& exchange = *conn.proxy;
+    UpstreamConn& up = *worker.upstreams[exchange.upstreamFd];
+    while (exchange.backlog() > 0) {
+        ssize_t sent = send(up.fd, exchange.out.data() + exchange.outOffset, exchange.backlog(), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watchUpstream(worker, up, false, true);
+                return true;
+            }
+            exchange.error = strerror(errno);
+            return false;
+        }
+        exchange.outOffset += sent;
+        exchange.reached = true;
+        exchange.lastActive = t_now;
+    }
+    exchange.out.clear();
+    exchange.outOffset = 0;
+    exchange.requestHeadLength = 0;
+    return true;
+}
+
+// An attempt failed. It counts against the upstream, unless a pooled connection turned out to be closed
+// already. The request is tried again elsewhere as long as no application can end up getting it twice;
+// otherwise the client gets a 502 (504 after a timeout), or is cut off if the answer has begun.
+void proxyFailed(Worker& worker, Connection& conn, bool timedOut) {
+    ProxyExchange& exchange = *conn.proxy;
+    while (true) {
+        UpstreamConn& up = *worker.upstreams[exchange.upstreamFd];
+        if (!up.reused || exchange.received || timedOut) {
+            bump(t_metrics->upstreamErrors);
+            upstreamFailed(*g_upstreams[up.upstream], timedOut ? "timed out" : exchange.error);
+        }
+        detachUpstream(worker, exchange, false);
+        bool retry = !timedOut && !exchange.received && (exchange.head.contentLength == 0 || !exchange.reached);
+        if (!retry || !attachUpstream(worker, conn)) break;
+        if (sendUpstream(worker, conn)) return;
+    }
+    
+    if (exchange.headSent) {
+        finishRequest(conn, &exchange.head, exchange.status, exchange.bodyBytes, exchange.arrival);
+        conn.closing = true;
+        conn.proxy.reset();
+        return;
+    }
+    HttpResponse response;
+    cannedResponse(response, timedOut ? 504 : 502);
+    bool keepAlive = exchange.head.keepAlive && conn.requests < g_maxKeepAliveRequests && g_running && !g_draining;
+    size_t bytes = queueResponse(conn, response, keepAlive, exchange.head.http10, exchange.head.method == "HEAD");
+    finishRequest(conn, &exchange.head, response.status, bytes, exchange.arrival);
+    conn.discard = exchange.forward;
+    if (!keepAlive) conn.closing = true;
+    conn.proxy.reset();
+}
+
+// Pass on the part of the request body that has arrived
+void forwardBody(Worker& worker, Connection& conn) {
+    ProxyExchange& exchange = *conn.proxy;
+    size_t available = std::min(exchange.forward, conn.in.size() - conn.inOffset);
+    exchange.out.append(conn.in, conn.inOffset, available);
+    conn.inOffset += available;
+    exchange.forward -= available;
+    if (!sendUpstream(worker, conn)) proxyFailed(worker, conn, false);
+}
+
+// Forward a request to an upstream. Returns false, with a 502 in 'response', if none can be reached.
+bool startProxy(Worker& worker, Connection& conn, const RequestHead& head, uint64_t arrival, HttpResponse& response) {
+    conn.proxy.reset(new ProxyExchange());
+    ProxyExchange& exchange = *conn.proxy;
+    exchange.headBytes.assign(conn.in, conn.inOffset, head.length);
+    exchange.head = head;
+    exchange.head.rebase(conn.in.data() + conn.inOffset, exchange.headBytes.data());
+    exchange.arrival = arrival;
+    exchange.forward = head.contentLength;
+    if (!attachUpstream(worker, conn)) {
+        conn.proxy.reset();
+        response = HttpResponse();
+        cannedResponse(response, 502);
+        return false;
+    }
+    bump(t_metrics->upstreamRequests);
+    conn.inOffset += head.length;
+    conn.requests++;
+    // A client that asked first is told to go ahead, unless the body is on its way already
+    if (head.contentLength > 0 && conn.in.size() == conn.inOffset && hasToken(head.header("Expect"), "100-continue")) {
+        queueOutput(conn, "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+    forwardBody(worker, conn);
+    return true;
+}
+
+// Parse the upstream's response head at the start of exchange.in and queue it for the client, with the
+// upstream's connection handling replaced by the client's. Interim 1xx answers are dropped.
+ParseStatus relayResponseHead(Connection& conn) {
+    ProxyExchange& exchange = *conn.proxy;
+    std::string& in = exchange.in;
+    size_t end, lineEnd;
+    int status;
+    while (true) {
+        end = in.find("\r\n\r\n");
+        if (end == std::string::npos) return in.size() > PROXY_HEAD_MAX ? ParseStatus::TOO_LARGE : ParseStatus::INCOMPLETE;
+        // Status line: HTTP/1.x SP 3DIGIT [SP reason]
+        lineEnd = in.find("\r\n");
+        if (lineEnd < 12 || in.compare(0, 7, "HTTP/1.") != 0 || in[8] != ' ' || !isdigit((unsigned char)in[9]) || 
+            !isdigit((unsigned char)in[10]) || !isdigit((unsigned char)in[11]) || (lineEnd > 12 && in[12] != ' ')) {
+            return ParseStatus::INVALID;
+        }
+        status = (in[9] - '0') * 100 + (in[10] - '0') * 10 + (in[11] - '0');
+        // 101 would switch protocols, but no upgrade is ever passed on
+        if (status < 100 || status == 101) return ParseStatus::INVALID;
+        if (status >= 200) break;
+        in.erase(0, end + 4);
+    }
+    exchange.upstreamKeepAlive = in[7] != '0';
+    
+    bool chunked = false;
+    bool sawLength = false;
+    size_t length = 0;
+    std::string out = "HTTP/1.1 " + in.substr(9, lineEnd - 9) + "\r\n";
+    for (size_t pos = lineEnd + 2; pos < end + 2; ) {
+        size_t next = in.find("\r\n", pos);
+        std::string_view field(in.data() + pos, next - pos);
+        pos = next + 2;
+        size_t colon = field.find(':');
+        if (colon == std::string_view::npos || colon == 0) return ParseStatus::INVALID;
+        std::string_view name = field.substr(0, colon);
+        std::string_view value = trimWhitespace(field.substr(colon + 1));
+        
+        if (equalsIgnoreCase(name, "Connection")) {
+            if (hasToken(value, "close")) exchange.upstreamKeepAlive = false;
+            else if (hasToken(value, "keep-alive")) exchange.upstreamKeepAlive = true;
+            continue;
+        }
+        if (equalsIgnoreCase(name, "Transfer-Encoding")) {
+            chunked = chunked || hasToken(value, "chunked");
+            if (exchange.head.http10) continue; // an HTTP/1.0 client gets the body without the chunk framing
+        } else if (equalsIgnoreCase(name, "Content-Length")) {
+            size_t parsed = 0;
+            if (value.empty() || value.size() > 18) return ParseStatus::INVALID;
+            for (char c : value) {
+                if (c < '0' || c > '9') return ParseStatus::INVALID;
+                parsed = parsed * 10 + (c - '0');
+            }
+            if (sawLength && parsed != length) return ParseStatus::INVALID;
+            sawLength = true;
+            length = parsed;
+        } else if (isHopByHop(name)) {
+            continue;
+        }
+        out.append(field);
+        out += "\r\n";
+    }
+    
+    if (exchange.head.method == "HEAD" || status == 204 || status == 304) {
+        exchange.framing = BodyFraming::NONE;
+    } else if (chunked) {
+        exchange.framing = BodyFraming::CHUNKED;
+        exchange.dechunk = exchange.head.http10;
+    } else if (sawLength) {
+        exchange.framing = BodyFraming::LENGTH;
+        exchange.remaining = length;
+    } else {
+        // The body ends when the upstream closes the connection, and so does the client's
+        exchange.framing = BodyFraming::CLOSE;
+        exchange.upstreamKeepAlive = false;
+    }
+    exchange.keepAlive = exchange.head.keepAlive && conn.requests < g_maxKeepAliveRequests && g_running && !g_draining && 
+                         exchange.framing != BodyFraming::CLOSE && !exchange.dechunk;
+    if (!exchange.keepAlive) {
+        out += "Connection: close\r\n";
+    } else if (exchange.head.http10) {
+        out += "Connection: keep-alive\r\n";
+    }
+    out += "\r\n";
+    queueOutput(conn, std::move(out));
+    exchange.status = status;
+    exchange.headSent = true;
+    in.erase(0, end + 4);
+    return ParseStatus::COMPLETE;
+}
+
+// Follow the chunk framing of a response body. Returns how many of the bytes belong to the body (all of
+// them unless it ended) or -1 if the framing is broken. With 'payload', the chunks' data is collected there.
+ssize_t followChunks(ProxyExchange& exchange, const char* data, size_t size, std::string* payload) {
+    size_t i = 0;
+    while (i < size && exchange.chunkState != ChunkState::DONE) {
+        char c = data[i];
+        switch (exchange.chunkState) {
+            case ChunkState::SIZE:
+                if (hexValue(c) < 0) {
+                    if (exchange.chunkDigits == 0) return -1;
+                    exchange.chunkState = ChunkState::EXTENSION;
+                    break;
+                }
+                if (++exchange.chunkDigits > 15) return -1;
+                exchange.remaining = exchange.remaining * 16 + hexValue(c);
+                i++;
+                break;
+            case ChunkState::EXTENSION:
+                i++;
+                if (c != '\n') break;
+                exchange.chunkDigits = 0;
+                exchange.chunkState = exchange.remaining > 0 ? ChunkState::DATA : ChunkState::TRAILER_START;
+                break;
+            case ChunkState::DATA: {
+                size_t take = std::min(size - i, exchange.remaining);
+                if (payload) payload->append(data + i, take);
+                i += take;
+                exchange.remaining -= take;
+                if (exchange.remaining == 0) exchange.chunkState = ChunkState::DATA_END;
+                break;
+            }
+            case ChunkState::DATA_END:
+                i++;
+                if (c == '\n') exchange.chunkState = ChunkState::SIZE;
+                else if (c != '\r') return -1;
+                break;
+            case ChunkState::TRAILER_START:
+                i++;
+                if (c == '\n') exchange.chunkState = ChunkState::DONE;
+                else if (c != '\r') exchange.chunkState = ChunkState::TRAILER;
+                break;
+            case ChunkState::TRAILER:
+                i++;
+                if (c == '\n') exchange.chunkState = ChunkState::TRAILER_START;
+                break;
+            default:
+                break;
+        }
+    }
+    return i;
+}
+
+bool responseComplete(const ProxyExchange& exchange) {
+    switch (exchange.framing) {
+        case BodyFraming::NONE: return true;
+        case BodyFraming::LENGTH: return exchange.remaining == 0;
+        case BodyFraming::CHUNKED: return exchange.chunkState == ChunkState::DONE;
+        default: return false;
+    }
+}
+
+// Queue body bytes received from the upstream for the client; false if the chunk framing is broken
+bool relayBody(Connection& conn, const char* data, size_t size) {
+    ProxyExchange& exchange = *conn.proxy;
+    size_t used = size;
+    std::string payload;
+    if (exchange.framing == BodyFraming::NONE) {
+        used = 0;
+    } else if (exchange.framing == BodyFraming::LENGTH) {
+        used = std::min(size, exchange.remaining);
+        exchange.remaining -= used;
+    } else if (exchange.framing == BodyFraming::CHUNKED) {
+        ssize_t length = followChunks(exchange, data, size, exchange.dechunk ? &payload : nullptr);
+        if (length < 0) return false;
+        used = length;
+    }
+    // Anything after the end of the answer leaves the connection out of step
+    if (used < size) exchange.upstreamKeepAlive = false;
+    if (!exchange.dechunk) payload.assign(data, used);
+    exchange.bodyBytes += payload.size();
+    queueOutput(conn, std::move(payload));
+    return true;
+}
+
+// Read what the upstream answers and queue it for the client, until the upstream has nothing more for
+// now, the answer is complete or the client has to catch up first
+Relay receiveResponse(Worker& worker, Connection& conn) {
+    ProxyExchange& exchange = *conn.proxy;
+    UpstreamConn& up = *worker.upstreams[exchange.upstreamFd];
+    thread_local char buffer[65536];
+    exchange.blocked = false;
+    while (!exchange.headSent || !responseComplete(exchange)) {
+        bool splicing = !worker.uring && exchange.headSent && 
+                        (exchange.framing == BodyFraming::LENGTH || exchange.framing == BodyFraming::CLOSE) && 
+                        (conn.pipe[0] >= 0 || openPipe(conn, PROXY_PIPE_SIZE));
+        // epoll can hand the client what piled up right away; io_uring's sends complete later
+        if (conn.memoryQueued >= OUTPUT_HIGH_WATERMARK || (splicing && conn.piped >= conn.pipeSize)) {
+            if (!worker.uring) flushConnection(conn);
+            if (conn.memoryQueued >= OUTPUT_HIGH_WATERMARK || (splicing && conn.piped >= conn.pipeSize)) {
+                exchange.blocked = true;
+                return Relay::WAIT;
+            }
+        }
+        
+        ssize_t n;
+        if (splicing) {
+            size_t room = conn.pipeSize - conn.piped;
+            if (exchange.framing == BodyFraming::LENGTH) room = std::min(room, exchange.remaining);
+            n = splice(up.fd, nullptr, conn.pipe[1], nullptr, room, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+            // The pipe rather than the socket may be what is full; let the client take some and try again
+            if (n < 0 && errno == EAGAIN && conn.piped > 0) {
+                flushConnection(conn);
+                if (conn.piped > 0) {
+                    exchange.blocked = true;
+                    return Relay::WAIT;
+                }
+                continue;
+            }
+        } else {
+            n = read(up.fd, buffer, sizeof(buffer));
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watchUpstream(worker, up, true, false);
+                return Relay::WAIT;
+            }
+            exchange.error = strerror(errno);
+            return Relay::FAILED;
+        }
+        if (n == 0) {
+            if (exchange.headSent && exchange.framing == BodyFraming::CLOSE) return Relay::DONE;
+            exchange.error = exchange.headSent ? "closed the connection in the middle of an answer" : "closed the connection";
+            return Relay::FAILED;
+        }
+        exchange.received = true;
+        exchange.lastActive = t_now;
+        
+        if (splicing) {
+            queuePiped(conn, n);
+            exchange.bodyBytes += n;
+            if (exchange.framing == BodyFraming::LENGTH) exchange.remaining -= n;
+            continue;
+        }
+        if (exchange.headSent) {
+            if (!relayBody(conn, buffer, n)) {
+                exchange.error = "sent a malformed chunk";
+                return Relay::FAILED;
+            }
+            continue;
+        }
+        exchange.in.append(buffer, n);
+        ParseStatus status = relayResponseHead(conn);
+        if (status == ParseStatus::INCOMPLETE) continue;
+        if (status != ParseStatus::COMPLETE) {
+            exchange.error = "sent a malformed response";
+            return Relay::FAILED;
+        }
+        std::string rest;
+        rest.swap(exchange.in);
+        if (!relayBody(conn, rest.data(), rest.size())) {
+            exchange.error = "sent a malformed chunk";
+            return Relay::FAILED;
+        }
+    }
+    return Relay::DONE;
+}
+
+// The upstream has answered completely: pool its connection and log the request
+void endExchange(Worker& worker, Connection& conn) {
+    ProxyExchange& exchange = *conn.proxy;
+    upstreamSucceeded(*g_upstreams[worker.upstreams[exchange.upstreamFd]->upstream]);
+    // A connection that still waits for part of the request body cannot carry another request
+    detachUpstream(worker, exchange, exchange.upstreamKeepAlive && exchange.forward == 0 && exchange.backlog() == 0);
+    finishRequest(conn, &exchange.head, exchange.status, exchange.bodyBytes, exchange.arrival);
+    conn.discard = exchange.forward; // the rest of a body the upstream answered without
+    if (!exchange.keepAlive) conn.closing = true;
+    conn.proxy.reset();
+}
+
+// Move an exchange along: send the upstream what it still needs and pass on what it answered. Once the
+// exchange is over, the requests behind it are answered. Sending to the client is left to the caller.
+void pumpExchange(Worker& worker, Connection& conn) {
+    if (!sendUpstream(worker, conn)) {
+        proxyFailed(worker, conn, false);
+    } else {
+        Relay result = receiveResponse(worker, conn);
+        if (result == Relay::DONE) endExchange(worker, conn);
+        else if (result == Relay::FAILED) proxyFailed(worker, conn, false);
+    }
+    if (!conn.proxy) processRequests(conn);
+}
+
+// The upstream kept a client waiting for longer than --proxy-timeout
+void proxyTimedOut(Worker& worker, Connection& conn) {
+    proxyFailed(worker, conn, true);
+    processRequests(conn);
+    settleConnection(worker, conn);
+}
+
+// An upstream connection became readable or writable
+void upstreamEvent(Worker& worker, int fd) {
+    UpstreamConn& up = *worker.upstreams[fd];
+    if (up.client < 0) {
+        if (idleUpstreamUsable(fd)) watchUpstream(worker, up, true, false);
+        else closeUpstream(worker, fd);
+        return;
+    }
+    Connection& conn = *worker.conns[up.client];
+    pumpExchange(worker, conn);
+    settleConnection(worker, conn);
+}
+
+// Runs once a second: close the connections whose timeout has expired
+void expireConnections(Worker& worker) {
+    // For a listening socket tcpi_unacked is the number of connections waiting in the accept queue
+    struct tcp_info info;
+    socklen_t infoLength = sizeof(info);
+    if (getsockopt(worker.listenFd, IPPROTO_TCP, TCP_INFO, &info, &infoLength) == 0) {
+        t_metrics->acceptQueue.store(info.tcpi_unacked, std::memory_order_relaxed);
+    }
+    
+    refreshPlugins(); // so an idle worker does not keep stopped plugins loaded
+    
+    thread_local std::vector<int> due;
+    due.clear();
+    worker.timers.advance(t_now, due);
+    for (int fd : due) {
+        Connection* conn = worker.conns[fd].get();
+        if (!conn || conn->closed) continue;
+        time_t deadline = connectionDeadline(*conn);
+        if (deadline == 0) continue;
+        if (deadline > t_now) {
+            worker.timers.schedule(fd, deadline);
+            continue;
+        }
+        // Idle keep-alive connections are expected to time out; everything else is counted
+        if (conn->timeout != TimeoutKind::IDLE) bump(t_metrics->timeouts);
+        if (conn->timeout == TimeoutKind::UPSTREAM) {
+            proxyTimedOut(worker, *conn);
+            continue;
+        }
+        closeConnection(worker, fd);
+    }
+}
+
+// Answer the requests the I/O pool has finished, then everything that was waiting behind them
+void resumeRequests(Worker& worker) {
+    std::vector<std::shared_ptr<PendingIo>> done;
+    {
+        CompletionQueue& completions = g_completions[worker.id];
+        std::lock_guard<std::mutex> lock(completions.mutex);
+        done.swap(completions.done);
+    }
+    for (auto& io : done) {
+        Connection* conn = (size_t)io->fd < worker.conns.size() ? worker.conns[io->fd].get() : nullptr;
+        if (!conn || conn->io != io) continue; // closed in the meantime
+        io->done = true;
+        conn->lastActive = t_now;
+        processRequests(*conn);
+        settleConnection(worker, *conn);
+    }
+}
+
+void acceptConnections(Worker& worker) {
+    while (true) {
+        sockaddr_in client;
+        socklen_t client_len = sizeof(client);
+        int client_fd = accept4(worker.listenFd, (struct sockaddr*)&client, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log(LogLevel::ERROR, "Accept failed: " + std::string(strerror(errno)));
+            }
+            return;
+        }
+        
+        ClientState* state = nullptr;
+        if (admissionEnabled() && !(state = admitConnection(client.sin_addr))) {
+            close(client_fd);
+            bump(t_metrics->connectionsRefused);
+            continue;
+        }
+        
+        if ((size_t)client_fd >= worker.conns.size()) {
+            worker.conns.resize(client_fd + 1);
+        }
+        worker.conns[client_fd].reset(new Connection(client_fd, &worker.memory));
+        worker.open++;
+        worker.conns[client_fd]->lastActive = t_now;
+        worker.conns[client_fd]->peer = client.sin_addr;
+        worker.conns[client_fd]->client = state;
+        bump(t_metrics->connectionsAccepted);
+        
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_fd;
+        if (epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            log(LogLevel::ERROR, "Failed to register client socket");
+            close(client_fd);
+            worker.conns[client_fd].reset();
+            worker.open--;
+            continue;
+        }
+        armTimeout(worker, *worker.conns[client_fd]);
+    }
+}
+
+// Graceful restart: stop accepting (new connections wait in the listening socket's queue for whoever
+// accepts next), close idle keep-alive connections and let the rest finish the request they are on.
+// Returns true once no connection is left or the drain deadline has passed.
+bool drainWorker(Worker& worker) {
+    if (!worker.draining) {
+        worker.draining = true;
+        worker.drainDeadline = t_now + g_drainTimeout;
+        if (worker.uring) uringStopAccepting(*worker.uring);
+        else epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, worker.listenFd, nullptr);
+        // Only connections between two requests are closed here, the others get "Connection: close"
+        // on their next answer. New clients and ones whose next request is already queued are served.
+        for (auto& conn : worker.conns) {
+            char byte;
+            if (conn && !conn->closed && conn->requests > 0 && conn->out.empty() && !conn->io && !conn->proxy && 
+                conn->in.empty() && conn->discard == 0 && recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && 
+                (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                closeConnection(worker, conn->fd);
+            }
+        }
+    }
+    return worker.open == 0 || t_now >= worker.drainDeadline;
+}
+
+// io_uring engine
+// The same connections and request handling as the epoll loop, but accepts, receives and sends are
+// queued on a per-worker ring and go to the kernel together, one io_uring_enter() per loop iteration.
+// Uses the raw system calls, so no library is needed.
+#ifdef IORING_RECV_MULTISHOT
+const unsigned URING_ENTRIES = 1024;
+const unsigned URING_RECV_BUFFERS = 256; // provided to the kernel, which picks one per receive
+const size_t URING_RECV_BUFFER_SIZE = 16384;
+const unsigned URING_FILE_SLOTS = 65536; // registered file table, indexed by socket fd
+const size_t URING_PIPE_SIZE = 1 << 20;
+
+enum class UringOp : uint8_t { ACCEPT, WAKE, TIMER, RECV, SEND, SPLICE_IN, SPLICE_OUT, UPSTREAM_IN, UPSTREAM_OUT, IGNORE };
+
+// Completions name the connection by fd. A socket is only closed once none of its operations are
+// pending, so its fd cannot be reused while a completion for it may still arrive.
+uint64_t uringTag(int fd, UringOp op) {
+    return (uint64_t)fd << 8 | (uint64_t)op;
+}
+
+// Submission and completion queues shared with the kernel
+struct Uring {
+    int fd = -1;
+    void* rings = MAP_FAILED;
+    size_t ringsSize = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned queued = 0; // filled in but not submitted yet
+    std::deque<io_uring_cqe> spilled; // completions moved out of a full queue, oldest first
+    
+    bool init(unsigned entries, unsigned flags) {
+        io_uring_params params{};
+        params.flags = flags | IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4; // multishot operations post many completions per submission
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) return false;
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            errno = ENOSYS;
+            return false;
+        }
+        
+        ringsSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                             params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        rings = mmap(nullptr, ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (rings == MAP_FAILED || sqes == MAP_FAILED) return false;
+        
+        char* base = (char*)rings;
+        sqHead = (unsigned*)(base + params.sq_off.head);
+        sqTail = (unsigned*)(base + params.sq_off.tail);
+        sqArray = (unsigned*)(base + params.sq_off.array);
+        sqMask = *(unsigned*)(base + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        cqHead = (unsigned*)(base + params.cq_off.head);
+        cqTail = (unsigned*)(base + params.cq_off.tail);
+        cqMask = *(unsigned*)(base + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(base + params.cq_off.cqes);
+        return true;
+    }
+    
+    ~Uring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (rings != MAP_FAILED) munmap(rings, ringsSize);
+        if (fd >= 0) close(fd);
+    }
+    
+    int registerResource(unsigned opcode, const void* arg, unsigned count) {
+        return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+    }
+    
+    // Submit everything queued and wait for at least 'waitFor' completions; returns -errno on failure
+    int submit(unsigned waitFor) {
+        int ret = syscall(__NR_io_uring_enter, fd, queued, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret < 0) return -errno;
+        queued -= std::min<unsigned>(ret, queued);
+        return ret;
+    }
+    
+    // Take the next completion off the queue, spilled ones first
+    bool pop(io_uring_cqe& cqe) {
+        if (!spilled.empty()) {
+            cqe = spilled.front();
+            spilled.pop_front();
+            return true;
+        }
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+        cqe = cqes[head & cqMask];
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    
+    // A cleared submission entry; submits first if the queue is full
+    io_uring_sqe* next() {
+        unsigned tail = *sqTail;
+        while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            int ret = submit(0);
+            if (ret == -EBUSY) {
+                // The completion queue is full too, e.g. while closing thousands of connections at once.
+                // Move the completions aside so the kernel can go on; the loop handles them next.
+                unsigned head = *cqHead;
+                unsigned cqTailNow = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+                for (; head != cqTailNow; head++) spilled.push_back(cqes[head & cqMask]);
+                __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            } else if (ret < 0 && ret != -EINTR && ret != -EAGAIN) {
+                log(LogLevel::FATAL, "io_uring submission failed: " + std::string(strerror(-ret)));
+            }
+        }
+        unsigned index = tail & sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+        return sqe;
+    }
+};
+
+// Receive buffers the kernel picks from when data arrives, so idle connections hold no buffer.
+// Normally they are handed over through a shared buffer ring; where the ring does not work they are
+// provided with IORING_OP_PROVIDE_BUFFERS instead. The ring's tail shares its slot with the first
+// entry's reserved field, so entries are filled field by field.
+bool g_uringBufferRing = true; // cleared at startup if receives never pick from a registered ring
+
+struct RecvBuffers {
+    io_uring_buf_ring* ring = (io_uring_buf_ring*)MAP_FAILED;
+    char* memory = (char*)MAP_FAILED;
+    unsigned tail = 0;
+    
+    bool init(Uring& uring, bool useRing) {
+        memory = (char*)mmap(nullptr, URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return false;
+        if (!useRing) {
+            provide(uring, 0, URING_RECV_BUFFERS);
+            return true;
+        }
+        
+        ring = (io_uring_buf_ring*)mmap(nullptr, URING_RECV_BUFFERS * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) return false;
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)ring;
+        reg.ring_entries = URING_RECV_BUFFERS;
+        reg.bgid = 0;
+        if (uring.registerResource(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+        for (unsigned id = 0; id < URING_RECV_BUFFERS; id++) add(id);
+        __atomic_store_n(&ring->tail, (uint16_t)tail, __ATOMIC_RELEASE);
+        return true;
+    }
+    
+    ~RecvBuffers() {
+        if (ring != MAP_FAILED) munmap(ring, URING_RECV_BUFFERS * sizeof(io_uring_buf));
+        if (memory != MAP_FAILED) munmap(memory, URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    }
+    
+    const char* data(unsigned id) const {
+        return memory + id * URING_RECV_BUFFER_SIZE;
+    }
+    
+    void add(unsigned id) {
+        io_uring_buf& buf = ring->bufs[tail++ & (URING_RECV_BUFFERS - 1)];
+        buf.addr = (uint64_t)(memory + id * URING_RECV_BUFFER_SIZE);
+        buf.len = URING_RECV_BUFFER_SIZE;
+        buf.bid = id;
+    }
+    
+    void provide(Uring& uring, unsigned first, unsigned count) {
+        io_uring_sqe* sqe = uring.next();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = count;
+        sqe->addr = (uint64_t)(memory + first * URING_RECV_BUFFER_SIZE);
+        sqe->len = URING_RECV_BUFFER_SIZE;
+        sqe->off = first;
+        sqe->buf_group = 0;
+        sqe->user_data = uringTag(0, UringOp::IGNORE);
+    }
+    
+    // Hand a buffer back once its data has been copied out
+    void recycle(Uring& uring, unsigned id) {
+        if (ring == MAP_FAILED) {
+            provide(uring, id, 1);
+            return;
+        }
+        add(id);
+        __atomic_store_n(&ring->tail, (uint16_t)tail, __ATOMIC_RELEASE);
+    }
+};
+
+// Does a receive pick a buffer from a registered ring? Some kernels register the ring without ever using it.
+bool uringBufferRingWorks() {
+    Uring uring;
+    RecvBuffers buffers;
+    int pair[2];
+    if (!uring.init(8, 0) || !buffers.init(uring, true) || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        return false;
+    }
+    bool works = false;
+    if (write(pair[1], "x", 1) == 1) {
+        io_uring_sqe* sqe = uring.next();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = pair[0];
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        if (uring.submit(1) >= 0 && *uring.cqTail != *uring.cqHead) {
+            works = uring.cqes[*uring.cqHead & uring.cqMask].res == 1;
+        }
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return works;
+}
+
+struct UringLoop {
+    Worker& worker;
+    Uring ring;
+    RecvBuffers buffers;
+    unsigned fileSlots = 0; // size of the registered file table, 0 if it could not be registered
+    bool accepting = false;
+    uint64_t wakeValue = 0;
+    __kernel_timespec tick{1, 0};
+    
+    explicit UringLoop(Worker& w) : worker(w) {}
+};
+
+// Can this kernel run the engine? Checked once at startup; 'reason' says what is missing.
+bool uringSupported(std::string& reason) {
+    utsname name;
+    int major = 0, minor = 0;
+    if (uname(&name) == 0) sscanf(name.release, "%d.%d", &major, &minor);
+    if (major < 6) { // multishot recv
+        reason = "kernel " + std::string(name.release) + " is older than 6.0";
+        return false;
+    }
+    
+    Uring uring;
+    if (!uring.init(8, 0)) {
+        reason = strerror(errno);
+        return false;
+    }
+    std::vector<char> storage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    io_uring_probe* probe = (io_uring_probe*)storage.data();
+    if (uring.registerResource(IORING_REGISTER_PROBE, probe, 256) < 0) {
+        reason = "operation probe failed";
+        return false;
+    }
+    for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SPLICE, IORING_OP_READ,
+                   IORING_OP_TIMEOUT, IORING_OP_FILES_UPDATE, IORING_OP_ASYNC_CANCEL, IORING_OP_CLOSE,
+                   IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE}) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            reason = "operation " + std::to_string(op) + " is not supported";
+            return false;
+        }
+    }
+    g_uringBufferRing = uringBufferRingWorks();
+    return true;
+}
+
+// The socket as a submission target: its registered slot if it has one, which saves the fd lookup
+void uringTarget(io_uring_sqe* sqe, const Connection& conn) {
+    if (conn.slot >= 0) {
+        sqe->fd = conn.slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = conn.fd;
+    }
+}
+
+void uringArmAccept(UringLoop& loop) {
+    io_uring_sqe* sqe = loop.ring.next();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop.worker.listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uringTag(0, UringOp::ACCEPT);
+    loop.accepting = true;
+}
+
+void uringStopAccepting(UringLoop& loop) {
+    if (!loop.accepting) return;
+    io_uring_sqe* sqe = loop.ring.next();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uringTag(0, UringOp::ACCEPT);
+    sqe->user_data = uringTag(0, UringOp::IGNORE);
+}
+
+void uringArmWake(UringLoop& loop) {
+    io_uring_sqe* sqe = loop.ring.next();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop.worker.wakeFd;
+    sqe->addr = (uint64_t)&loop.wakeValue;
+    sqe->len = sizeof(loop.wakeValue);
+    sqe->user_data = uringTag(0, UringOp::WAKE);
+}
+
+void uringArmTimer(UringLoop& loop) {
+    io_uring_sqe* sqe = loop.ring.next();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)&loop.tick;
+    sqe->len = 1;
+    sqe->user_data = uringTag(0, UringOp::TIMER);
+}
+
+void uringArmRecv(UringLoop& loop, Connection& conn) {
+    io_uring_sqe* sqe = loop.ring.next();
+    sqe->opcode = IORING_OP_RECV;
+    uringTarget(sqe, conn);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uringTag(conn.fd, UringOp::RECV);
+    conn.receiving = true;
+    conn.pending++;
+}
+
+void uringSplice(UringLoop& loop, int in, uint64_t inOffset, const Connection& conn, bool toSocket,
+                 size_t length, unsigned flags, UringOp op) {
+    io_uring_sqe* sqe = loop.ring.next();
+    sqe->opcode = IORING_OP_SPLICE;
+    if (toSocket) uringTarget(sqe, conn);
+    else sqe->fd = conn.pipe[1];
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = in;
+    sqe->splice_off_in = inOffset;
+    sqe->len = length;
+    sqe->splice_flags = flags;
+    sqe->user_data = uringTag(conn.fd, op);
+}
+
+// Start sending the next piece of pending output, or finish the connection if nothing is left
+void uringSend(UringLoop& loop, Connection& conn) {
+    if (conn.sending || conn.closed) return;
+    while (!conn.out.empty()) {
+        OutputSegment& seg = conn.out.front();
+        bool more = conn.out.size() > 1;
+        if (conn.piped > 0) {
+            uringSplice(loop, conn.pipe[0], (uint64_t)-1, conn, true, conn.piped,
+                        SPLICE_F_MOVE | (more || seg.fileRemaining > 0 ? SPLICE_F_MORE : 0), UringOp::SPLICE_OUT);
+            conn.pending++;
+            conn.sending = true;
+            return;
+        }
+        if (seg.file && seg.fileRemaining > 0) {
+            if (conn.pipe[0] < 0 && !openPipe(conn, URING_PIPE_SIZE)) {
+                log(LogLevel::ERROR, "Failed to create pipe: " + std::string(strerror(errno)));
+                uringClose(loop, conn);
+                return;
+            }
+            // File to pipe, then pipe to socket. The second only runs if the first moved the whole chunk;
+            // after a short splice the rest of the pipe is sent on its own.
+            size_t chunk = std::min(seg.fileRemaining, conn.pipeSize);
+            uringSplice(loop, seg.file->fd, seg.fileOffset, conn, false, chunk, SPLICE_F_MOVE, UringOp::SPLICE_IN);
+            loop.ring.sqes[(*loop.ring.sqTail - 1) & loop.ring.sqMask].flags |= IOSQE_IO_LINK;
+            uringSplice(loop, conn.pipe[0], (uint64_t)-1, conn, true, chunk,
+                        SPLICE_F_MOVE | (more || seg.fileRemaining > chunk ? SPLICE_F_MORE : 0), UringOp::SPLICE_OUT);
+            conn.pending += 2;
+            conn.sending = true;
+            return;
+        }
+        if (!seg.file) {
+            // The iovecs and the message live in the connection until the send completes
+            conn.message = msghdr{};
+            conn.message.msg_iov = conn.iov;
+            conn.message.msg_iovlen = gatherOutput(conn, conn.iov, more);
+            io_uring_sqe* sqe = loop.ring.next();
+            sqe->opcode = IORING_OP_SENDMSG;
+            uringTarget(sqe, conn);
+            sqe->addr = (uint64_t)&conn.message;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+            sqe->user_data = uringTag(conn.fd, UringOp::SEND);
+            conn.pending++;
+            conn.sending = true;
+            return;
+        }
+        conn.out.pop_front();
+    }
+    if (conn.closing && !conn.io && !conn.proxy) uringClose(loop, conn);
+}
+
+// Free the connection once its last operation has completed
+void uringRelease(UringLoop& loop, Connection& conn) {
+    static const int EMPTY_SLOT = -1;
+    bump(t_metrics->connectionsClosed);
+    if (conn.slot >= 0) {
+        io_uring_sqe* sqe = loop.ring.next();
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->addr = (uint64_t)&EMPTY_SLOT;
+        sqe->len = 1;
+        sqe->off = conn.slot;
+        sqe->user_data = uringTag(0, UringOp::IGNORE);
+    }
+    io_uring_sqe* sqe = loop.ring.next();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn.fd;
+    sqe->user_data = uringTag(0, UringOp::IGNORE);
+    if (conn.pipe[0] >= 0) {
+        close(conn.pipe[0]);
+        close(conn.pipe[1]);
+    }
+    loop.worker.conns[conn.fd].reset();
+    loop.worker.open--;
+}
+
+// End whatever is still in flight for the connection; it is released once all of it has completed.
+// Shutting the socket down finishes its receives and sends right away. Cancelling by fd would do the
+// same, but the kernel looks through every pending request for each cancellation, which adds up when
+// thousands of idle connections time out together.
+void uringClose(UringLoop& loop, Connection& conn) {
+    if (conn.closed) return;
+    conn.closed = true;
+    cancelIo(conn);
+    abortProxy(loop.worker, conn);
+    loop.worker.timers.cancel(conn.fd);
+    if (conn.pending == 0) {
+        uringRelease(loop, conn);
+        return;
+    }
+    if (shutdown(conn.fd, SHUT_RDWR) == 0) return;
+    io_uring_sqe* sqe = loop.ring.next();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = conn.slot >= 0 ? conn.slot : conn.fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_FD |
+                        (conn.slot >= 0 ? IORING_ASYNC_CANCEL_FD_FIXED : 0);
+    sqe->user_data = uringTag(0, UringOp::IGNORE);
+}
+
+void uringAccepted(UringLoop& loop, int fd) {
+    Worker& worker = loop.worker;
+    // Multishot accept does not report the address; only admission control, the access log, plugins and
+    // the proxy need it
+    refreshPlugins();
+    sockaddr_in client{};
+    if (admissionEnabled() || g_accessLogFd >= 0 || (t_plugins && !t_plugins->plugins.empty()) || !g_upstreams.empty()) {
+        socklen_t length = sizeof(client);
+        getpeername(fd, (sockaddr*)&client, &length);
+    }
+    ClientState* state = nullptr;
+    if (admissionEnabled() && !(state = admitConnection(client.sin_addr))) {
+        close(fd);
+        bump(t_metrics->connectionsRefused);
+        return;
+    }
+    
+    if ((size_t)fd >= worker.conns.size()) {
+        worker.conns.resize(fd + 1);
+    }
+    worker.conns[fd].reset(new Connection(fd, &worker.memory));
+    worker.open++;
+    Connection& conn = *worker.conns[fd];
+    conn.lastActive = t_now;
+    conn.peer = client.sin_addr;
+    conn.client = state;
+    bump(t_metrics->connectionsAccepted);
+    
+    // Register the socket in the slot matching its fd; linked, so the receive below starts only
+    // once the slot is filled
+    if ((unsigned)fd < loop.fileSlots) {
+        io_uring_sqe* sqe = loop.ring.next();
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->addr = (uint64_t)&conn.fd;
+        sqe->len = 1;
+        sqe->off = fd;
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe->user_data = uringTag(0, UringOp::IGNORE);
+        conn.slot = fd;
+    }
+    uringArmRecv(loop, conn);
+    armTimeout(worker, conn);
+}
+
+// Stop receiving while a connection is paused; whatever arrives meanwhile waits in the socket
+void uringCancelRecv(UringLoop& loop, Connection& conn) {
+    io_uring_sqe* sqe = loop.ring.next();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uringTag(conn.fd, UringOp::RECV);
+    sqe->user_data = uringTag(0, UringOp::IGNORE);
+}
+
+void uringReceived(UringLoop& loop, Connection& conn, const io_uring_cqe& cqe, bool more) {
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        unsigned id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe.res > 0 && !conn.closing && !conn.closed) conn.in.append(loop.buffers.data(id), cqe.res);
+        loop.buffers.recycle(loop.ring, id);
+    }
+    if (!more) conn.receiving = false;
+    if (conn.closed) return;
+    
+    // Out of buffers only means the worker is behind; they are handed back as data is consumed.
+    // A receive cancelled for backpressure is armed again once the connection resumes.
+    if (cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -ECANCELED) {
+        if (cqe.res > 0) {
+            conn.lastActive = t_now;
+            processRequests(conn);
+        }
+        if (conn.paused) {
+            if (conn.receiving && cqe.res > 0) uringCancelRecv(loop, conn);
+        } else if (!conn.receiving && !conn.closing) {
+            uringArmRecv(loop, conn);
+        }
+        uringSend(loop, conn);
+    } else if (cqe.res == 0) {
+        // A half-closed client still gets the answers to everything it sent; while paused some of them
+        // are still in the input buffer, and the end of the input is received again after resuming
+        if (!conn.paused) conn.closing = true;
+        uringSend(loop, conn);
+    } else {
+        uringClose(loop, conn);
+    }
+}
+
+// Answer what a paused connection sent meanwhile, and receive again unless it pauses right away
+void uringResume(UringLoop& loop, Connection& conn) {
+    conn.paused = false;
+    processRequests(conn);
+    if (!conn.paused && !conn.receiving && !conn.closing) uringArmRecv(loop, conn);
+}
+
+// Upstream connections are watched with one-shot polls; the exchange does the reading and writing itself
+void uringPollUpstream(UringLoop& loop, int fd, uint32_t events, UringOp op) {
+    io_uring_sqe* sqe = loop.ring.next();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = uringTag(fd, op);
+}
+
+void uringWatchUpstream(UringLoop& loop, UpstreamConn& up, bool readable, bool writable) {
+    if (readable && !up.pollingIn) {
+        uringPollUpstream(loop, up.fd, POLLIN | POLLRDHUP, UringOp::UPSTREAM_IN);
+        up.pollingIn = true;
+    }
+    if (writable && !up.pollingOut) {
+        uringPollUpstream(loop, up.fd, POLLOUT, UringOp::UPSTREAM_OUT);
+        up.pollingOut = true;
+    }
+}
+
+// Remove the connection's polls; it is closed once they have completed
+void uringForgetUpstream(UringLoop& loop, UpstreamConn& up) {
+    up.closed = true;
+    for (UringOp op : {UringOp::UPSTREAM_IN, UringOp::UPSTREAM_OUT}) {
+        if (op == UringOp::UPSTREAM_IN ? !up.pollingIn : !up.pollingOut) continue;
+        io_uring_sqe* sqe = loop.ring.next();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = uringTag(up.fd, op);
+        sqe->user_data = uringTag(0, UringOp::IGNORE);
+    }
+}
+
+void uringUpstreamReady(UringLoop& loop, int fd, UringOp op) {
+    Worker& worker = loop.worker;
+    UpstreamConn* up = (size_t)fd < worker.upstreams.size() ? worker.upstreams[fd].get() : nullptr;
+    if (!up) return;
+    (op == UringOp::UPSTREAM_IN ? up->pollingIn : up->pollingOut) = false;
+    if (!up->closed) {
+        upstreamEvent(worker, fd);
+    } else if (!up->pollingIn && !up->pollingOut) {
+        close(fd);
+        worker.upstreams[fd].reset();
+    }
+}
+
+void uringComplete(UringLoop& loop, const io_uring_cqe& cqe) {
+    int fd = cqe.user_data >> 8;
+    UringOp op = (UringOp)(cqe.user_data & 0xff);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    
+    switch (op) {
+        case UringOp::ACCEPT:
+            if (cqe.res >= 0) {
+                uringAccepted(loop, cqe.res);
+            } else if (cqe.res != -ECANCELED) {
+                log(LogLevel::ERROR, "Accept failed: " + std::string(strerror(-cqe.res)));
+            }
+            // After an error accepting resumes with the next tick
+            if (!more) loop.accepting = false;
+            if (!loop.accepting && cqe.res >= 0) uringArmAccept(loop);
+            return;
+        case UringOp::WAKE:
+            resumeRequests(loop.worker);
+            if (g_running) uringArmWake(loop);
+            return;
+        case UringOp::TIMER:
+            t_now = monotonicSeconds();
+            expireConnections(loop.worker);
+            if (!loop.accepting && g_running && !loop.worker.draining) uringArmAccept(loop);
+            uringArmTimer(loop);
+            return;
+        case UringOp::UPSTREAM_IN:
+        case UringOp::UPSTREAM_OUT:
+            uringUpstreamReady(loop, fd, op);
+            return;
+        case UringOp::IGNORE:
+            return;
+        default:
+            break;
+    }
+    
+    Connection* conn = (size_t)fd < loop.worker.conns.size() ? loop.worker.conns[fd].get() : nullptr;
+    if (!conn) return;
+    if (!more) conn->pending--;
     
-    if (level == LogLevel::FATAL) {
-        g_running = false;
-        g_cv.notify_all();
-        exit(1);
+    switch (op) {
+        case UringOp::RECV:
+            uringReceived(loop, *conn, cqe, more);
+            break;
+        case UringOp::SEND:
+            conn->sending = false;
+            if (conn->closed) break;
+            if (cqe.res < 0) {
+                uringClose(loop, *conn);
+                break;
+            }
+            consumeOutput(*conn, cqe.res);
+            if (conn->proxy && conn->proxy->blocked && relayHasRoom(*conn)) pumpExchange(loop.worker, *conn);
+            if (conn->paused && canResume(*conn)) uringResume(loop, *conn);
+            uringSend(loop, *conn);
+            break;
+        case UringOp::SPLICE_IN:
+            if (cqe.res > 0) {
+                OutputSegment& seg = conn->out.front();
+                seg.fileOffset += cqe.res;
+                seg.fileRemaining -= cqe.res;
+                conn->piped += cqe.res;
+            } else if (!conn->closed) {
+                uringClose(loop, *conn); // read error, or the file shrank after the headers went out
+            }
+            break;
+        case UringOp::SPLICE_OUT:
+            conn->sending = false;
+            if (conn->closed) break;
+            if (cqe.res < 0 && cqe.res != -ECANCELED) {
+                uringClose(loop, *conn);
+                break;
+            }
+            if (cqe.res > 0) {
+                conn->piped -= cqe.res;
+                countSent(*conn, cqe.res);
+            }
+            uringSend(loop, *conn);
+            break;
+        default:
+            break;
     }
+    // Closing a connection with nothing pending has already released it
+    conn = loop.worker.conns[fd].get();
+    if (!conn) return;
+    if (!conn->closed) armTimeout(loop.worker, *conn);
+    else if (conn->pending == 0) uringRelease(loop, *conn);
 }
 
-// Signal handler for graceful shutdown
-void signalHandler(int signum) {
-    if (signum == SIGINT) {
-        log(LogLevel::INFO, "Received shutdown signal. Shutting down gracefully...");
-        g_running = false;
-        g_cv.notify_all();
+// Run the worker on io_uring; returns false if the ring could not be set up, so the worker uses epoll
+bool runUringLoop(Worker& worker) {
+    UringLoop loop(worker);
+    // Only this thread submits, and completions are processed when it asks for them
+    if (!loop.ring.init(URING_ENTRIES, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN) &&
+        !loop.ring.init(URING_ENTRIES, 0)) {
+        log(LogLevel::WARN, "Worker " + std::to_string(worker.id) + " could not set up io_uring (" + strerror(errno) + "); using epoll");
+        return false;
+    }
+    if (!loop.buffers.init(loop.ring, g_uringBufferRing)) {
+        log(LogLevel::WARN, "Worker " + std::to_string(worker.id) + " could not register receive buffers; using epoll");
+        return false;
+    }
+    
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    io_uring_rsrc_register files{};
+    files.nr = std::min<rlim_t>(URING_FILE_SLOTS, limit.rlim_cur);
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (loop.ring.registerResource(IORING_REGISTER_FILES2, &files, sizeof(files)) == 0) {
+        loop.fileSlots = files.nr;
+    }
+    
+    worker.uring = &loop;
+    uringArmAccept(loop);
+    uringArmWake(loop);
+    uringArmTimer(loop);
+    
+    while (g_running) {
+        int ret = loop.ring.submit(1);
+        t_now = monotonicSeconds();
+        worker.passStart = monotonicMicros();
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            log(LogLevel::ERROR, "io_uring_enter failed: " + std::string(strerror(-ret)));
+            break;
+        }
+        
+        io_uring_cqe cqe;
+        while (loop.ring.pop(cqe)) uringComplete(loop, cqe);
+        worker.lastPass = monotonicMicros() - worker.passStart;
+        if (g_draining && drainWorker(worker)) break;
+    }
+    
+    // Closing the ring cancels whatever is still in flight and drops the registered sockets
+    worker.uring = nullptr;
+    for (auto& conn : worker.conns) {
+        if (conn) {
+            if (!conn->closed) bump(t_metrics->connectionsClosed);
+            cancelIo(*conn);
+            abortProxy(worker, *conn);
+            close(conn->fd);
+            if (conn->pipe[0] >= 0) {
+                close(conn->pipe[0]);
+                close(conn->pipe[1]);
+            }
+        }
     }
+    worker.conns.clear();
+    closeUpstreams(worker);
+    return true;
+}
+#else
+bool uringSupported(std::string& reason) {
+    reason = "built without io_uring headers";
+    return false;
 }
 
-bool endsWith(const std::string& str, const std::string& suffix) {
-    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
-}
-
-std::string getMimeType(const std::string& filename) {
-    if (endsWith(filename, ".html") || endsWith(filename, ".htm")) return "text/html";
-    if (endsWith(filename, ".css")) return "text/css";
-    if (endsWith(filename, ".js")) return "application/javascript";
-    if (endsWith(filename, ".png")) return "image/png";
-    if (endsWith(filename, ".jpg") || endsWith(filename, ".jpeg")) return "image/jpeg";
-    if (endsWith(filename, ".gif")) return "image/gif";
-    if (endsWith(filename, ".svg")) return "image/svg+xml";
-    if (endsWith(filename, ".json")) return "application/json";
-    if (endsWith(filename, ".ico")) return "image/x-icon";
-    if (endsWith(filename, ".pdf")) return "application/pdf";
-    if (endsWith(filename, ".mp4")) return "video/mp4";
-    if (endsWith(filename, ".mp3")) return "audio/mpeg";
-    return "text/plain";
-}
-
-// Helper function to get SVG icon for file type
-std::string getFileIconSvg(const std::string& filename, std::string& iconColor) {
-    std::string iconSvg;
-    
-    if (endsWith(filename, ".html") || endsWith(filename, ".htm")) {
-        iconSvg = "M12,17.56L16.07,16.43L16.62,10.33H9.38L9.2,8.3H16.8L17,6.31H7L7.56,12.32H14.45L14.22,14.9L12,15.5L9.78,14.9L9.64,13.24H7.64L7.93,16.43L12,17.56M4.07,3H19.93L18.5,19.2L12,21L5.5,19.2L4.07,3Z";
-        iconColor = "#e44d26";
-    } else if (endsWith(filename, ".css")) {
-        iconSvg = "M5,3L4.35,6.34H17.94L17.5,8.5H3.92L3.26,11.83H16.85L16.09,16.64L10.61,18.33L5.86,16.64L6.19,14.41H2.87L2.17,19L9.95,22L18.3,19L20.1,3H5Z";
-        iconColor = "#264de4";
-    } else if (endsWith(filename, ".js")) {
-        iconSvg = "M3,3H21V21H3V3M7.73,18.04C8.13,18.89 8.92,19.59 10.27,19.59C11.77,19.59 12.8,18.79 12.8,17.04V11.26H11.1V17C11.1,17.86 10.75,18.08 10.2,18.08C9.62,18.08 9.38,17.68 9.11,17.21L7.73,18.04M13.71,17.86C14.21,18.84 15.22,19.59 16.8,19.59C18.4,19.59 19.6,18.76 19.6,17.23C19.6,15.82 18.79,15.19 17.35,14.57L16.93,14.39C16.2,14.08 15.89,13.87 15.89,13.37C15.89,12.96 16.2,12.64 16.7,12.64C17.18,12.64 17.5,12.85 17.79,13.37L19.1,12.5C18.55,11.54 17.77,11.17 16.7,11.17C15.19,11.17 14.22,12.13 14.22,13.4C14.22,14.78 15.03,15.43 16.25,15.95L16.67,16.13C17.45,16.47 17.91,16.68 17.91,17.26C17.91,17.74 17.46,18.09 16.76,18.09C15.93,18.09 15.45,17.66 15.09,17.06L13.71,17.86Z";
-        iconColor = "#f0db4f";
-    } else if (endsWith(filename, ".cpp") || endsWith(filename, ".c") || endsWith(filename, ".h")) {
-        iconSvg = "M10.5,15.97L10.91,18.41C10.65,18.55 10.23,18.68 9.67,18.8C9.1,18.93 8.43,19 7.66,19C5.45,18.96 3.79,18.3 2.68,17.04C1.56,15.77 1,14.16 1,12.21C1.05,9.9 1.72,8.13 3,6.89C4.32,5.64 5.96,5 7.94,5C8.69,5 9.34,5.07 9.88,5.19C10.42,5.31 10.82,5.44 11.08,5.59L10.5,8.08L9.44,7.74C9.04,7.64 8.58,7.59 8.05,7.59C6.89,7.58 5.93,7.95 5.18,8.69C4.42,9.42 4.03,10.54 4,12.03C4,13.39 4.37,14.45 5.08,15.23C5.79,16 6.79,16.4 8.07,16.41L9.4,16.29C9.83,16.21 10.19,16.1 10.5,15.97M11,11H13V9H15V11H17V13H15V15H13V13H11V11Z";
-        iconColor = "#659ad2";
-    } else if (endsWith(filename, ".jpg") || endsWith(filename, ".jpeg") || endsWith(filename, ".png") || endsWith(filename, ".gif") || endsWith(filename, ".svg")) {
-        iconSvg = "M8.5,13.5L11,16.5L14.5,12L19,18H5M21,19V5C21,3.89 20.1,3 19,3H5A2,2 0 0,0 3,5V19A2,2 0 0,0 5,21H19A2,2 0 0,0 21,19Z";
-        iconColor = "#ff9e80";
-    } else if (endsWith(filename, ".mp4") || endsWith(filename, ".webm") || endsWith(filename, ".mov")) {
-        iconSvg = "M18,4L20,8H17L15,4H13L15,8H12L10,4H8L10,8H7L5,4H4A2,2 0 0,0 2,6V18A2,2 0 0,0 4,20H20A2,2 0 0,0 22,18V4H18Z";
-        iconColor = "#ff5252";
-    } else if (endsWith(filename, ".mp3") || endsWith(filename, ".wav") || endsWith(filename, ".ogg")) {
-        iconSvg = "M14,3.23V5.29C16.89,6.15 19,8.83 19,12C19,15.17 16.89,17.84 14,18.7V20.77C18,19.86 21,16.28 21,12C21,7.72 18,4.14 14,3.23M16.5,12C16.5,10.23 15.5,8.71 14,7.97V16C15.5,15.29 16.5,13.76 16.5,12M3,9V15H7L12,20V4L7,9H3Z";
-        iconColor = "#69f0ae";
-    } else if (endsWith(filename, ".pdf")) {
-        iconSvg = "M19,3A2,2 0 0,1 21,5V19A2,2 0 0,1 19,21H5C3.89,21 3,20.1 3,19V5C3,3.89 3.89,3 5,3H19M10.59,10.08C10.57,10.13 10.3,11.84 8.5,14.77C8.5,14.77 5,14 5.5,11.5C5.83,10.04 6.15,8.95 7.86,9.15C9.82,9.38 10.38,9.96 10.59,10.08M15.5,14.5C14,14.5 11.5,13.26 10,10.5C10.5,9.65 10.62,9.56 10.81,9.43C11.38,9.08 13.69,7.95 15.5,9C17.35,10.05 18.29,10.53 18.38,12.42C18.45,14.16 17,14.5 15.5,14.5M18.5,15C18.5,15 17,18 13,19C9.03,20 5.08,19.5 5.08,19.5C6.45,15.4 7.23,13.5 8.5,12C9.09,13.31 10.5,14.5 12,14.5C14,14.5 14.35,14.25 15.25,13.66C16.23,15.27 18.5,15 18.5,15Z";
-        iconColor = "#ff5252";
-    } else if (endsWith(filename, ".zip") || endsWith(filename, ".rar") || endsWith(filename, ".tar") || endsWith(filename, ".gz")) {
-        iconSvg = "M14,17H12V15H10V13H12V15H14M14,9H12V11H14V13H12V11H10V9H12V7H10V5H12V7H14M19,3H5C3.89,3 3,3.89 3,5V19A2,2 0 0,0 5,21H19A2,2 0 0,0 21,19V5C21,3.89 20.1,3 19,3Z";
-        iconColor = "#ffd740";
-    } else {
-        iconSvg = "M14,2H6A2,2 0 0,0 4,4V20A2,2 0 0,0 6,22H18A2,2 0 0,0 20,20V8L14,2M18,20H6V4H13V9H18V20Z";
-        iconColor = "#f0f0f0";
-    }
-    
-    return iconSvg;
-}
-
-std::string generateExplorerHTML(const std::string& path) {
-    std::stringstream html;
-    
-    // HTML head with styles
-    html << "<!DOCTYPE html><html><head><title>MTWS Directory Explorer</title>"
-         << "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">"
-         << "<style>"
-         << ":root {"
-         << "  --bg-color: #121212;"
-         << "  --card-bg: #1e1e1e;"
-         << "  --card-hover: #2a2a2a;"
-         << "  --text-color: #f0f0f0;"
-         << "  --accent-color: #8a2be2;"
-         << "  --accent-hover: #9d44e6;"
-         << "  --header-bg: #1a1a1a;"
-         << "  --shadow-color: rgba(138, 43, 226, 0.4);"
-         << "  --warning-bg: #332700;"
-         << "  --warning-border: #665200;"
-         << "  --warning-text: #ffcc00;"
-         << "  --icon-color: #f0f0f0;"
-         << "  --folder-color: #8a85ff;"
-         << "  --file-color: #f0f0f0;"
-         << "  --file-js-color: #f0db4f;"
-         << "  --file-html-color: #e44d26;"
-         << "  --file-css-color: #264de4;"
-         << "  --file-cpp-color: #659ad2;"
-         << "  --file-img-color: #ff9e80;"
-         << "  --file-video-color: #ff5252;"
-         << "  --file-audio-color: #69f0ae;"
-         << "  --file-pdf-color: #ff5252;"
-         << "  --file-archive-color: #ffd740;"
-         << "}"
-         << "* {"
-         << "  box-sizing: border-box;"
-         << "  margin: 0;"
-         << "  padding: 0;"
-         << "  transition: all 0.2s ease;"
-         << "}"
-         << "body {"
-         << "  background: var(--bg-color);"
-         << "  color: var(--text-color);"
-         << "  font-family: 'Segoe UI', system-ui, -apple-system, sans-serif;"
-         << "  line-height: 1.6;"
-         << "  padding-bottom: 2rem;"
-         << "  min-height: 100vh;"
-         << "}"
-         << "header {"
-         << "  background: var(--header-bg);"
-         << "  padding: 0.75rem 1rem;"
-         << "  box-shadow: 0 4px 12px rgba(0, 0, 0, 0.1);"
-         << "  position: sticky;"
-         << "  top: 0;"
-         << "  z-index: 100;"
-         << "  backdrop-filter: blur(10px);"
-         << "  display: flex;"
-         << "  align-items: center;"
-         << "  justify-content: space-between;"
-         << "}"
-         << ".header-title {"
-         << "  font-size: 1.2rem;"
-         << "  font-weight: 600;"
-         << "  display: flex;"
-         << "  align-items: center;"
-         << "  gap: 0.5rem;"
-         << "}"
-         << ".navigation {"
-         << "  display: flex;"
-         << "  align-items: center;"
-         << "  gap: 0.5rem;"
-         << "}"
-         << ".nav-button {"
-         << "  background: transparent;"
-         << "  border: none;"
-         << "  color: var(--text-color);"
-         << "  width: 36px;"
-         << "  height: 36px;"
-         << "  border-radius: 4px;"
-         << "  display: flex;"
-         << "  align-items: center;"
-         << "  justify-content: center;"
-         << "  cursor: pointer;"
-         << "}"
-         << ".nav-button:hover {"
-         << "  background: rgba(255, 255, 255, 0.1);"
-         << "}"
-         << ".nav-button svg {"
-         << "  width: 20px;"
-         << "  height: 20px;"
-         << "  fill: var(--icon-color);"
-         << "}"
-         << ".breadcrumb {"
-         << "  display: flex;"
-         << "  align-items: center;"
-         << "  gap: 0.25rem;"
-         << "  margin-left: 1rem;"
-         << "  flex-grow: 1;"
-         << "  overflow-x: auto;"
-         << "  white-space: nowrap;"
-         << "  scrollbar-width: thin;"
-         << "  padding: 0.25rem 0;"
-         << "}"
-         << ".breadcrumb::-webkit-scrollbar {"
-         << "  height: 4px;"
-         << "}"
-         << ".breadcrumb::-webkit-scrollbar-thumb {"
-         << "  background: rgba(255, 255, 255, 0.2);"
-         << "  border-radius: 4px;"
-         << "}"
-         << ".breadcrumb-item {"
-         << "  display: flex;"
-         << "  align-items: center;"
-         << "  color: var(--text-color);"
-         << "  opacity: 0.7;"
-         << "  text-decoration: none;"
-         << "  padding: 0.25rem 0.5rem;"
-         << "  border-radius: 4px;"
-         << "}"
-         << ".breadcrumb-item:hover {"
-         << "  background: rgba(255, 255, 255, 0.1);"
-         << "  opacity: 1;"
-         << "}"
-         << ".breadcrumb-item.active {"
-         << "  opacity: 1;"
-         << "  font-weight: 500;"
-         << "}"
-         << ".breadcrumb-separator {"
-         << "  opacity: 0.5;"
-         << "  margin: 0 0.25rem;"
-         << "}"
-         << ".view-options {"
-         << "  display: flex;"
-         << "  align-items: center;"
-         << "  gap: 0.5rem;"
-         << "}"
-         << ".container {"
-         << "  width: 95%;"
-         << "  max-width: 1400px;"
-         << "  margin: 1rem auto;"
-         << "  animation: fadeIn 0.5s ease-out;"
-         << "}"
-         << ".warning-banner {"
-         << "  background-color: var(--warning-bg);"
-         << "  border: 1px solid var(--warning-border);"
-         << "  color: var(--warning-text);"
-         << "  padding: 1rem;"
-         << "  margin-bottom: 1rem;"
-         << "  border-radius: 8px;"
-         << "  animation: pulse 2s infinite;"
-         << "}"
-         << ".warning-banner h3 {"
-         << "  margin-bottom: 0.5rem;"
-         << "  display: flex;"
-         << "  align-items: center;"
-         << "  gap: 0.5rem;"
-         << "}"
-         << ".warning-banner p {"
-         << "  margin: 0.25rem 0;"
-         << "}"
-         << ".explorer {"
-         << "  background: var(--card-bg);"
-         << "  border-radius: 8px;"
-         << "  overflow: hidden;"
-         << "  box-shadow: 0 4px 8px rgba(0, 0, 0, 0.2);"
-         << "}"
-         << ".explorer-body {"
-         << "  padding: 0.5rem;"
-         << "}"
-         << ".file-grid {"
-         << "  display: grid;"
-         << "  grid-template-columns: repeat(auto-fill, minmax(120px, 1fr));"
-         << "  gap: 1rem;"
-         << "  padding: 0.5rem;"
-         << "}"
-         << ".file-item {"
-         << "  display: flex;"
-         << "  flex-direction: column;"
-         << "  align-items: center;"
-         << "  text-align: center;"
-         << "  padding: 0.75rem;"
-         << "  border-radius: 8px;"
-         << "  transition: background-color 0.2s;"
-         << "  cursor: pointer;"
-         << "  text-decoration: none;"
-         << "  color: var(--text-color);"
-         << "}"
-         << ".file-item:hover {"
-         << "  background-color: var(--card-hover);"
-         << "}"
-         << ".file-icon {"
-         << "  width: 48px;"
-         << "  height: 48px;"
-         << "  margin-bottom: 0.5rem;"
-         << "  display: flex;"
-         << "  align-items: center;"
-         << "  justify-content: center;"
-         << "}"
-         << ".file-icon svg {"
-         << "  width: 100%;"
-         << "  height: 100%;"
-         << "}"
-         << ".file-name {"
-         << "  font-size: 0.9rem;"
-         << "  word-break: break-word;"
-         << "  max-width: 100%;"
-         << "  overflow: hidden;"
-         << "  text-overflow: ellipsis;"
-         << "  display: -webkit-box;"
-         << "  -webkit-line-clamp: 2;"
-         << "  -webkit-box-orient: vertical;"
-         << "}"
-         << ".footer {"
-         << "  margin-top: 2rem;"
-         << "  text-align: center;"
-         << "  font-size: 0.85rem;"
-         << "  color: rgba(255, 255, 255, 0.5);"
-         << "}"
-         << "@keyframes fadeIn {"
-         << "  from { opacity: 0; transform: translateY(10px); }"
-         << "  to { opacity: 1; transform: translateY(0); }"
-         << "}"
-         << "@keyframes pulse {"
-         << "  0% { opacity: 1; }"
-         << "  50% { opacity: 0.8; }"
-         << "  100% { opacity: 1; }"
-         << "}"
-         << "@media (max-width: 768px) {"
-         << "  .file-grid {"
-         << "    grid-template-columns: repeat(auto-fill, minmax(100px, 1fr));"
-         << "  }"
-         << "  header {"
-         << "    padding: 0.5rem;"
-         << "  }"
-         << "  .breadcrumb {"
-         << "    margin-left: 0.5rem;"
-         << "  }"
-         << "}"
-         << "</style></head><body>";
-
-    // Header with navigation buttons
-    html << "<header>"
-         << "  <div class=\"navigation\">"
-         << "    <button class=\"nav-button\" onclick=\"history.back()\">"
-         << "      <svg viewBox=\"0 0 24 24\"><path d=\"M20,11V13H8L13.5,18.5L12.08,19.92L4.16,12L12.08,4.08L13.5,5.5L8,11H20Z\"></path></svg>"
-         << "    </button>"
-         << "    <button class=\"nav-button\" onclick=\"history.forward()\">"
-         << "      <svg viewBox=\"0 0 24 24\"><path d=\"M4,11V13H16L10.5,18.5L11.92,19.92L19.84,12L11.92,4.08L10.5,5.5L16,11H4Z\"></path></svg>"
-         << "    </button>"
-         << "  </div>"
-         << "  <div class=\"breadcrumb\">";
+void uringClose(UringLoop& loop, Connection& conn) {
+}
 
-    // Build breadcrumb navigation
-    std::string currentPath = "";
-    std::vector<std::string> pathParts;
-    std::string pathCopy = path;
-    
-    // Handle root directory
-    if (path == "." || path == "./") {
-        html << "<a href=\"/\" class=\"breadcrumb-item active\">"
-             << "  <svg style=\"width:20px;height:20px;margin-right:4px;\" viewBox=\"0 0 24 24\">"
-             << "    <path fill=\"currentColor\" d=\"M10,20V14H14V20H19V12H22L12,3L2,12H5V20H10Z\" />"
-             << "  </svg>"
-             << "  Root"
-             << "</a>";
-    } else {
-        html << "<a href=\"/\" class=\"breadcrumb-item\">"
-             << "  <svg style=\"width:20px;height:20px;margin-right:4px;\" viewBox=\"0 0 24 24\">"
-             << "    <path fill=\"currentColor\" d=\"M10,20V14H14V20H19V12H22L12,3L2,12H5V20H10Z\" />"
-             << "  </svg>"
-             << "  Root"
-             << "</a>"
-             << "<span class=\"breadcrumb-separator\">/</span>";
-        
-        // Split path into parts
-        if (pathCopy.front() == '.') pathCopy = pathCopy.substr(1);
-        if (pathCopy.front() == '/') pathCopy = pathCopy.substr(1);
-        if (pathCopy.back() == '/') pathCopy = pathCopy.substr(0, pathCopy.size() - 1);
-        
-        std::istringstream pathStream(pathCopy);
-        std::string part;
-        while (std::getline(pathStream, part, '/')) {
-            if (!part.empty()) {
-                pathParts.push_back(part);
-            }
+void uringSend(UringLoop& loop, Connection& conn) {
+}
+
+void uringStopAccepting(UringLoop& loop) {
+}
+
+void uringResume(UringLoop& loop, Connection& conn) {
+}
+
+void uringWatchUpstream(UringLoop& loop, UpstreamConn& up, bool readable, bool writable) {
+}
+
+void uringForgetUpstream(UringLoop& loop, UpstreamConn& up) {
+}
+
+bool runUringLoop(Worker& worker) {
+    return false;
+}
+#endif
+
+void runEpollLoop(Worker& worker) {
+    epoll_event events[MAX_EVENTS];
+    time_t lastSweep = t_now;
+    
+    while (g_running) {
+        int n = epoll_wait(worker.epollFd, events, MAX_EVENTS, 1000);
+        t_now = monotonicSeconds();
+        worker.passStart = monotonicMicros();
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log(LogLevel::ERROR, "epoll_wait failed: " + std::string(strerror(errno)));
+            break;
         }
         
-        // Build breadcrumb items
-        for (size_t i = 0; i < pathParts.size(); ++i) {
-            currentPath += "/" + pathParts[i];
-            bool isLast = (i == pathParts.size() - 1);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            uint32_t what = events[i].events;
+            
+            if (fd == worker.listenFd) {
+                acceptConnections(worker);
+                continue;
+            }
+            if (fd == worker.wakeFd) {
+                uint64_t value;
+                ssize_t ignored = read(worker.wakeFd, &value, sizeof(value));
+                (void)ignored;
+                resumeRequests(worker);
+                continue;
+            }
             
-            html << "<a href=\"" << currentPath << "\" class=\"breadcrumb-item " << (isLast ? "active" : "") << "\">"
-                 << pathParts[i]
-                 << "</a>";
+            Connection* conn = (size_t)fd < worker.conns.size() ? worker.conns[fd].get() : nullptr;
+            if (!conn) {
+                if ((size_t)fd < worker.upstreams.size() && worker.upstreams[fd]) upstreamEvent(worker, fd);
+                continue;
+            }
             
-            if (!isLast) {
-                html << "<span class=\"breadcrumb-separator\">/</span>";
-            }
-        }
-    }
-    
-    html << "  </div>"
-         << "  <div class=\"view-options\">"
-         << "    <button class=\"nav-button\" title=\"Grid View\">"
-         << "      <svg viewBox=\"0 0 24 24\"><path d=\"M3,3H11V11H3V3M3,13H11V21H3V13M13,3H21V11H13V3M13,13H21V21H13V13Z\"></path></svg>"
-         << "    </button>"
-         << "    <button class=\"nav-button\" title=\"List View\">"
-         << "      <svg viewBox=\"0 0 24 24\"><path d=\"M3,4H21V8H3V4M3,10H21V14H3V10M3,16H21V20H3V16Z\"></path></svg>"
-         << "    </button>"
-         << "  </div>"
-         << "</header>"
-         << "<div class=\"container\">";
-    
-    // Show warning banner if no index.html exists
-    if (!fs::exists("./index.html") && !fs::exists("./index.htm")) {
-        html << "<div class=\"warning-banner\">"
-             << "  <h3>"
-             << "    <svg style=\"width:24px;height:24px\" viewBox=\"0 0 24 24\">"
-             << "      <path fill=\"currentColor\" d=\"M13,13H11V7H13M13,17H11V15H13M12,2A10,10 0 0,0 2,12A10,10 0 0,0 12,22A10,10 0 0,0 22,12A10,10 0 0,0 12,2Z\" />"
-             << "    </svg>"
-             << "    MTWS Explorer Component"
-             << "  </h3>"
-             << "  <p>This is the built-in file explorer of My Tiny Web Server.</p>"
-             << "  <p>No index.html or index.htm file was found in this directory.</p>"
-             << "</div>";
-    }
-    
-    html << "<div class=\"explorer\">"
-         << "  <div class=\"explorer-body\">"
-         << "    <div class=\"file-grid\">";
-
-    // Add parent directory link if not in root
-    if (path != "." && path != "./") {
-        html << "<a href=\"..\" class=\"file-item\">"
-             << "  <div class=\"file-icon\">"
-             << "    <svg viewBox=\"0 0 24 24\">"
-             << "      <path fill=\"#8a85ff\" d=\"M20,18H4V8H20M20,6H12L10,4H4C2.89,4 2,4.89 2,6V18A2,2 0 0,0 4,20H20A2,2 0 0,0 22,18V8C22,6.89 21.1,6 20,6Z\" />"
-             << "    </svg>"
-             << "  </div>"
-             << "  <div class=\"file-name\">..</div>"
-             << "</a>";
-    }
-
-    // Sort entries: directories first, then files
-    std::vector<fs::directory_entry> dirs;
-    std::vector<fs::directory_entry> files;
-    
-    for (const auto& entry : fs::directory_iterator(path)) {
-        if (fs::is_directory(entry)) {
-            dirs.push_back(entry);
-        } else {
-            files.push_back(entry);
+            bool keep = true;
+            if (what & (EPOLLERR | EPOLLHUP)) {
+                keep = false;
+            } else {
+                if (what & (EPOLLIN | EPOLLRDHUP)) keep = readConnection(*conn);
+                if (keep && (what & EPOLLOUT)) keep = writeConnection(*conn);
+            }
+            if (!keep) closeConnection(worker, fd);
+            else armTimeout(worker, *conn);
         }
-    }
-    
-    // Add directories
-    for (const auto& entry : dirs) {
-        std::string name = entry.path().filename().string();
+        worker.lastPass = monotonicMicros() - worker.passStart;
         
-        html << "<a href=\"" << name << "\" class=\"file-item\">"
-             << "  <div class=\"file-icon\">"
-             << "    <svg viewBox=\"0 0 24 24\">"
-             << "      <path fill=\"#8a85ff\" d=\"M20,18H4V8H20M20,6H12L10,4H4C2.89,4 2,4.89 2,6V18A2,2 0 0,0 4,20H20A2,2 0 0,0 22,18V8C22,6.89 21.1,6 20,6Z\" />"
-             << "    </svg>"
-             << "  </div>"
-             << "  <div class=\"file-name\">" << name << "</div>"
-             << "</a>";
+        if (t_now != lastSweep) {
+            lastSweep = t_now;
+            expireConnections(worker);
+        }
+        if (g_draining && drainWorker(worker)) break;
     }
     
-    // Add files
-    for (const auto& entry : files) {
-        std::string name = entry.path().filename().string();
-        std::string iconColor;
-        std::string iconSvg = getFileIconSvg(name, iconColor);
-        
-        html << "<a href=\"" << name << "\" class=\"file-item\">"
-             << "  <div class=\"file-icon\">"
-             << "    <svg viewBox=\"0 0 24 24\">"
-             << "      <path fill=\"" << iconColor << "\" d=\"" << iconSvg << "\" />"
-             << "    </svg>"
-             << "  </div>"
-             << "  <div class=\"file-name\">" << name << "</div>"
-             << "</a>";
+    for (auto& conn : worker.conns) {
+        if (conn) {
+            cancelIo(*conn);
+            abortProxy(worker, *conn);
+            close(conn->fd);
+            if (conn->pipe[0] >= 0) {
+                close(conn->pipe[0]);
+                close(conn->pipe[1]);
+            }
+            bump(t_metrics->connectionsClosed);
+        }
     }
-    
-    html << "    </div>"
-         << "  </div>"
-         << "</div>"
-         << "<div class=\"footer\">"
-         << "  Powered by My Tiny Web Server (MTWS)"
-         << "</div>"
-         << "</div></body></html>";
-    
-    return html.str();
-}
-
-bool checkPortAvailable(int port) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return false;
-    
-    sockaddr_in address{};
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    
-    int result = bind(sock, (struct sockaddr*)&address, sizeof(address));
-    close(sock);
-    
-    return result >= 0;
+    worker.conns.clear();
+    closeUpstreams(worker);
 }
 
-bool tryStartServer(int port, int& server_fd) {
-    sockaddr_in address{};
-    int opt = 1;
-
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        return false;
+void runWorker(Worker& worker) {
+    if (worker.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker.cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            log(LogLevel::WARN, "Could not pin worker " + std::to_string(worker.id) + " to CPU " + std::to_string(worker.cpu));
+        }
     }
     
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        close(server_fd);
-        return false;
+    t_metrics = &g_metrics[worker.id];
+    t_workerId = worker.id;
+    t_worker = &worker;
+    worker.idleUpstreams.assign(g_upstreams.size(), {});
+    int seen = g_metricsWorkers.load();
+    while (seen <= worker.id && !g_metricsWorkers.compare_exchange_weak(seen, worker.id + 1)) {
     }
+    
+    t_now = monotonicSeconds();
+    worker.timers.start(t_now);
+    if (!g_ioUring || !runUringLoop(worker)) runEpollLoop(worker);
+    t_metrics->acceptQueue.store(0, std::memory_order_relaxed);
+}
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-
-    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-        close(server_fd);
-        return false;
+// CPUs this process may run on, in ascending order
+std::vector<int> availableCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
     }
-    
-    return true;
+    if (cpus.empty()) cpus.push_back(0);
+    return cpus;
 }
 
-// Function to get the server's IP address
-std::string getLocalIP() {
-    char hostbuffer[256];
-    if (gethostname(hostbuffer, sizeof(hostbuffer)) != 0) {
-        return "127.0.0.1";
+// Steer each new connection to the listener whose worker is pinned to the CPU that received it
+void attachCpuSteering(int listen_fd, const std::vector<Worker>& workers) {
+    std::vector<sock_filter> code;
+    code.push_back({BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)});
+    for (const auto& worker : workers) {
+        code.push_back({BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (uint32_t)worker.cpu});
+        code.push_back({BPF_RET | BPF_K, 0, 0, (uint32_t)worker.id});
     }
+    code.push_back({BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)workers.size()});
+    code.push_back({BPF_RET | BPF_A, 0, 0, 0});
     
-    struct hostent* host_entry = gethostbyname(hostbuffer);
-    if (host_entry == nullptr) {
-        return "127.0.0.1";
+    sock_fprog prog{};
+    prog.len = code.size();
+    prog.filter = code.data();
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        log(LogLevel::WARN, "Could not attach CPU steering program: " + std::string(strerror(errno)));
     }
-    
-    char* ip = inet_ntoa(*((struct in_addr*)host_entry->h_addr_list[0]));
-    return std::string(ip);
 }
 
 // Console input handler
 void consoleHandler() {
     while (g_running) {
-        std::cout << "\033[32mMTWS> \033[0m";
+        flushLogs(); // so the prompt comes after everything logged so far
+        std::cout << "\033[32mMTWS> \033[0m" << std::flush;
         std::string command;
         std::getline(std::cin, command);
         
@@ -589,48 +6168,74 @@ void consoleHandler() {
             log(LogLevel::INFO, "Server shutdown requested via console");
             g_running = false;
             g_cv.notify_all();
+            wakeServer();
             break;
         } else if (command == "ip") {
             std::string ip = getLocalIP();
             log(LogLevel::INFO, "Server running at http://" + ip + ":" + std::to_string(g_port));
+        } else if (command == "stats") {
+            logStats();
+        } else if (command == "cache") {
+            logCacheStats();
+        } else if (command == "cache clear") {
+            cacheClear();
+            log(LogLevel::INFO, "File cache cleared");
         } else if (command == "plugins") {
-            if (g_plugins.empty()) {
+            std::shared_ptr<const PluginTable> table = std::atomic_load(&g_pluginTable);
+            if (table->plugins.empty()) {
                 log(LogLevel::INFO, "No plugins loaded");
             } else {
                 log(LogLevel::INFO, "Active plugins:");
-                for (const auto& plugin : g_plugins) {
-                    log(LogLevel::INFO, "  - " + plugin);
+                for (const auto& plugin : table->plugins) {
+                    log(LogLevel::INFO, "  - " + plugin->name + ": " + plugin->prefix + " (" + plugin->file + ")");
                 }
             }
+        } else if (command.substr(0, 13) == "plugins load ") {
+            std::istringstream words(command.substr(13));
+            std::string file, prefix;
+            words >> file >> prefix;
+            loadPlugin(file, prefix);
+        } else if (command.substr(0, 15) == "plugins reload ") {
+            std::string pluginName = command.substr(15);
+            std::shared_ptr<const PluginTable> table = std::atomic_load(&g_pluginTable);
+            auto it = std::find_if(table->plugins.begin(), table->plugins.end(), [&](const auto& plugin) { return plugin->name == pluginName; });
+            if (it == table->plugins.end()) {
+                log(LogLevel::ERROR, "Plugin '" + pluginName + "' not found");
+            } else {
+                loadPlugin((*it)->file, (*it)->mount);
+            }
         } else if (command.substr(0, 13) == "plugins stop ") {
             std::string pluginName = command.substr(13);
-            bool found = false;
-            for (auto it = g_plugins.begin(); it != g_plugins.end(); ++it) {
-                if (*it == pluginName) {
-                    g_plugins.erase(it);
-                    log(LogLevel::INFO, "Plugin '" + pluginName + "' stopped");
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
+            if (stopPlugin(pluginName)) {
+                log(LogLevel::INFO, "Plugin '" + pluginName + "' stopped");
+            } else {
                 log(LogLevel::ERROR, "Plugin '" + pluginName + "' not found");
             }
         } else if (command == "restart") {
-            log(LogLevel::INFO, "Server restart requested");
+            log(LogLevel::INFO, "Server restart requested; finishing open requests first");
             g_restart = true;
-            g_running = false;
+            g_draining = true;
+            g_cv.notify_all();
+            wakeServer();
+            break;
+        } else if (command == "upgrade") {
+            log(LogLevel::INFO, "Upgrade requested; finishing open requests, then starting " + g_executable);
+            g_restart = true;
+            g_upgrade = true;
+            g_draining = true;
             g_cv.notify_all();
+            wakeServer();
             break;
         } else if (command == "restart --force") {
             log(LogLevel::INFO, "Server force restart requested");
             g_restart = true;
             g_running = false;
             g_cv.notify_all();
+            wakeServer();
             break;
         } else if (!command.empty()) {
             log(LogLevel::ERROR, "Unknown command: " + command);
-            log(LogLevel::INFO, "Available commands: ip, stop, plugins, plugins stop <plugin>, restart, restart --force");
+            log(LogLevel::INFO, "Available commands: ip, stop, stats, cache, cache clear, plugins, plugins load <file> [prefix], plugins reload <plugin>, plugins stop <plugin>, restart, restart --force, upgrade");
         }
     }
 }
@@ -638,159 +6243,181 @@ void consoleHandler() {
 // Server main function
 void runServer(int port) {
     g_port = port;
-    int server_fd;
     
-    if (!tryStartServer(port, server_fd)) {
-        log(LogLevel::FATAL, "Failed to start server on port " + std::to_string(port));
-        return;
+    int count = g_workerCount;
+    if (count <= 0) count = availableCpus().size();
+    if (count > MAX_WORKERS) count = MAX_WORKERS;
+    std::vector<int> cpus = availableCpus();
+    
+    // Listeners are created in worker order so reuseport group index == worker id. They outlive restarts,
+    // so connections that arrive in between wait in their queues instead of being refused.
+    // An upgrade may hand over more than are needed now; nobody would accept from the extra ones.
+    while ((int)g_listenFds.size() > count) {
+        close(g_listenFds.back());
+        g_listenFds.pop_back();
+    }
+    std::vector<Worker> workers(count);
+    for (int i = 0; i < count; i++) {
+        Worker& worker = workers[i];
+        worker.id = i;
+        if (g_pinWorkers) worker.cpu = cpus[i % cpus.size()];
+        
+        if (i < (int)g_listenFds.size()) {
+            worker.listenFd = g_listenFds[i];
+        } else {
+            if (!tryStartServer(port, worker.listenFd, worker.cpu)) {
+                log(LogLevel::FATAL, "Failed to start server on port " + std::to_string(port));
+                return;
+            }
+            if (listen(worker.listenFd, g_listenBacklog) < 0) {
+                log(LogLevel::FATAL, "Listen failed on port " + std::to_string(port));
+                return;
+            }
+            g_listenFds.push_back(worker.listenFd);
+        }
+        int flags = fcntl(worker.listenFd, F_GETFL, 0);
+        fcntl(worker.listenFd, F_SETFL, flags | O_NONBLOCK);
+        
+        if (i >= g_wakeFdCount) {
+            g_wakeFds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (g_wakeFds[i] >= 0) g_wakeFdCount = i + 1;
+        }
+        worker.epollFd = epoll_create1(EPOLL_CLOEXEC);
+        worker.wakeFd = i < g_wakeFdCount ? g_wakeFds[i] : -1;
+        if (worker.epollFd < 0 || worker.wakeFd < 0) {
+            log(LogLevel::FATAL, "Failed to create event loop");
+            return;
+        }
+        
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = worker.listenFd;
+        epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, worker.listenFd, &ev);
+        ev.data.fd = worker.wakeFd;
+        epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, worker.wakeFd, &ev);
+        
+        std::lock_guard<std::mutex> lock(g_completions[i].mutex);
+        g_completions[i].wakeFd = worker.wakeFd;
+    }
+    
+    if (g_pinWorkers && (size_t)count == cpus.size()) {
+        attachCpuSteering(workers[0].listenFd, workers);
+    }
+    
+    std::string reason;
+    if (g_ioUring && !uringSupported(reason)) {
+        log(LogLevel::WARN, "io_uring is not available (" + reason + "); using epoll");
+        g_ioUring = false;
     }
     
     // Check for index.html at startup
-    if (!fs::exists("./index.html") && !fs::exists("./index.htm")) {
+    if (!g_upstreams.empty()) {
+        log(LogLevel::INFO, "Forwarding requests for paths not on disk to " + std::to_string(g_upstreams.size()) + 
+                            (g_upstreams.size() == 1 ? " upstream" : " upstreams"));
+    } else if (!fs::exists("./index.html") && !fs::exists("./index.htm")) {
         log(LogLevel::WARN, "No 'index.html' in this directory found; explorer will be shown instead");
     }
     
     std::string ip = getLocalIP();
-    log(LogLevel::INFO, "Server started on port " + std::to_string(port));
+    log(LogLevel::INFO, "Server started on port " + std::to_string(port) + " with " + std::to_string(count) + 
+                        (count == 1 ? " worker" : " workers") + (g_pinWorkers ? " (pinned)" : "") +
+                        (g_ioUring ? " using io_uring" : ""));
     log(LogLevel::INFO, "Go to http://" + ip + ":" + std::to_string(port));
     
     // Start console handler in a separate thread
     std::thread consoleThread(consoleHandler);
     consoleThread.detach();
     
-    while (g_running) {
-        // Set socket to non-blocking mode to allow checking g_running
-        int flags = fcntl(server_fd, F_GETFL, 0);
-        fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
-        
-        if (listen(server_fd, 10) < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                log(LogLevel::ERROR, "Listen failed");
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
-        }
-        
-        sockaddr_in client;
-        socklen_t client_len = sizeof(client);
-        int client_fd = accept(server_fd, (struct sockaddr*)&client, &client_len);
-        
-        if (client_fd < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                log(LogLevel::ERROR, "Accept failed");
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
-        }
-        
-        // Set client socket back to blocking mode for read/write
-        flags = fcntl(client_fd, F_GETFL, 0);
-        fcntl(client_fd, F_SETFL, flags & ~O_NONBLOCK);
-        
-        char buffer[4096] = {0};
-        ssize_t bytes_read = read(client_fd, buffer, 4096);
-        
-        if (bytes_read <= 0) {
-            close(client_fd);
-            continue;
+    std::vector<std::thread> threads;
+    for (int i = 1; i < count; i++) {
+        threads.emplace_back(runWorker, std::ref(workers[i]));
+    }
+    runWorker(workers[0]);
+    if (g_shutdownSignalled.exchange(false)) {
+        log(LogLevel::INFO, "Received shutdown signal. Shutting down gracefully...");
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    
+    for (auto& worker : workers) {
+        {
+            // Jobs that finish from now on have nobody to report to
+            std::lock_guard<std::mutex> lock(g_completions[worker.id].mutex);
+            g_completions[worker.id].wakeFd = -1;
+            g_completions[worker.id].done.clear();
         }
-        
-        std::string request(buffer);
+        close(worker.epollFd);
+    }
+    if (!g_restart) {
+        for (int fd : g_listenFds) close(fd);
+        g_listenFds.clear();
+    }
+    log(LogLevel::INFO, "Server stopped");
+}
 
-        std::smatch match;
-        std::regex_search(request, match, std::regex("GET (/[^ ]*)"));
-        std::string path = match.size() > 1 ? match[1].str() : "/";
+// Take over the listening sockets of the binary this one replaced (see upgradeServer)
+void adoptListeners(int port) {
+    const char* value = getenv(LISTEN_FDS_ENV);
+    if (!value) return;
+    std::string list = value;
+    unsetenv(LISTEN_FDS_ENV);
+    
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+        int fd = atoi(list.substr(start, end - start).c_str());
+        start = end + 1;
         
-        // URL decode the path
-        std::string decoded_path;
-        for (size_t i = 0; i < path.length(); ++i) {
-            if (path[i] == '%' && i + 2 < path.length()) {
-                int value;
-                std::istringstream is(path.substr(i + 1, 2));
-                if (is >> std::hex >> value) {
-                    decoded_path += static_cast<char>(value);
-                    i += 2;
-                } else {
-                    decoded_path += path[i];
-                }
-            } else if (path[i] == '+') {
-                decoded_path += ' ';
-            } else {
-                decoded_path += path[i];
-            }
+        sockaddr_in address{};
+        socklen_t length = sizeof(address);
+        int listening = 0;
+        socklen_t optionLength = sizeof(listening);
+        if (fd > 2 && getsockname(fd, (sockaddr*)&address, &length) == 0 && address.sin_family == AF_INET && 
+            ntohs(address.sin_port) == port && getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optionLength) == 0 && listening) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            g_listenFds.push_back(fd);
+        } else if (fd > 2) {
+            close(fd); // not for this port (the command line changed), or not a listening socket
         }
-        path = decoded_path;
-        
-        if (path == "/") path = "/index.html";
-
-        std::string filePath = "." + path;
-        std::string response;
+    }
+    if (!g_listenFds.empty()) {
+        log(LogLevel::INFO, "Took over " + std::to_string(g_listenFds.size()) + " listening socket" + 
+                            (g_listenFds.size() == 1 ? "" : "s") + " from the previous binary");
+    }
+}
 
-        if (fs::exists(filePath) && fs::is_regular_file(filePath)) {
-            // Serve the file
-            std::ifstream file(filePath, std::ios::binary);
-            if (!file) {
-                std::string errorMsg = "<h1>500 Internal Server Error</h1><p>Could not open file: " + path + "</p>";
-                response = "HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/html\r\nContent-Length: " + 
-                           std::to_string(errorMsg.size()) + "\r\n\r\n" + errorMsg;
-            } else {
-                std::ostringstream content;
-                content << file.rdbuf();
-                std::string body = content.str();
-                response = "HTTP/1.1 200 OK\r\nContent-Type: " + getMimeType(filePath) + 
-                           "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
-            }
-        } else if (fs::exists(filePath) && fs::is_directory(filePath)) {
-            // Check for index.html in the directory
-            std::string indexPath = filePath + "/index.html";
-            std::string indexPathHtm = filePath + "/index.htm";
-            
-            if (fs::exists(indexPath) && fs::is_regular_file(indexPath)) {
-                std::ifstream file(indexPath, std::ios::binary);
-                std::ostringstream content;
-                content << file.rdbuf();
-                std::string body = content.str();
-                response = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: " + 
-                           std::to_string(body.size()) + "\r\n\r\n" + body;
-            } else if (fs::exists(indexPathHtm) && fs::is_regular_file(indexPathHtm)) {
-                std::ifstream file(indexPathHtm, std::ios::binary);
-                std::ostringstream content;
-                content << file.rdbuf();
-                std::string body = content.str();
-                response = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: " + 
-                           std::to_string(body.size()) + "\r\n\r\n" + body;
-            } else {
-                // Generate directory listing
-                std::string body = generateExplorerHTML(filePath);
-                response = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: " + 
-                           std::to_string(body.size()) + "\r\n\r\n" + body;
-            }
-        } else {
-            if (path == "/index.html" || path == "/index.htm") {
-                std::string body = generateExplorerHTML(".");
-                response = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: " + 
-                           std::to_string(body.size()) + "\r\n\r\n" + body;
-            } else {
-                std::string notFound = "<html><head><title>404 Not Found</title><style>body{font-family:system-ui;background:#121212;color:#f0f0f0;display:flex;align-items:center;justify-content:center;height:100vh;margin:0;flex-direction:column;}.container{text-align:center;animation:fadeIn 0.5s ease-out;}h1{color:#ff5577;font-size:3rem;margin-bottom:1rem;}p{font-size:1.2rem;opacity:0.8;}@keyframes fadeIn{from{opacity:0;transform:translateY(-20px);}to{opacity:1;transform:translateY(0);}}</style></head><body><div class='container'><h1>404 Not Found</h1><p>The requested resource could not be found on this server.</p></div></body></html>";
-                response = "HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\nContent-Length: " + 
-                           std::to_string(notFound.size()) + "\r\n\r\n" + notFound;
-            }
-        }
-        
-        send(client_fd, response.c_str(), response.size(), 0);
-        close(client_fd);
+// Replace this process with the binary on disk, which may be a new version, passing on the listening
+// sockets. Only returns if that fails; the server then restarts in place.
+void upgradeServer(char* argv[]) {
+    std::string fds;
+    for (int fd : g_listenFds) {
+        fcntl(fd, F_SETFD, 0);
+        fds += (fds.empty() ? "" : ",") + std::to_string(fd);
     }
+    setenv(LISTEN_FDS_ENV, fds.c_str(), 1);
+    log(LogLevel::INFO, "Starting " + g_executable);
+    flushLogs();
+    execv(g_executable.c_str(), argv);
     
-    close(server_fd);
-    log(LogLevel::INFO, "Server stopped");
+    log(LogLevel::ERROR, "Could not start " + g_executable + ": " + strerror(errno) + "; restarting in place");
+    unsetenv(LISTEN_FDS_ENV);
+    for (int fd : g_listenFds) fcntl(fd, F_SETFD, FD_CLOEXEC);
 }
 
 int main(int argc, char* argv[]) {
     // Register signal handler for Ctrl+C
     signal(SIGINT, signalHandler);
+    // splice() and sendfile() have no MSG_NOSIGNAL; a client that went away is seen as EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    startLogging();
     
     int port = 80;
     bool port_specified = false;
+    std::vector<std::pair<std::string, std::string>> plugins; // file and optional prefix
+    std::string mimeTypes = "/etc/mime.types";
+    bool mimeTypesSpecified = false;
     
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -807,26 +6434,205 @@ int main(int argc, char* argv[]) {
             } else {
                 log(LogLevel::FATAL, "Port flag (-p) used but no port specified");
             }
+        } else if (arg == "-w" || arg == "--workers") {
+            if (i + 1 < argc) {
+                std::string value = argv[++i];
+                if (value == "auto") {
+                    g_workerCount = 0;
+                } else {
+                    try {
+                        g_workerCount = std::stoi(value);
+                    } catch (const std::exception& e) {
+                        g_workerCount = -1;
+                    }
+                    if (g_workerCount < 1 || g_workerCount > MAX_WORKERS) {
+                        log(LogLevel::FATAL, "Invalid worker count specified");
+                    }
+                }
+            } else {
+                log(LogLevel::FATAL, "Workers flag (" + arg + ") used but no count specified");
+            }
+        } else if (arg == "--pin") {
+            g_pinWorkers = true;
+        } else if (arg == "--io-engine") {
+            std::string engine = i + 1 < argc ? argv[++i] : "";
+            if (engine != "epoll" && engine != "io_uring") {
+                log(LogLevel::FATAL, "I/O engine must be 'epoll' or 'io_uring'");
+            }
+            g_ioUring = engine == "io_uring";
+        } else if (arg == "--cache-size" || arg == "--cache-entries") {
+            if (i + 1 < argc) {
+                long long value = -1;
+                try {
+                    value = std::stoll(argv[++i]);
+                } catch (const std::exception& e) {
+                }
+                if (value < 0) {
+                    log(LogLevel::FATAL, "Invalid value for " + arg);
+                }
+                if (arg == "--cache-size") g_cacheMaxBytes = value * 1024 * 1024;
+                else g_cacheMaxEntries = value;
+            } else {
+                log(LogLevel::FATAL, "Flag " + arg + " used but no value specified");
+            }
+        } else if (arg == "--compress-cache" || arg == "--compress-threads") {
+            if (i + 1 < argc) {
+                long long value = -1;
+                try {
+                    value = std::stoll(argv[++i]);
+                } catch (const std::exception& e) {
+                }
+                if (value < 0 || (arg == "--compress-threads" && value > 64)) {
+                    log(LogLevel::FATAL, "Invalid value for " + arg);
+                }
+                if (arg == "--compress-cache") g_variantCacheBytes = value * 1024 * 1024;
+                else g_compressThreads = value;
+            } else {
+                log(LogLevel::FATAL, "Flag " + arg + " used but no value specified");
+            }
+        } else if (arg == "--io-threads") {
+            int value = -1;
+            if (i + 1 < argc) {
+                try {
+                    value = std::stoi(argv[++i]);
+                } catch (const std::exception& e) {
+                }
+            }
+            if (value < 0 || value > 256) {
+                log(LogLevel::FATAL, "Invalid value for --io-threads");
+            }
+            g_ioThreads = value;
+        } else if (arg == "--access-log") {
+            if (i + 1 >= argc) {
+                log(LogLevel::FATAL, "Access log flag used but no file specified");
+            }
+            std::string path = argv[++i];
+            g_accessLogFd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (g_accessLogFd < 0) {
+                log(LogLevel::FATAL, "Could not open access log " + path + ": " + strerror(errno));
+            }
+        } else if (arg == "--access-log-format") {
+            std::string format = i + 1 < argc ? argv[++i] : "";
+            if (format != "common" && format != "combined") {
+                log(LogLevel::FATAL, "Access log format must be 'common' or 'combined'");
+            }
+            g_accessLogCombined = format == "combined";
+        } else if (arg == "--cache-control") {
+            std::string rule = i + 1 < argc ? argv[++i] : "";
+            size_t equals = rule.find('=');
+            if (equals == std::string::npos || equals == 0) {
+                log(LogLevel::FATAL, "Cache-Control rules look like --cache-control '<pattern>=<value>'");
+            }
+            g_cacheControlRules.emplace_back(rule.substr(0, equals), rule.substr(equals + 1));
+        } else if (arg == "--plugin") {
+            if (i + 1 >= argc) {
+                log(LogLevel::FATAL, "Plugin flag used but no file specified");
+            }
+            std::string plugin = argv[++i];
+            size_t equals = plugin.find('=');
+            if (equals == std::string::npos) plugins.emplace_back(plugin, "");
+            else plugins.emplace_back(plugin.substr(0, equals), plugin.substr(equals + 1));
+        } else if (arg == "--mime-types") {
+            if (i + 1 >= argc) {
+                log(LogLevel::FATAL, "MIME types flag used but no file specified");
+            }
+            mimeTypes = argv[++i];
+            mimeTypesSpecified = true;
+        } else if (arg == "--proxy") {
+            if (i + 1 >= argc) {
+                log(LogLevel::FATAL, "Proxy flag used but no upstream specified");
+            }
+            std::string upstream = argv[++i];
+            if (!addUpstream(upstream)) {
+                log(LogLevel::FATAL, "Could not resolve upstream " + upstream + " (use host:port, [v6]:port or unix:/path)");
+            }
+        } else if (arg == "--proxy-balance") {
+            std::string balance = i + 1 < argc ? argv[++i] : "";
+            if (balance != "round-robin" && balance != "least-conn") {
+                log(LogLevel::FATAL, "Proxy balancing must be 'round-robin' or 'least-conn'");
+            }
+            g_proxyLeastConnections = balance == "least-conn";
+        } else if (arg == "--max-connections-per-ip" || arg == "--rate-limit" || arg == "--rate-burst" || 
+                   arg == "--overload-lag" || arg == "--overload-queue") {
+            if (i + 1 < argc) {
+                int value = -1;
+                try {
+                    value = std::stoi(argv[++i]);
+                } catch (const std::exception& e) {
+                }
+                if (value < 0 || (arg == "--rate-limit" && value > 1000000)) {
+                    log(LogLevel::FATAL, "Invalid value for " + arg);
+                }
+                if (arg == "--overload-queue") g_overloadQueue = value;
+                else (arg == "--max-connections-per-ip" ? g_maxClientConnections : arg == "--rate-limit" ? g_rateLimit : 
+                      arg == "--rate-burst" ? g_rateBurst : g_overloadLag) = value;
+            } else {
+                log(LogLevel::FATAL, "Flag " + arg + " used but no value specified");
+            }
+        } else if (arg == "--keepalive-timeout" || arg == "--header-timeout" || arg == "--body-timeout" || 
+                   arg == "--send-timeout" || arg == "--drain-timeout" || arg == "--proxy-timeout" || 
+                   arg == "--max-requests" || arg == "--backlog") {
+            if (i + 1 < argc) {
+                int value = -1;
+                try {
+                    value = std::stoi(argv[++i]);
+                } catch (const std::exception& e) {
+                }
+                if (value < 1) {
+                    log(LogLevel::FATAL, "Invalid value for " + arg);
+                }
+                (arg == "--keepalive-timeout" ? g_keepAliveTimeout : arg == "--header-timeout" ? g_headerTimeout : 
+                 arg == "--body-timeout" ? g_bodyTimeout : arg == "--send-timeout" ? g_sendTimeout : 
+                 arg == "--drain-timeout" ? g_drainTimeout : arg == "--proxy-timeout" ? g_proxyTimeout : 
+                 arg == "--backlog" ? g_listenBacklog : g_maxKeepAliveRequests) = value;
+            } else {
+                log(LogLevel::FATAL, "Flag " + arg + " used but no value specified");
+            }
         }
     }
     
+    // The path is resolved now: once the file is replaced, /proc/self/exe names the old, deleted one
+    char executable[PATH_MAX];
+    ssize_t executableLength = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+    g_executable = executableLength > 0 ? std::string(executable, executableLength) : std::string(argv[0]);
+    adoptListeners(port);
+    
     // Check if the specified port is available
-    if (port_specified && !checkPortAvailable(port)) {
+    if (port_specified && g_listenFds.empty() && !checkPortAvailable(port)) {
         log(LogLevel::FATAL, "Port " + std::to_string(port) + " is already in use or unavailable");
     }
     
+    // Types the built-in table does not know come from the system's list; a missing one is fine unless asked for
+    if (!g_mimeTypes.load(mimeTypes) && mimeTypesSpecified) {
+        log(LogLevel::FATAL, "Could not read MIME types from " + mimeTypes);
+    }
+    
+    prepareResponses();
+    g_rootFd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (g_rootFd < 0) log(LogLevel::FATAL, std::string("Could not open the web root: ") + strerror(errno));
+    startFileCache();
+    startCompression();
+    startIoPool();
+    for (const auto& plugin : plugins) {
+        if (!loadPlugin(plugin.first, plugin.second)) {
+            log(LogLevel::FATAL, "Could not start plugin " + plugin.first);
+        }
+    }
+    
     // Main server loop with restart capability
     do {
         g_running = true;
         g_restart = false;
+        g_draining = false;
         
         runServer(port);
         
+        if (g_upgrade.exchange(false)) upgradeServer(argv);
         if (g_restart) {
             log(LogLevel::INFO, "Restarting server...");
-            std::this_thread::sleep_for(std::chrono::seconds(1));
         }
     } while (g_restart);
     
+    flushLogs();
     return 0;
 }
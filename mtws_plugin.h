@@ -0,0 +1,89 @@
+// mtws_plugin.h – Plugin interface of My Tiny Web Server
+// By Jamie / RGBToaster
+//
+// A plugin is a shared library that exports mtws_plugin_entry(). It answers every request whose path
+// starts with its prefix, on the worker thread that received the request, so handlers must be
+// thread-safe and should not block. Build one with:
+//
+//     gcc -shared -fPIC -O2 -o hello.so hello.c
+//
+// and load it with "--plugin ./hello.so" or the console command "plugins load ./hello.so".
+
+#ifndef MTWS_PLUGIN_H
+#define MTWS_PLUGIN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bumped whenever a struct below changes; plugins built against another version are refused
+#define MTWS_PLUGIN_ABI 1
+
+// Return values of handle()
+#define MTWS_HANDLED 0    // the response is complete
+#define MTWS_DECLINED 1   // not for this plugin after all; the request is served from the web root
+#define MTWS_ERROR (-1)   // anything written is dropped and the client gets a 500
+
+#define MTWS_LOG_INFO 0
+#define MTWS_LOG_WARN 1
+#define MTWS_LOG_ERROR 2
+
+// Not NUL-terminated. Only valid during the handle() call.
+typedef struct {
+    const char* data;
+    size_t size;
+} mtws_string;
+
+typedef struct {
+    mtws_string name;
+    mtws_string value;
+} mtws_header;
+
+// A view of the parsed request; nothing is copied
+typedef struct {
+    mtws_string method;
+    mtws_string target;          // as sent, e.g. "/api/items?id=3"
+    mtws_string path;            // percent-decoded and normalized, without the query
+    mtws_string query;           // without the '?'
+    int http_minor;              // 0 for HTTP/1.0, 1 for HTTP/1.1
+    const mtws_header* headers;
+    size_t header_count;
+    mtws_string body;            // complete, at most 1 MB
+    mtws_string remote_address;  // e.g. "127.0.0.1"
+} mtws_request;
+
+// The answer being built; written straight into the connection's output
+typedef struct mtws_response mtws_response;
+
+// Functions the server offers to plugins
+typedef struct {
+    int abi;
+    void (*set_status)(mtws_response* response, int status);              // default 200
+    // Content-Type replaces the default "text/plain"; Content-Length and Connection are set by the server
+    void (*add_header)(mtws_response* response, const char* name, const char* value);
+    void (*write)(mtws_response* response, const void* data, size_t size);
+    void (*log)(int level, const char* message);
+} mtws_host;
+
+typedef struct {
+    int abi;                // MTWS_PLUGIN_ABI
+    const char* name;       // used by the console commands
+    const char* prefix;     // e.g. "/api/"; the longest matching prefix wins
+    // Optional. Called once after loading; whatever is stored in *state is passed to handle().
+    // Returning non-zero refuses the load.
+    int (*init)(const mtws_host* host, void** state);
+    int (*handle)(void* state, const mtws_request* request, mtws_response* response);
+    // Optional. Called once no request can reach the plugin any more, right before it is unloaded.
+    void (*shutdown)(void* state);
+} mtws_plugin;
+
+// The one symbol every plugin exports
+const mtws_plugin* mtws_plugin_entry(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif